@@ -1,16 +1,198 @@
 /* compile in macos:
- * gcc gd32up.c libserialport.a -o gd32up -framework IOKit -framework CoreFoundation */
+ * gcc gd32up.c libserialport.a -o gd32up -framework IOKit -framework CoreFoundation
+ * compile in linux:
+ * gcc gd32up.c libserialport.a -o gd32up */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <linux/usbdevice_fs.h>
+#endif
 
 #include "libserialport.h"
+#include "project/core/dsp.h"
 
 #define MAX_WAIT     600
 #define BLK_SIZE     0x100
+#define BAUDRATE     115200
+
+#define FLASH_BASE   0x08000000
+#define RAM_BASE     0x20000000
+#define RAM_SIZE     0x2000
+
+// uid is at 0x1ffff7ac and flash size (KB) at 0x1ffff7e0, one read gets both.
+#define INFO_ADDR    0x1ffff7ac
+#define INFO_SIZE    0x36
+
+// chip profiles are cached per uid, one line per chip.
+#define PROFILE_DB   ".gd32up_profiles"
+
+// benchmark modes of project/acm, the baud rate is BENCH_BAUD + mode.
+#define BENCH_BAUD       1000
+#define BENCH_LOOPBACK   0
+#define BENCH_SOURCE     1
+#define BENCH_SINK       2
+#define BENCH_PING       3
+#define BENCH_BLOCK      0x1000
+#define BENCH_LOOP_SIZE  0x200  // bytes per loopback round, OUT is NAKed while the device is full.
+#define BENCH_PACKET     64
+#define BENCH_PINGS      1000
+#define BENCH_MAX_GAP    0x10000    // a longer jump of the source sequence is a resync, not loss.
+
+// vendor port of project/acm2 (CDC_ACM_VENDOR_PORT), a bulk pair on interface 2
+// with the usart line coding set by vendor requests, read through usbfs.
+#define VENDOR_ITF       2
+#define VENDOR_IN_EP     0x84
+#define VENDOR_SET_LINE  0x20
+#define VENDOR_XFER      0x4000     // one bulk read, many packets
+#define VENDOR_TIMEOUT   100
+
+// vendor request of project/acm2 on interface 0, answers cdc_stats_struct,
+// wValue 1 clears it. the same block as the PROXY_STATS request.
+#define BRIDGE_GET_STATS 0x01
+
+// vendor request of project/daq, answers daq_stats_struct: core_hz, rate,
+// channels, block_samples, decimation, overrun, then count, cycles and max of
+// one block through the filters. wValue 1 clears them.
+#define DAQ_GET_STATS    0x01
+#define DAQ_STATS_SIZE   36
+
+// trigger of project/daq, daq_trigger_struct: mode, channel, level, high, pre
+// and post (le16 each). written with 0x02, read back with 0x03.
+#define DAQ_SET_TRIGGER  0x02
+#define DAQ_GET_TRIGGER  0x03
+#define DAQ_TRIGGER_SIZE 12
+
+// dspcheck runs the fixed point stages of project/core/dsp.h against double
+// models, with the project/daq defaults.
+#define DSP_CHECK_SAMPLES    0x8000
+#define DSP_CHECK_AVERAGE    3
+#define DSP_CHECK_CIC_ORDER  3
+#define DSP_CHECK_CIC_SHIFT  4
+#define DSP_CHECK_BIQUAD     3384, 6770, 3384, -6054, 3208
+
+// serial backends, termios is only available in linux.
+#define SP_BACKEND_LIBSP     0
+#define SP_BACKEND_TERMIOS   1
+#define SP_BACKEND_REPLAY    2
+
+// session log: header, then records of type, varint delta us, varint size, data.
+#define LOG_MAGIC    "GD32LOG1"
+#define LOG_TX       0
+#define LOG_RX       1
+#define LOG_TIMEOUT  2      // read returned short, no data.
+
+// bootloader proxy of project/acm2, entered by opening the bridge at the magic
+// baudrate. request: op, 0, len (le16), addr (le32), data. reply: status, op,
+// len (le16), data. the bridge runs whole pages against the chip by itself.
+#define PROXY_BAUD   1234
+#define PROXY_PAGE   0x400
+#define PROXY_XFER   0x58   // send data, return addr reply bytes.
+#define PROXY_WRITE  0x57
+#define PROXY_READ   0x52   // data is the le16 byte count.
+#define PROXY_ERASE  0x45   // addr is the erase command.
+#define PROXY_STATS  0x53   // bridge counters, addr 1 clears them.
+#define PROXY_RETRY  20     // reads of MAX_WAIT before a reply is given up.
+
+// serial sniffer of project/acm2, entered at the magic baudrate, a 7 byte write
+// (CDC line coding) sets the sniffed line. records: sync, flags, len (le16),
+// time (le32 us of the first start bit), data. CONT goes on with a burst.
+#define SNIFF_BAUD       4321
+#define SNIFF_SYNC       0xA5
+#define SNIFF_USART1     0x01
+#define SNIFF_CONT       0x02
+#define SNIFF_ERROR      0x04
+#define SNIFF_LOST       0x08
+#define SNIFF_MAX_REC    0x400      // a record never exceeds the ring of the bridge.
+#define SNIFF_MAX_BURST  0x10000    // longer bursts are split into more packets.
+#define PCAP_LINKTYPE    147        // LINKTYPE_USER0, the first byte is the record flags.
+
+// adc sample frames of project/adc2 and project/daq, see project/core/adc_frame.h.
+// sync, seq (le16), channel mask, flags, scans (le16), packed 12 bit samples,
+// crc16. RAW frames hold le16 samples and no crc.
+#define ADC_SYNC0        0xA5
+#define ADC_SYNC1        0x5A
+#define ADC_HEADER       8
+#define ADC_OVERRUN      0x01
+#define ADC_RAW          0x02
+#define ADC_START        0x04       // the source restarted, the capture does too.
+#define ADC_WIDE         0x08       // filtered 16 bit samples, the nibble check is off.
+#define ADC_TRIGGER      0x10       // a window around a trigger, frames are not back to back.
+#define ADC_BAUD         921600
+#define ADC_MAX_SAMPLES  0x8000     // a longer frame is taken as noise.
+#define ADC_LOST         0xff       // both bytes of the samples of a dropped frame.
+#define CAPTURE_GROW     0x100000
+
+struct log_record {
+    int type;
+    int size;
+    char *data;
+    long pos;               // tx bytes sent before this record.
+    long long delay;        // us since the last tx record.
+    long long ready;        // replay time the data shows up, 0 until armed.
+};
+
+struct log_replay {
+    struct log_record *recs;
+    int count;
+    int armed;              // records before this are armed.
+    int tx_rec, tx_off;     // next recorded tx byte to compare.
+    int rx_rec, rx_off;     // next recorded rx byte to return.
+    long tx_pos;
+    long mismatch;
+};
+
+struct gd32_profile {
+    char uid[25];
+    int pid;            // from get id command 0x02.
+    int version;        // bootloader version, 0x22 is v2.2.
+    int flash_kb;
+    int erase_cmd;      // 0x43 erase or 0x44 extended erase.
+};
+
+struct gd32_port {
+    struct sp_port *sp;
+    int backend;
+    struct gd32_profile prof;
+
+    // termios backend only, raw fd and current VMIN setting.
+    int fd;
+    int vmin;
+
+    // outgoing frames are built here and sent with one write.
+    char tx[BLK_SIZE + 16];
+    int tx_used;
+
+    // proxy mode, raw bootloader bytes wait here for the next xfer request.
+    int proxy;
+    char px[PROXY_PAGE + 16];
+    int px_used;
+
+    // transfer counters for the benchmark output.
+    long writes, reads, syscalls;
+
+    // session recording, time of the last record.
+    FILE *log;
+    long long log_time;
+    struct log_replay *replay;
+};
+
+int sp_backend = SP_BACKEND_LIBSP;
+int sp_pipeline = 0;
+int sp_boot = 0;
+int sp_proxy = 0;
+const char *sp_record = NULL;
+const char *sp_replay = NULL;
 
 void print_hex(const char *name, const char *buf, size_t count)
 {
@@ -21,24 +203,379 @@ void print_hex(const char *name, const char *buf, size_t count)
     printf("\n");
 }
 
-int sp_write(struct sp_port *port, const void *buf, size_t count)
+long long time_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifdef __linux__
+int termios_set_vmin(struct gd32_port *port, size_t count)
+{
+    struct termios tio;
+    int vmin = count > 255 ? 255 : count;
+
+    // every change costs one ioctl, so only touch it when it differs.
+    if (vmin == port->vmin)
+        return 0;
+    port->syscalls += 2;
+    if (tcgetattr(port->fd, &tio) < 0)
+        return -__LINE__;
+
+    // return once vmin bytes arrived, or 100ms after the last byte.
+    tio.c_cc[VMIN] = vmin;
+    tio.c_cc[VTIME] = 1;
+    if (tcsetattr(port->fd, TCSANOW, &tio) < 0)
+        return -__LINE__;
+
+    port->vmin = vmin;
+    return 0;
+}
+
+int termios_write(struct gd32_port *port, const void *buf, size_t count)
+{
+    size_t done = 0;
+    int n;
+
+    while (done < count) {
+        n = write(port->fd, (const char *)buf + done, count - done);
+        port->syscalls++;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+int termios_read(struct gd32_port *port, void *buf, size_t count)
+{
+    struct pollfd pfd;
+    size_t done = 0;
+    int n;
+
+    while (done < count) {
+        // VTIME only starts after the first byte, poll for the total wait.
+        pfd.fd = port->fd;
+        pfd.events = POLLIN;
+        port->syscalls++;
+        if (poll(&pfd, 1, MAX_WAIT) <= 0)
+            break;
+
+        termios_set_vmin(port, count - done);
+        n = read(port->fd, (char *)buf + done, count - done);
+        port->syscalls++;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+void termios_low_latency(struct gd32_port *port, const char *name)
+{
+    struct serial_struct ss;
+    const char *tty;
+    char path[256];
+    FILE *fp;
+
+    // ask the tty driver to push received bytes immediately.
+    if (ioctl(port->fd, TIOCGSERIAL, &ss) == 0) {
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(port->fd, TIOCSSERIAL, &ss) < 0)
+            printf("can not set low latency mode.\n");
+    }
+
+    // ftdi adapters hold bytes up to 16ms in chip, set it to 1ms.
+    tty = strrchr(name, '/');
+    tty = tty ? tty + 1 : name;
+    snprintf(path, sizeof(path), "/sys/bus/usb-serial/devices/%s/latency_timer", tty);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+        return;     // not a ftdi adapter, or no permission.
+    if (fprintf(fp, "1") > 0)
+        printf("set %s latency timer to 1ms.\n", tty);
+    fclose(fp);
+}
+#endif
+
+void log_put_varint(FILE *fp, unsigned long long v)
+{
+    while (v >= 0x80) {
+        fputc((v & 0x7f) | 0x80, fp);
+        v >>= 7;
+    }
+    fputc(v, fp);
+}
+
+int log_get_varint(FILE *fp, unsigned long long *v)
+{
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        c = fgetc(fp);
+        if (c == EOF || shift > 56)
+            return -__LINE__;
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+void log_record(struct gd32_port *port, int type, const void *buf, int size)
+{
+    long long now = time_us();
+
+    fputc(type, port->log);
+    log_put_varint(port->log, now - port->log_time);
+    log_put_varint(port->log, size);
+    fwrite(buf, 1, size, port->log);
+    port->log_time = now;
+}
+
+struct log_replay *log_load(const char *path)
+{
+    struct log_replay *rp;
+    unsigned long long delta, size;
+    long long t = 0, tx_time = 0;
+    long pos = 0;
+    char magic[8];
+    int type, max = 0;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    if (8 != fread(magic, 1, 8, fp) || memcmp(magic, LOG_MAGIC, 8)) {
+        fclose(fp);
+        return NULL;
+    }
+
+    rp = (struct log_replay *)calloc(1, sizeof(struct log_replay));
+    while ((type = fgetc(fp)) != EOF) {
+        struct log_record *r;
+
+        if (log_get_varint(fp, &delta) < 0 || log_get_varint(fp, &size) < 0)
+            break;
+        if (rp->count == max) {
+            max = max ? max * 2 : 1024;
+            rp->recs = (struct log_record *)realloc(rp->recs, max * sizeof(struct log_record));
+        }
+        r = &rp->recs[rp->count];
+        r->type = type;
+        r->size = size;
+        r->data = (char *)malloc(size + 1);
+        if (size != fread(r->data, 1, size, fp)) {
+            free(r->data);
+            break;      // truncated log, keep what we have.
+        }
+
+        // replies are timed against the tx record that caused them.
+        t += delta;
+        if (type == LOG_TX)
+            tx_time = t;
+        r->pos = pos;
+        r->delay = t - tx_time;
+        r->ready = 0;
+        if (type == LOG_TX)
+            pos += size;
+        rp->count++;
+    }
+    fclose(fp);
+    return rp;
+}
+
+int replay_write(struct gd32_port *port, const void *buf, size_t count)
+{
+    struct log_replay *rp = port->replay;
+    const char *p = (const char *)buf;
+    long long now = time_us();
+    size_t i;
+
+    // compare against the recorded tx stream, frame splits may differ.
+    for (i = 0; i < count; i++) {
+        while (rp->tx_rec < rp->count && (rp->recs[rp->tx_rec].type != LOG_TX ||
+                rp->tx_off >= rp->recs[rp->tx_rec].size)) {
+            rp->tx_rec++;
+            rp->tx_off = 0;
+        }
+        if (rp->tx_rec >= rp->count || rp->recs[rp->tx_rec].data[rp->tx_off] != p[i])
+            rp->mismatch++;
+        if (rp->tx_rec < rp->count)
+            rp->tx_off++;
+    }
+    rp->tx_pos += count;
+
+    // device answers once it got the bytes, after the recorded delay.
+    while (rp->armed < rp->count) {
+        struct log_record *r = &rp->recs[rp->armed];
+
+        if (r->type == LOG_TX && r->pos + r->size > rp->tx_pos)
+            break;
+        if (r->type != LOG_TX && r->pos > rp->tx_pos)
+            break;
+        r->ready = now + r->delay;
+        rp->armed++;
+    }
+    return count;
+}
+
+int replay_read(struct gd32_port *port, void *buf, size_t count)
+{
+    struct log_replay *rp = port->replay;
+    size_t done = 0;
+    long long now;
+    int n;
+
+    while (done < count) {
+        struct log_record *r;
+
+        while (rp->rx_rec < rp->count && (rp->recs[rp->rx_rec].type == LOG_TX ||
+                (rp->recs[rp->rx_rec].type == LOG_RX && rp->rx_off >= rp->recs[rp->rx_rec].size))) {
+            rp->rx_rec++;
+            rp->rx_off = 0;
+        }
+        if (rp->rx_rec >= rp->count || rp->rx_rec >= rp->armed)
+            break;      // nothing recorded for what we sent so far.
+
+        r = &rp->recs[rp->rx_rec];
+        now = time_us();
+        if (r->ready > now)
+            usleep(r->ready - now);
+        if (r->type == LOG_TIMEOUT) {
+            rp->rx_rec++;
+            break;
+        }
+
+        n = r->size - rp->rx_off;
+        if (n > count - done)
+            n = count - done;
+        memcpy((char *)buf + done, r->data + rp->rx_off, n);
+        rp->rx_off += n;
+        done += n;
+    }
+    return done;
+}
+
+int link_write(struct gd32_port *port, const void *buf, size_t count)
 {
     int wbyte;
-    wbyte = sp_blocking_write(port, buf, count, MAX_WAIT);
+
+    port->writes++;
+    if (port->backend == SP_BACKEND_REPLAY)
+        wbyte = replay_write(port, buf, count);
+    else
+#ifdef __linux__
+    if (port->backend == SP_BACKEND_TERMIOS)
+        wbyte = termios_write(port, buf, count);
+    else
+#endif
+    wbyte = sp_blocking_write(port->sp, buf, count, MAX_WAIT);
+    if (port->log && wbyte > 0)
+        log_record(port, LOG_TX, buf, wbyte);
     
 //    print_hex("wr", buf, wbyte);
     return wbyte;
 }
 
-int sp_read(struct sp_port *port, void *buf, size_t count)
+int link_read(struct gd32_port *port, void *buf, size_t count)
 {
     int rbyte;
-    rbyte = sp_blocking_read(port, buf, count, MAX_WAIT);
+
+    port->reads++;
+    if (port->backend == SP_BACKEND_REPLAY)
+        rbyte = replay_read(port, buf, count);
+    else
+#ifdef __linux__
+    if (port->backend == SP_BACKEND_TERMIOS)
+        rbyte = termios_read(port, buf, count);
+    else
+#endif
+    rbyte = sp_blocking_read(port->sp, buf, count, MAX_WAIT);
+    if (port->log && rbyte > 0)
+        log_record(port, LOG_RX, buf, rbyte);
+    if (port->log && rbyte < (int)count)
+        log_record(port, LOG_TIMEOUT, NULL, 0);
     
 //    print_hex("rd", buf, rbyte);
     return rbyte;
 }
 
+// one proxy request and its reply, returns the reply data size.
+int proxy_request(struct gd32_port *port, int op, int addr, const void *d, int size,
+    void *r, int rsize, int *status)
+{
+    char buf[PROXY_PAGE + 8];
+    int used, len, i;
+
+    buf[0] = op;
+    buf[1] = 0;
+    buf[2] = size & 0xff;
+    buf[3] = (size >> 8) & 0xff;
+    buf[4] = addr & 0xff;
+    buf[5] = (addr >> 8) & 0xff;
+    buf[6] = (addr >> 16) & 0xff;
+    buf[7] = (addr >> 24) & 0xff;
+    memcpy(buf + 8, d, size);
+    if (8 + size != link_write(port, buf, 8 + size))
+        return -__LINE__;
+
+    // an erase keeps the bridge busy for a while, wait for it.
+    for (used = 0, i = 0; used < 4 && i < PROXY_RETRY; i++)
+        used += link_read(port, buf + used, 4 - used);
+    if (used != 4 || buf[1] != (char)op)
+        return -__LINE__;
+
+    *status = (unsigned char)buf[0];
+    len = (unsigned char)buf[2] | (unsigned char)buf[3] << 8;
+    if (len > rsize || len != link_read(port, r, len))
+        return -__LINE__;
+    return len;
+}
+
+// in proxy mode bootloader bytes are collected, a read sends them as one xfer.
+int sp_write(struct gd32_port *port, const void *buf, size_t count)
+{
+    if (!port->proxy)
+        return link_write(port, buf, count);
+    if (port->px_used + count > sizeof(port->px))
+        return -__LINE__;
+    memcpy(port->px + port->px_used, buf, count);
+    port->px_used += count;
+    return count;
+}
+
+int sp_read(struct gd32_port *port, void *buf, size_t count)
+{
+    int used, status;
+
+    if (!port->proxy)
+        return link_read(port, buf, count);
+    used = proxy_request(port, PROXY_XFER, count, port->px, port->px_used,
+        buf, count, &status);
+    port->px_used = 0;
+    return used;
+}
+
+void sp_reset_stats(struct gd32_port *port)
+{
+    port->writes = 0;
+    port->reads = 0;
+    port->syscalls = 0;
+}
+
+void sp_print_stats(struct gd32_port *port, int blocks)
+{
+    if (blocks <= 0)
+        return;
+    printf("%d blocks, %.1f writes and %.1f reads per block", blocks,
+        (double)port->writes / blocks, (double)port->reads / blocks);
+    if (port->backend == SP_BACKEND_TERMIOS)
+        printf(", %.1f syscalls per block", (double)port->syscalls / blocks);
+    printf(".\n");
+}
+
 void print_serial_list()
 {
     struct sp_port **ports;
@@ -51,37 +588,125 @@ void print_serial_list()
     sp_free_port_list(ports);
 }
 
-struct sp_port * gd32_init_serial(const char *name)
+void gd32_default_profile(struct gd32_profile *prof)
 {
-    struct sp_port *port;
-    int baudrate = 115200;
+    // gd32f150g8, what gd32up always assumed.
+    prof->pid = 0;
+    prof->version = 0;
+    prof->flash_kb = 64;
+    prof->erase_cmd = 0x43;
+}
+
+struct gd32_port * gd32_init_serial(const char *name)
+{
+    struct gd32_port *port;
+    struct sp_port *sp;
+    int baudrate = sp_proxy ? PROXY_BAUD : BAUDRATE;
+
+    port = (struct gd32_port *)calloc(1, sizeof(struct gd32_port));
+    port->backend = SP_BACKEND_LIBSP;
+    port->proxy = sp_proxy;
+    port->fd = -1;
+    port->vmin = -1;
+    gd32_default_profile(&port->prof);
+
+    // replay drives the protocol from a recorded session, no port is opened.
+    if (sp_replay) {
+        port->replay = log_load(sp_replay);
+        if (port->replay == NULL) {
+            printf("can not load session log %s.\n", sp_replay);
+            free(port);
+            return NULL;
+        }
+        port->backend = SP_BACKEND_REPLAY;
+        printf("replay %d records from %s.\n", port->replay->count, sp_replay);
+        return port;
+    }
 
-    if (SP_OK != sp_get_port_by_name(name, &port))
+    if (SP_OK != sp_get_port_by_name(name, &sp)) {
+        free(port);
         return NULL;
+    }
 
-    if (SP_OK != sp_open(port, SP_MODE_READ_WRITE))
+    if (SP_OK != sp_open(sp, SP_MODE_READ_WRITE)) {
+        sp_free_port(sp);
+        free(port);
         return NULL;
+    }
 
     // clear input/output buffer.
-    sp_flush(port, SP_BUF_BOTH);
+    sp_flush(sp, SP_BUF_BOTH);
 
-    // gd32f150 supported protocol 115200, 8e1.
+    // gd32f150 supported protocol 115200, 8e1. the proxy bridge talks 8e1 to
+    // the chip by itself, the magic baudrate only switches it over.
+    if (sp_proxy)
+        printf("use bootloader proxy of the bridge.\n");
     printf("set bandrate to %d.\n", baudrate);
-    sp_set_baudrate(port, baudrate);
-    sp_set_bits(port, 8);
-    sp_set_parity(port, SP_PARITY_EVEN);
-    sp_set_stopbits(port, 1);
+    sp_set_baudrate(sp, baudrate);
+    sp_set_bits(sp, 8);
+    sp_set_parity(sp, SP_PARITY_EVEN);
+    sp_set_stopbits(sp, 1);
     
     // necessary, or system will drop 0x11 and 0x13.
-    sp_set_flowcontrol(port, SP_FLOWCONTROL_NONE);
+    sp_set_flowcontrol(sp, SP_FLOWCONTROL_NONE);
+
+    // bridges mapping DTR/RTS to NRST/BOOT0 (project/acm2) reset the chip
+    // into its bootloader on a rising DTR while RTS is set.
+    if (sp_boot) {
+        printf("reset chip into bootloader by DTR/RTS.\n");
+        sp_set_rts(sp, SP_RTS_ON);
+        sp_set_dtr(sp, SP_DTR_OFF);
+        usleep(10000);
+        sp_set_dtr(sp, SP_DTR_ON);
+        usleep(50000);
+        sp_flush(sp, SP_BUF_INPUT);
+    }
+
+    port->sp = sp;
+
+    if (sp_record) {
+        port->log = fopen(sp_record, "wb");
+        if (port->log == NULL)
+            printf("can not record session to %s.\n", sp_record);
+        else
+            fwrite(LOG_MAGIC, 1, 8, port->log);
+        port->log_time = time_us();
+    }
+
+#ifdef __linux__
+    // libserialport configured the line, termios does the transfers.
+    if (sp_backend == SP_BACKEND_TERMIOS && SP_OK == sp_get_port_handle(sp, &port->fd)) {
+        port->backend = SP_BACKEND_TERMIOS;
+        termios_low_latency(port, name);
+    }
+#endif
+    if (sp_backend != port->backend)
+        printf("termios backend is not available, use libserialport.\n");
 
     return port;
 }
 
-void gd32_uninit_serial(struct sp_port *port)
+void gd32_uninit_serial(struct gd32_port *port)
 {
-    sp_close(port);
-    sp_free_port(port);
+    int i;
+
+    if (port->log)
+        fclose(port->log);
+
+    if (port->replay) {
+        printf("replay: %ld bytes sent, %ld differ from the recording.\n",
+            port->replay->tx_pos, port->replay->mismatch);
+        for (i = 0; i < port->replay->count; i++)
+            free(port->replay->recs[i].data);
+        free(port->replay->recs);
+        free(port->replay);
+    }
+
+    if (port->sp) {
+        sp_close(port->sp);
+        sp_free_port(port->sp);
+    }
+    free(port);
 }
 
 char block_xor(const char *d, int size)
@@ -92,7 +717,76 @@ char block_xor(const char *d, int size)
     return out;
 }
 
-int gd32_init_bootloader(struct sp_port *port)
+void tx_put(struct gd32_port *port, const void *d, int size)
+{
+    memcpy(port->tx + port->tx_used, d, size);
+    port->tx_used += size;
+}
+
+// command and size frames are one byte with its complement.
+void tx_byte(struct gd32_port *port, char c)
+{
+    port->tx[port->tx_used++] = c;
+    port->tx[port->tx_used++] = ~c;
+}
+
+void tx_addr(struct gd32_port *port, int addr)
+{
+    char *p = port->tx + port->tx_used;
+
+    p[0] = (addr >> 24) & 0xff;
+    p[1] = (addr >> 16) & 0xff;
+    p[2] = (addr >> 8) & 0xff;
+    p[3] = addr & 0xff;
+    p[4] = block_xor(p, 4);
+    port->tx_used += 5;
+}
+
+int tx_flush(struct gd32_port *port)
+{
+    int used = 0;
+
+    if (port->tx_used)
+        used = sp_write(port, port->tx, port->tx_used);
+    port->tx_used = 0;
+    return used;
+}
+
+// send all queued frames, then read their ACKs and payload in one read.
+int gd32_flush_frames(struct gd32_port *port, int acks, char *d, int size)
+{
+    char buf[BLK_SIZE + 8];
+    int used, i;
+
+    tx_flush(port);
+    used = sp_read(port, buf, acks + size);
+    if (used < acks)
+        return -__LINE__;
+    for (i = 0; i < acks; i++)
+        if (buf[i] != 0x79)
+            return -__LINE__;
+    if (used != acks + size)
+        return -__LINE__;
+
+    if (size)
+        memcpy(d, buf + acks, size);
+    return size;
+}
+
+// a frame expecting ACK is queued, wait for it unless frames are pipelined.
+int gd32_frame_end(struct gd32_port *port, int *acks)
+{
+    int pending = *acks + 1;
+
+    *acks = pending;
+    if (sp_pipeline)
+        return 0;
+
+    *acks = 0;
+    return gd32_flush_frames(port, pending, NULL, 0);
+}
+
+int gd32_init_bootloader(struct gd32_port *port)
 {
     char buf[1];
     int i;
@@ -117,12 +811,52 @@ int gd32_init_bootloader(struct sp_port *port)
     return 1;
 }
 
-int gd32_erase_flash(struct sp_port *port)
+int gd32_measure_latency(struct gd32_port *port)
+{
+    char buf[5];
+    long long t, total = 0, best = 0;
+    int i, wire;
+
+    // get version command 0x01 always answers 5 bytes, good to time a round trip.
+    for (i = 0; i < 8; i++) {
+        buf[0] = 0x01;
+        buf[1] = ~buf[0];
+        t = time_us();
+        sp_write(port, buf, 2);
+        if (5 != sp_read(port, buf, 5) || buf[0] != 0x79)
+            return -__LINE__;
+        t = time_us() - t;
+
+        total += t;
+        if (best == 0 || t < best)
+            best = t;
+    }
+
+    // 7 bytes on the wire, 11 bits per byte with 8e1.
+    wire = 7 * 11 * 1000000 / BAUDRATE;
+    printf("bootloader v%d.%d, round trip avg %lldus, min %lldus, wire time %dus.\n",
+        (unsigned char)buf[1] >> 4, buf[1] & 0xf, total / i, best, wire);
+    return 1;
+}
+
+int gd32_erase_flash(struct gd32_port *port)
 {
-    char buf[2];
+    char buf[3];
+    int size, status;
+
+    // the bridge runs the whole erase and answers once it is done.
+    if (port->proxy) {
+        printf("erase flash...");
+        fflush(stdout);
+        if (proxy_request(port, PROXY_ERASE, port->prof.erase_cmd, NULL, 0,
+            NULL, 0, &status) < 0 || status != 0)
+            return -__LINE__;
+        printf("done\n");
+        return 1;
+    }
 
-    // erase memory command is 0x43.
-    buf[0] = 0x43;
+    // erase memory command is 0x43, newer bootloaders only have 0x44.
+    buf[0] = port->prof.erase_cmd;
     buf[1] = ~buf[0];
     sp_write(port, buf, 2);
     if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
@@ -130,10 +864,12 @@ int gd32_erase_flash(struct sp_port *port)
     
     printf("erase flash...");
    
-    // requests to erase all blocks.
+    // requests to erase all blocks, 0xffff with checksum for extended erase.
     buf[0] = 0xff;
-    buf[1] = ~buf[0];
-    sp_write(port, buf, 2);
+    buf[1] = port->prof.erase_cmd == 0x44 ? 0xff : ~buf[0];
+    buf[2] = 0x00;
+    size = port->prof.erase_cmd == 0x44 ? 3 : 2;
+    sp_write(port, buf, size);
     // erase takes around 200ms, MAX_WAIT must big enough.
     if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
         return -__LINE__;
@@ -142,136 +878,305 @@ int gd32_erase_flash(struct sp_port *port)
     return 1;
 }
 
-int gd32_read_memory(struct sp_port *port, int addr, char *d, int size)
+int gd32_read_memory(struct gd32_port *port, int addr, char *d, int size)
 {
-    char buf[5];
-    int used;
+    int acks = 0, status;
+    char len[2];
+
+    // a proxy page is read by the bridge in 256 byte commands.
+    if (port->proxy) {
+        len[0] = size & 0xff;
+        len[1] = (size >> 8) & 0xff;
+        if (size != proxy_request(port, PROXY_READ, addr, len, 2, d, size, &status)
+            || status != 0)
+            return -__LINE__;
+        return size;
+    }
 
     // read memory command is 0x11.
-    buf[0] = 0x11;
-    buf[1] = ~buf[0];
-    sp_write(port, buf, 2);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    tx_byte(port, 0x11);
+    if (gd32_frame_end(port, &acks) < 0)
         return -__LINE__;
 
     // send address to remote.
-    buf[0] = (addr >> 24) & 0xff;
-    buf[1] = (addr >> 16) & 0xff;
-    buf[2] = (addr >> 8) & 0xff;
-    buf[3] = addr & 0xff;
-    buf[4] = block_xor(buf, 4);
-    sp_write(port, buf, 5);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    tx_addr(port, addr);
+    if (gd32_frame_end(port, &acks) < 0)
         return -__LINE__;
 
-    // send request read byte size.
-    buf[0] = (size - 1) & 0xff;
-    buf[1] = ~buf[0];
-    sp_write(port, buf, 2);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    // send request read byte size, real data follows its ACK.
+    tx_byte(port, (size - 1) & 0xff);
+    acks++;
+    if (gd32_flush_frames(port, acks, d, size) < 0)
         return -__LINE__;
 
-    // read real data from serial port.
-    used = sp_read(port, d, size);
-    if (size != used)
-        return -used;
-
     return size;
 }
 
-int gd32_write_memory(struct sp_port *port, int addr, char *d, int size)
+int gd32_write_memory(struct gd32_port *port, int addr, char *d, int size)
 {
-    char buf[BLK_SIZE + 2];
+    char *p;
+    int acks = 0, status;
+
+    // one status for the whole page, the bridge checks every ACK.
+    if (port->proxy) {
+        if (proxy_request(port, PROXY_WRITE, addr, d, size, NULL, 0, &status) < 0
+            || status != 0)
+            return -__LINE__;
+        return size;
+    }
 
     // write memory command is 0x31.
-    buf[0] = 0x31;
-    buf[1] = ~buf[0];
-    sp_write(port, buf, 2);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    tx_byte(port, 0x31);
+    if (gd32_frame_end(port, &acks) < 0)
         return -__LINE__;
 
     // send address to remote.
-    buf[0] = (addr >> 24) & 0xff;
-    buf[1] = (addr >> 16) & 0xff;
-    buf[2] = (addr >> 8) & 0xff;
-    buf[3] = addr & 0xff;
-    buf[4] = block_xor(buf, 4);
-    sp_write(port, buf, 5);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    tx_addr(port, addr);
+    if (gd32_frame_end(port, &acks) < 0)
         return -__LINE__;
 
     // send write size, data, and xor.
-    buf[0] = (size - 1) & 0xff;
-    memcpy(buf + 1, d, size);
-    buf[size + 1] = block_xor(buf, size + 1);
-    sp_write(port, buf, size + 2);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    p = port->tx + port->tx_used;
+    p[0] = (size - 1) & 0xff;
+    port->tx_used++;
+    tx_put(port, d, size);
+    p[size + 1] = block_xor(p, size + 1);
+    port->tx_used++;
+    acks++;
+    if (gd32_flush_frames(port, acks, NULL, 0) < 0)
         return -__LINE__;
 
     // we already have xor check, no need more compare.
     return size;
 }
 
-const char *gd32_get_unique_id(struct sp_port *port)
+int gd32_parse_profile(struct gd32_profile *prof, const char *get, const char *info)
 {
-    static char id[25] = "";
-    unsigned char buf[12] = {0};
-    char *p = id, i;
+    int i, n = (unsigned char)get[0] + 1;
+    int has_erase = 0, has_ext_erase = 0;
+
+    // get reply is N, version, then N command bytes.
+    prof->version = (unsigned char)get[1];
+    for (i = 2; i <= n; i++) {
+        if (get[i] == 0x43)
+            has_erase = 1;
+        if (get[i] == 0x44)
+            has_ext_erase = 1;
+    }
+    if (!has_erase && !has_ext_erase)
+        return -__LINE__;
+    // legacy erase needs 2 bytes for a mass erase, extended needs 3.
+    prof->erase_cmd = has_erase ? 0x43 : 0x44;
 
-    if (gd32_read_memory(port, 0x1ffff7ac, buf, 12) < 0)
-        return NULL;
+    prof->flash_kb = (unsigned char)info[0x34] | (unsigned char)info[0x35] << 8;
+    if (prof->flash_kb == 0 || prof->flash_kb > 1024)
+        prof->flash_kb = 64;
 
     for (i = 0; i < 12; i++)
-        p += sprintf(p, "%02X", buf[i]);
-
-    return id;
+        sprintf(prof->uid + i * 2, "%02X", (unsigned char)info[i]);
+    return 1;
 }
 
-void gd32_read_flash_to_file(const char *name, const char *path)
+// read what is left of the replies, a failed probe must not leave them in the
+// stream for the next command.
+void gd32_drain(struct gd32_port *port)
 {
-    struct sp_port *port;
+    char buf[64];
 
-    FILE *fp;
+    while (sp_read(port, buf, sizeof(buf)) == sizeof(buf))
+        ;
+}
+
+// one write asks for the info block (uid and flash size), GET, GET_VERSION and
+// GET_ID, the replies come back in that order. uid is set once the info block
+// is in, prof only once every reply parsed.
+int gd32_probe(struct gd32_port *port, struct gd32_profile *prof, char *uid)
+{
+    char info[3 + INFO_SIZE], get[258], buf[10];
+    struct gd32_profile p = *prof;
     int i;
-    time_t ct = time(NULL);
-    const char *id = NULL;
+
+    // read memory 0x11 answers ACK, ACK, ACK and the block.
+    tx_byte(port, 0x11);
+    tx_addr(port, INFO_ADDR);
+    tx_byte(port, INFO_SIZE - 1);
+    // get 0x00 answers ACK, N, version, N commands, ACK. get version 0x01
+    // and get id 0x02 answer 5 bytes each.
+    tx_byte(port, 0x00);
+    tx_byte(port, 0x01);
+    tx_byte(port, 0x02);
+    tx_flush(port);
+
+    if (sizeof(info) != sp_read(port, info, sizeof(info)) ||
+        info[0] != 0x79 || info[1] != 0x79 || info[2] != 0x79)
+        goto probe_fail;
+    for (i = 0; i < 12; i++)
+        sprintf(uid + i * 2, "%02X", (unsigned char)info[3 + i]);
+
+    if (2 != sp_read(port, get, 2) || get[0] != 0x79)
+        goto probe_fail;
+    if ((unsigned char)get[1] + 2 != sp_read(port, get + 2, (unsigned char)get[1] + 2))
+        goto probe_fail;
+    if (get[(unsigned char)get[1] + 3] != 0x79)
+        goto probe_fail;
+
+    // 5 bytes version, 5 bytes id.
+    if (10 != sp_read(port, buf, 10))
+        goto probe_fail;
+    if (buf[0] != 0x79 || buf[4] != 0x79 || buf[5] != 0x79 || buf[9] != 0x79)
+        return -__LINE__;
+
+    p.pid = (unsigned char)buf[7] << 8 | (unsigned char)buf[8];
+    if (gd32_parse_profile(&p, get + 1, info + 3) < 0)
+        return -__LINE__;
+    *prof = p;
+    return 1;
+
+probe_fail:
+    gd32_drain(port);
+    return -__LINE__;
+}
+
+FILE *gd32_open_profile_db(const char *mode)
+{
+    char path[512];
+    const char *home = getenv("HOME");
+
+    if (home == NULL)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/%s", home, PROFILE_DB);
+    return fopen(path, mode);
+}
+
+// the last line of a uid wins, a changed profile is appended.
+int gd32_load_profile(struct gd32_profile *prof, const char *uid)
+{
+    char line[128], id[25];
+    struct gd32_profile p;
+    FILE *fp = gd32_open_profile_db("r");
+    int found = -__LINE__;
+
+    if (fp == NULL)
+        return -__LINE__;
+    while (fgets(line, sizeof(line), fp)) {
+        if (5 != sscanf(line, "%24s %x %x %d %x", id, &p.pid, &p.version, &p.flash_kb, &p.erase_cmd))
+            continue;
+        if (strcmp(id, uid))
+            continue;
+        strcpy(p.uid, id);
+        *prof = p;
+        found = 1;
+    }
+    fclose(fp);
+    return found;
+}
+
+void gd32_save_profile(const struct gd32_profile *prof)
+{
+    FILE *fp = gd32_open_profile_db("a");
+
+    if (fp == NULL)
+        return;
+    fprintf(fp, "%s %04x %02x %d %02x\n", prof->uid, prof->pid, prof->version,
+        prof->flash_kb, prof->erase_cmd);
+    fclose(fp);
+}
+
+struct gd32_port *gd32_connect(const char *name)
+{
+    struct gd32_port *port;
+    struct gd32_profile prof, cached;
+    char uid[25] = "";
+    int probed;
 
     port = gd32_init_serial(name);
     if (port == NULL) {
         printf("can not open serial %s.\n", name);
-        return;     // invalid port.
+        return NULL;    // invalid port.
     }
     if (gd32_init_bootloader(port) < 0) {
-        printf("can not init bootloader.\n", name);
-        return;     // invalid protocol.
+        printf("can not init bootloader.\n");
+        goto connect_fail;  // invalid protocol.
     }
-
-    // init bootloader serial connection.
-    id = gd32_get_unique_id(port);
-    if (id == NULL) {
+    if (gd32_measure_latency(port) < 0)
+        printf("can not measure adapter latency.\n");
+
+    // the probe rides on the uid read, so it costs no extra round trip. the
+    // cache only stands in when the probe replies do not parse. a recorded
+    // session does not use it, its replay must pick the same profile
+    // whatever the cache of this machine holds.
+    prof = port->prof;
+    probed = gd32_probe(port, &prof, uid);
+    if (uid[0] == 0) {
         printf("can not connect to chip.\n");
-        return;
+        goto connect_fail;
     }
-    printf("connected to chip, id is %s.\n", id);
+    printf("connected to chip, id is %s.\n", uid);
+
+    if (probed > 0) {
+        port->prof = prof;
+        if (!sp_record && port->backend != SP_BACKEND_REPLAY &&
+            (gd32_load_profile(&cached, uid) < 0 || cached.pid != prof.pid ||
+             cached.version != prof.version || cached.flash_kb != prof.flash_kb ||
+             cached.erase_cmd != prof.erase_cmd))
+            gd32_save_profile(&prof);
+        printf("probed profile: ");
+    } else if (!sp_record && port->backend != SP_BACKEND_REPLAY &&
+        gd32_load_profile(&port->prof, uid) > 0) {
+        printf("cached profile: ");
+    } else {
+        strcpy(port->prof.uid, uid);
+        printf("can not probe chip, assume gd32f150g8.\n");
+        return port;
+    }
+    printf("pid %04X, bootloader v%d.%d, %dKB flash, erase command 0x%02X.\n",
+        port->prof.pid, port->prof.version >> 4, port->prof.version & 0xf,
+        port->prof.flash_kb, port->prof.erase_cmd);
+    return port;
+
+connect_fail:
+    gd32_uninit_serial(port);
+    return NULL;
+}
+
+// the bootloader moves 256 bytes per command, the proxy a whole page per request.
+int gd32_block_size(struct gd32_port *port)
+{
+    return port->proxy ? PROXY_PAGE : BLK_SIZE;
+}
+
+void gd32_read_flash_to_file(const char *name, const char *path)
+{
+    struct gd32_port *port;
+
+    FILE *fp;
+    int i, blk;
+    time_t ct = time(NULL);
+
+    port = gd32_connect(name);
+    if (port == NULL)
+        return;
 
     // path is null, just read id but not read anything to file.
     if (path == NULL)
-        return;
+        goto read_end;
 
-    // everything is ok, read data out, 64KB default.
+    // everything is ok, read data out, size from chip profile.
     fp = fopen(path, "wb");
     if (fp == NULL) {
         printf("can not save to file %s.\n", path);
         goto read_end;
     }
     printf("[GD32] => %s: ", path);
-    for (i = 0; i < 65536 / BLK_SIZE; i++) {       // 64KB totally
-        char buf[BLK_SIZE] = {0};
+    sp_reset_stats(port);
+    blk = gd32_block_size(port);
+    for (i = 0; i < port->prof.flash_kb * 1024 / blk; i++) {
+        char buf[PROXY_PAGE] = {0};
         int size, used;
 
-        size = gd32_read_memory(port, 0x08000000 + i * BLK_SIZE, buf, BLK_SIZE);
-        if (size != BLK_SIZE) {
-            printf("error: read size %d!=%d at block %d.\n", size, BLK_SIZE, i);
+        size = gd32_read_memory(port, FLASH_BASE + i * blk, buf, blk);
+        if (size != blk) {
+            printf("error: read size %d!=%d at block %d.\n", size, blk, i);
             break;
         }
 
@@ -280,13 +1185,14 @@ void gd32_read_flash_to_file(const char *name, const char *path)
             printf("error: can not write data block %d.\n", i);
             break;
         }
-        if (i % (2048 / BLK_SIZE) == 0) {
+        if (i % (2048 / blk) == 0) {
             fwrite("#", 1, 1, stdout);
             fflush(stdout);
         }
     }
     fclose(fp);
     printf("\n");       // end of transfer process line.
+    sp_print_stats(port, i);
 
 read_end:
     printf("elapsed time %lds, thank you.\n", time(NULL) - ct);
@@ -294,66 +1200,72 @@ read_end:
     gd32_uninit_serial(port);
 }
 
-void gd32_run_flash(struct sp_port *port)
+void gd32_run(struct gd32_port *port, int addr)
 {
-    char buf[5];
+    int acks = 0;
 
     // jump command is 0x21.
-    buf[0] = 0x21;
-    buf[1] = ~buf[0];
-    sp_write(port, buf, 2);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
-        return;
-
-    // flash default address is 0x08000000
-    buf[0] = 0x08;
-    buf[1] = 0x00;
-    buf[2] = 0x00;
-    buf[3] = 0x00;
-    buf[4] = block_xor(buf, 4);
-    sp_write(port, buf, 5);
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    tx_byte(port, 0x21);
+    if (gd32_frame_end(port, &acks) < 0)
         return;
 
-    // the bootloader will return another 0x79.
-    if (1 == sp_read(port, buf, 1) && buf[0] != 0x79)
+    // the bootloader will return another 0x79 after the address.
+    tx_addr(port, addr);
+    acks += 2;
+    if (gd32_flush_frames(port, acks, NULL, 0) < 0)
         return;
 
     // every thing is OK now.
-    printf("run firmware from 0x08000000 now!\n");
+    printf("run firmware from 0x%08X now!\n", addr);
 }
 
-void gd32_write_file_to_flash(const char *name, const char *path)
+int gd32_write_file(struct gd32_port *port, FILE *fp, int base)
 {
-    struct sp_port *port;
+    int i, blk = gd32_block_size(port);
 
-    FILE *fp;
-    int i;
-    time_t ct = time(NULL);
-    const char *id = NULL;
+    sp_reset_stats(port);
+    for (i = 0; ; i++) {
+        char buf[PROXY_PAGE];
+        int size, used;
 
-    port = gd32_init_serial(name);
-    if (port == NULL) {
-        printf("can not open serial %s.\n", name);
-        return;     // invalid port.
-    }
-    if (gd32_init_bootloader(port) < 0) {
-        printf("can not init serial %s.\n", name);
-        return;     // invalid protocol.
+        size = fread(buf, 1, blk, fp);
+        if (size <= 0) {
+            // we have reached the end of the file ...
+            // or might a rare error, ignore it. :)
+            break;
+        }
+
+        used = gd32_write_memory(port, base + i * blk, buf, size);
+        if (used != size) {
+            printf("error: write size %d!=%d at block %d.\n", size, used, i);
+            break;
+        }
+        
+        if (i % (2048 / blk) == 0) {
+            fwrite("#", 1, 1, stdout);
+            fflush(stdout);
+        }
     }
+    printf("\n");       // end of transfer process line.
+    sp_print_stats(port, i);
+    return i;
+}
 
-    // init bootloader serial connection.
-    id = gd32_get_unique_id(port);
-    if (id == NULL) {
-        printf("can not connect to chip.\n");
+void gd32_write_file_to_flash(const char *name, const char *path)
+{
+    struct gd32_port *port;
+
+    FILE *fp;
+    time_t ct = time(NULL);
+
+    port = gd32_connect(name);
+    if (port == NULL)
         return;
-    }
-    printf("connected to chip, id is %s.\n", id);
 
     // erase all chip flash first.
     if (gd32_erase_flash(port) < 0) {
         printf("failed to erase chip.\n");
-        return;
+        goto write_end;
     }
 
     // everything is ok, write data to flash.
@@ -363,37 +1275,1020 @@ void gd32_write_file_to_flash(const char *name, const char *path)
         goto write_end;
     }
     printf("[GD32] <= %s: ", path);
-    for (i = 0; ; i++) {
-        char buf[BLK_SIZE];
-        int size, used;
+    gd32_write_file(port, fp, FLASH_BASE);
+    fclose(fp);
 
-        size = fread(buf, 1, BLK_SIZE, fp);
-        if (size <= 0) {
-            // we have reached the end of the file ...
-            // or might a rare error, ignore it. :)
+    gd32_run(port, FLASH_BASE);
+
+write_end:
+    printf("elapsed time %lds, thank you.\n", time(NULL) - ct);
+
+    gd32_uninit_serial(port);
+}
+
+void gd32_write_file_to_ram(const char *name, const char *path, int addr)
+{
+    struct gd32_port *port;
+
+    FILE *fp;
+    long size;
+    int blk;
+    time_t ct = time(NULL);
+
+    // image must be linked for sram, see core/gd32f150g8_ram.ld.
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("can not read file %s.\n", path);
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size <= 0 || addr < RAM_BASE || addr + size > RAM_BASE + RAM_SIZE) {
+        printf("image size %ld does not fit sram at 0x%08X.\n", size, addr);
+        fclose(fp);
+        return;
+    }
+
+    port = gd32_connect(name);
+    if (port == NULL) {
+        fclose(fp);
+        return;
+    }
+
+    // no erase needed, sram is written directly.
+    printf("[SRAM] <= %s: ", path);
+    blk = gd32_block_size(port);
+    if (gd32_write_file(port, fp, addr) == (size + blk - 1) / blk)
+        gd32_run(port, addr);
+    fclose(fp);
+
+    printf("elapsed time %lds, thank you.\n", time(NULL) - ct);
+
+    gd32_uninit_serial(port);
+}
+
+unsigned int get_le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+void print_isr_stats(const char *name, const unsigned char *p, unsigned int hz)
+{
+    unsigned int count = get_le32(p), cycles = get_le32(p + 4), max = get_le32(p + 8);
+    unsigned int avg = count ? cycles / count : 0;
+
+    printf("%-9s %u calls, avg %u cycles (%.2fus), max %u cycles (%.2fus).\n",
+        name, count, avg, avg * 1e6 / hz, max, max * 1e6 / hz);
+}
+
+// counters of the acm2 bridge, one word each, see cdc_stats_struct there.
+int print_bridge_stats(const unsigned char *buf, int size)
+{
+    const unsigned char *p;
+    int ports = size >= 8 ? get_le32(buf + 4) : 0, i;
+    unsigned int hz;
+
+    if (size != 8 + ports * 40 + 4 * 12)
+        return -__LINE__;
+
+    hz = get_le32(buf);
+    for (i = 0; i < ports; i++) {
+        p = buf + 8 + i * 40;
+        printf("port %d: usart rx %u, tx %u bytes, overrun %u, frame %u, parity %u, noise %u.\n",
+            i, get_le32(p), get_le32(p + 4), get_le32(p + 8), get_le32(p + 12),
+            get_le32(p + 16), get_le32(p + 20));
+        printf("        ring high water %u/%u, overflow %u bytes, OUT paused %u times.\n",
+            get_le32(p + 28), get_le32(p + 32), get_le32(p + 24), get_le32(p + 36));
+    }
+    p = buf + 8 + ports * 40;
+    print_isr_stats("isr usb", p, hz);
+    print_isr_stats("isr usart", p + 12, hz);
+    print_isr_stats("isr dma", p + 24, hz);
+    print_isr_stats("in copy", p + 36, hz);
+    return 1;
+}
+
+#ifdef __linux__
+// the stats vendor request on EP0, the bridge ports keep running as they are.
+int bridge_stats_usb(const char *dev, int clear, unsigned char *buf, int size)
+{
+    struct usbdevfs_ctrltransfer ctrl = {
+        .bRequestType = 0xC1,   // vendor, from the interface
+        .bRequest = BRIDGE_GET_STATS,
+        .wValue = clear,
+        .wIndex = 0,
+        .wLength = size,
+        .timeout = 1000,
+        .data = buf
+    };
+    int fd, used;
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        printf("can not open usb device %s.\n", dev);
+        return -__LINE__;
+    }
+    used = ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+    close(fd);
+    return used;
+}
+#endif
+
+// a usb device node is asked on EP0. a serial port falls back to the
+// bootloader proxy, which takes that port over, so name the one not bridging.
+void gd32_bridge_stats(const char *name, int clear)
+{
+    struct gd32_port *port = NULL;
+    unsigned char buf[PROXY_PAGE];
+    int size, status = 0;
+
+#ifdef __linux__
+    if (!strncmp(name, "/dev/bus/usb/", 13)) {
+        size = bridge_stats_usb(name, clear, buf, sizeof(buf));
+    } else
+#endif
+    {
+        sp_proxy = 1;
+        port = gd32_init_serial(name);
+        if (port == NULL) {
+            printf("can not open serial %s.\n", name);
+            return;
+        }
+        size = proxy_request(port, PROXY_STATS, clear, NULL, 0, buf, sizeof(buf), &status);
+    }
+
+    if (size < 0 || status != 0 || print_bridge_stats(buf, size) < 0) {
+        printf("bridge does not answer the stats request.\n");
+        goto stats_end;
+    }
+    if (clear)
+        printf("counters cleared.\n");
+
+stats_end:
+    if (port != NULL)
+        gd32_uninit_serial(port);
+}
+
+// switch the benchmark mode, the baud rate goes to the device as line coding.
+void bench_mode(struct sp_port *sp, int mode)
+{
+    char buf[BENCH_BLOCK];
+
+    sp_set_baudrate(sp, BENCH_BAUD + mode);
+    sp_flush(sp, SP_BUF_BOTH);
+    // a source never gets quiet, the other modes drop what is still in flight.
+    if (mode != BENCH_SOURCE)
+        while (sp_blocking_read(sp, buf, sizeof(buf), 50) > 0);
+}
+
+void bench_print_rate(const char *name, long long bytes, long long us)
+{
+    printf("%-9s %lld bytes in %.2fs, %.3f MB/s.\n", name, bytes, us / 1e6,
+        us ? bytes / (double)us : 0.0);
+}
+
+int bench_compare_us(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// device to host, every packet carries a sequence number in its first word.
+void bench_source(struct sp_port *sp, int seconds)
+{
+    unsigned char buf[BENCH_BLOCK], seq[4];
+    long long total = 0, t, end;
+    unsigned int expect = 0, got;
+    int used, i, off = 0, first = 1, gap, resyncs = 0;
+    long lost = 0;
+
+    bench_mode(sp, BENCH_SOURCE);
+    t = time_us();
+    end = t + seconds * 1000000LL;
+    while (time_us() < end) {
+        used = sp_blocking_read(sp, buf, sizeof(buf), 100);
+        if (used <= 0)
+            continue;
+        total += used;
+        for (i = 0; i < used; i++, off = (off + 1) % BENCH_PACKET) {
+            if (off < 4)
+                seq[off] = buf[i];
+            if (off != 3)
+                continue;
+            got = seq[0] | seq[1] << 8 | seq[2] << 16 | (unsigned int)seq[3] << 24;
+            // a restart of the device, a stray packet or a byte slip moves
+            // the sequence back or far ahead, start counting from there.
+            gap = (int)(got - expect);
+            if (!first && gap > 0 && gap <= BENCH_MAX_GAP)
+                lost += gap;
+            else if (!first && gap != 0)
+                resyncs++;
+            expect = got + 1;
+            first = 0;
+        }
+    }
+    bench_print_rate("source:", total, time_us() - t);
+    if (lost)
+        printf("          %ld packets lost.\n", lost);
+    if (resyncs)
+        printf("          %d sequence resyncs.\n", resyncs);
+}
+
+// host to device, the device drops the data.
+void bench_sink(struct sp_port *sp, int seconds)
+{
+    char buf[BENCH_BLOCK];
+    long long total = 0, t, end;
+    int used;
+
+    bench_mode(sp, BENCH_SINK);
+    memset(buf, 0x55, sizeof(buf));
+    t = time_us();
+    end = t + seconds * 1000000LL;
+    while (time_us() < end) {
+        used = sp_blocking_write(sp, buf, sizeof(buf), 1000);
+        if (used <= 0)
+            break;
+        total += used;
+    }
+    sp_drain(sp);
+    bench_print_rate("sink:", total, time_us() - t);
+}
+
+// both directions, one round of BENCH_LOOP_SIZE bytes at a time.
+void bench_loopback(struct sp_port *sp, int seconds)
+{
+    char out[BENCH_LOOP_SIZE], in[BENCH_LOOP_SIZE];
+    long long total = 0, t, end;
+    int i, used;
+    long errors = 0;
+
+    bench_mode(sp, BENCH_LOOPBACK);
+    t = time_us();
+    end = t + seconds * 1000000LL;
+    for (i = 0; time_us() < end; i++) {
+        memset(out, i, sizeof(out));
+        if (sizeof(out) != sp_blocking_write(sp, out, sizeof(out), 1000))
+            break;
+        used = sp_blocking_read(sp, in, sizeof(in), 1000);
+        if (used != sizeof(in) || memcmp(in, out, sizeof(in))) {
+            errors++;
             break;
         }
+        total += used;
+    }
+    bench_print_rate("loopback:", total, time_us() - t);
+    if (errors)
+        printf("          loopback data is short or different.\n");
+}
 
-        used = gd32_write_memory(port, 0x08000000 + i * BLK_SIZE, buf, size);
-        if (used != size) {
-            printf("error: write size %d!=%d at block %d.\n", size, used, i);
+// one packet out and back, the latency distribution over many of them.
+void bench_ping(struct sp_port *sp, int size)
+{
+    char buf[BENCH_PACKET];
+    long long us[BENCH_PINGS], sum = 0, t;
+    int i, n;
+
+    bench_mode(sp, BENCH_PING);
+    memset(buf, 0xaa, sizeof(buf));
+    for (n = 0; n < BENCH_PINGS; n++) {
+        t = time_us();
+        if (size != sp_blocking_write(sp, buf, size, 1000) ||
+            size != sp_blocking_read(sp, buf, size, 1000))
             break;
+        us[n] = time_us() - t;
+        sum += us[n];
+    }
+    if (n == 0) {
+        printf("ping:     no answer.\n");
+        return;
+    }
+
+    qsort(us, n, sizeof(us[0]), bench_compare_us);
+    printf("ping:     %d x %d bytes, avg %lldus, min %lldus, p50 %lldus, p90 %lldus, p99 %lldus, max %lldus.\n",
+        n, size, sum / n, us[0], us[n / 2], us[n * 9 / 10], us[n * 99 / 100], us[n - 1]);
+    for (i = 0; i < n && us[i] < 1000; i++);
+    printf("          %d%% of the round trips below 1ms (one USB frame).\n", i * 100 / n);
+}
+
+// run the project/acm benchmark modes one after the other.
+void usb_bench(const char *name, int seconds)
+{
+    struct sp_port *sp;
+
+    if (SP_OK != sp_get_port_by_name(name, &sp)) {
+        printf("can not open serial %s.\n", name);
+        return;
+    }
+    if (SP_OK != sp_open(sp, SP_MODE_READ_WRITE)) {
+        printf("can not open serial %s.\n", name);
+        sp_free_port(sp);
+        return;
+    }
+    sp_set_bits(sp, 8);
+    sp_set_parity(sp, SP_PARITY_NONE);
+    sp_set_stopbits(sp, 1);
+    sp_set_flowcontrol(sp, SP_FLOWCONTROL_NONE);
+
+    bench_source(sp, seconds);
+    bench_sink(sp, seconds);
+    bench_loopback(sp, seconds);
+    bench_ping(sp, 8);
+    bench_ping(sp, BENCH_PACKET);
+
+    // leave a plain loopback device.
+    bench_mode(sp, BENCH_LOOPBACK);
+    sp_close(sp);
+    sp_free_port(sp);
+}
+
+#ifdef __linux__
+// dump the usart of the vendor port to a file, the host asks for VENDOR_XFER
+// bytes at once and the device fills them with back to back packets.
+void vendor_read(const char *dev, const char *path, int seconds, int baud)
+{
+    unsigned char line[7] = { baud, baud >> 8, baud >> 16, baud >> 24, 0, 0, 8 };
+    unsigned char buf[VENDOR_XFER];
+    struct usbdevfs_ctrltransfer ctrl = {
+        .bRequestType = 0x41,   // vendor, to the interface
+        .bRequest = VENDOR_SET_LINE,
+        .wIndex = VENDOR_ITF,
+        .wLength = sizeof(line),
+        .timeout = 1000,
+        .data = line
+    };
+    struct usbdevfs_bulktransfer bulk = {
+        .ep = VENDOR_IN_EP,
+        .len = sizeof(buf),
+        .timeout = VENDOR_TIMEOUT,
+        .data = buf
+    };
+    unsigned int itf = VENDOR_ITF;
+    long long total = 0, t, end;
+    int fd, n;
+    FILE *fp;
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        printf("can not open usb device %s.\n", dev);
+        return;
+    }
+    if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &itf) < 0 ||
+        ioctl(fd, USBDEVFS_CONTROL, &ctrl) < 0) {
+        printf("%s has no vendor port.\n", dev);
+        close(fd);
+        return;
+    }
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        printf("can not open file %s.\n", path);
+        close(fd);
+        return;
+    }
+
+    t = time_us();
+    end = t + seconds * 1000000LL;
+    while (time_us() < end) {
+        // a timeout means the line was quiet, the device ends every burst with
+        // a short packet or a zlp, so no data waits for a full read.
+        n = ioctl(fd, USBDEVFS_BULK, &bulk);
+        if (n > 0) {
+            fwrite(buf, 1, n, fp);
+            total += n;
         }
-        
-        if (i % (2048 / BLK_SIZE) == 0) {
-            fwrite("#", 1, 1, stdout);
-            fflush(stdout);
+    }
+    bench_print_rate("vendor in", total, time_us() - t);
+
+    fclose(fp);
+    ioctl(fd, USBDEVFS_RELEASEINTERFACE, &itf);
+    close(fd);
+}
+
+// cycle budget of the project/daq filters, per adc sample and against the
+// time dma takes to fill the next block.
+void daq_stats(const char *dev, int clear)
+{
+    unsigned char buf[DAQ_STATS_SIZE];
+    struct usbdevfs_ctrltransfer ctrl = {
+        .bRequestType = 0xC1,   // vendor, from the interface
+        .bRequest = DAQ_GET_STATS,
+        .wValue = clear,
+        .wIndex = 0,
+        .wLength = sizeof(buf),
+        .timeout = 1000,
+        .data = buf
+    };
+    unsigned int hz, rate, channels, samples, count, cycles, max;
+    double budget;
+    int fd;
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        printf("can not open usb device %s.\n", dev);
+        return;
+    }
+    if (ioctl(fd, USBDEVFS_CONTROL, &ctrl) != sizeof(buf)) {
+        printf("%s does not answer the daq stats request.\n", dev);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    hz = get_le32(buf);
+    rate = get_le32(buf + 4);
+    channels = get_le32(buf + 8);
+    samples = get_le32(buf + 12);
+    count = get_le32(buf + 24);
+    cycles = get_le32(buf + 28);
+    max = get_le32(buf + 32);
+    printf("%u channels at %u scans/s, decimation %u, %u blocks or frames dropped.\n",
+        channels, rate, get_le32(buf + 16), get_le32(buf + 20));
+    if (count == 0 || rate == 0 || channels == 0) {
+        printf("no block filtered, the stream is stopped or DAQ_DSP is off.\n");
+    } else {
+        budget = (double)hz * samples / channels / rate;
+        printf("filters: %u blocks, avg %.1f cycles per sample, max %u cycles per block (%.2fus).\n",
+            count, (double)cycles / count / samples, max, max * 1e6 / hz);
+        printf("         %.1f%% of the core on average, %.1f%% at most.\n",
+            100.0 * cycles / count / budget, 100.0 * max / budget);
+    }
+    if (clear)
+        printf("counters cleared.\n");
+}
+
+const char *daq_trigger_modes[] = { "off", "rising", "falling", "above", "below", "outside" };
+
+// set the project/daq trigger if mode is given, then show the one the device
+// has. it takes effect when the stream (re)starts or arms the next window.
+void daq_trigger(const char *dev, int argc, char *argv[])
+{
+    unsigned short v[DAQ_TRIGGER_SIZE / 2] = { 0, 0, 0x800, 0xfff, 256, 256 }, want[DAQ_TRIGGER_SIZE / 2];
+    unsigned char buf[DAQ_TRIGGER_SIZE];
+    struct usbdevfs_ctrltransfer ctrl = {
+        .bRequestType = 0x41,   // vendor, to the interface
+        .bRequest = DAQ_SET_TRIGGER,
+        .wIndex = 0,
+        .wLength = sizeof(buf),
+        .timeout = 1000,
+        .data = buf
+    };
+    int fd, i;
+
+    if (argc > 0) {
+        for (i = 0; i < 6; i++)
+            if (!strcmp(argv[0], daq_trigger_modes[i]))
+                break;
+        if (i == 6) {
+            printf("unknown trigger mode %s.\n", argv[0]);
+            return;
+        }
+        v[0] = i;
+        if (argc > 1)
+            v[2] = atoi(argv[1]);
+        if (argc > 2)
+            v[4] = atoi(argv[2]);
+        if (argc > 3)
+            v[5] = atoi(argv[3]);
+        if (argc > 4)
+            v[3] = atoi(argv[4]);
+        if (argc > 5)
+            v[1] = atoi(argv[5]);
+    }
+
+    fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        printf("can not open usb device %s.\n", dev);
+        return;
+    }
+    if (argc > 0) {
+        memcpy(want, v, sizeof(v));
+        for (i = 0; i < DAQ_TRIGGER_SIZE / 2; i++) {
+            buf[i * 2] = v[i];
+            buf[i * 2 + 1] = v[i] >> 8;
+        }
+        if (ioctl(fd, USBDEVFS_CONTROL, &ctrl) < 0) {
+            printf("%s does not take the trigger request.\n", dev);
+            close(fd);
+            return;
         }
     }
+    ctrl.bRequestType = 0xC1;
+    ctrl.bRequest = DAQ_GET_TRIGGER;
+    if (ioctl(fd, USBDEVFS_CONTROL, &ctrl) != sizeof(buf)) {
+        printf("%s does not answer the trigger request.\n", dev);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    for (i = 0; i < DAQ_TRIGGER_SIZE / 2; i++)
+        v[i] = buf[i * 2] | buf[i * 2 + 1] << 8;
+    printf("trigger %s on channel %u, level %u", v[0] < 6 ? daq_trigger_modes[v[0]] : "?", v[1], v[2]);
+    if (v[0] == 5)
+        printf(" and %u", v[3]);
+    printf(", %u scans before and %u from the trigger on.\n", v[4], v[5]);
+    if (argc > 0 && memcmp(want, v, sizeof(v)))
+        printf("the device kept it, the new one is not valid (pre + post up to a block).\n");
+}
+#endif
+
+// one burst of one direction, the flags byte and then its data, a pcap packet.
+struct sniff_burst
+{
+    unsigned char d[1 + SNIFF_MAX_BURST];
+    int len;
+    long long us;
+};
+
+void sniff_write_burst(FILE *fp, struct sniff_burst *b, long long base_us)
+{
+    unsigned int rec[4];
+    long long t = base_us + b->us;
+
+    if (b->len == 0)
+        return;
+    rec[0] = t / 1000000;
+    rec[1] = t % 1000000;
+    rec[2] = rec[3] = b->len + 1;
+    fwrite(rec, 4, 4, fp);
+    fwrite(b->d, 1, b->len + 1, fp);
+    b->len = 0;
+}
+
+// turn the records of the bridge into a pcap file, one packet per burst.
+void sniff_capture(const char *name, int baud, int seconds, const char *path)
+{
+    static struct sniff_burst burst[2];
+    static unsigned char rx[0x4000];
+    unsigned char line[7] = { baud, baud >> 8, baud >> 16, baud >> 24, 0, 0, 8 };
+    unsigned int magic = 0xa1b2c3d4, zero = 0, snap = 1 + SNIFF_MAX_BURST, link = PCAP_LINKTYPE;
+    unsigned short major = 2, minor = 4;
+    long long base, now = 0, end, bytes[2] = { 0 };
+    int bursts[2] = { 0 }, errors[2] = { 0 }, lost[2] = { 0 };
+    int used = 0, skipped = 0, o, n, len, ch;
+    struct sp_port *sp;
+    unsigned char *r;
+    FILE *fp;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        printf("can not open file %s.\n", path);
+        return;
+    }
+    if (SP_OK != sp_get_port_by_name(name, &sp)) {
+        printf("can not open serial %s.\n", name);
+        fclose(fp);
+        return;
+    }
+    if (SP_OK != sp_open(sp, SP_MODE_READ_WRITE)) {
+        printf("can not open serial %s.\n", name);
+        sp_free_port(sp);
+        fclose(fp);
+        return;
+    }
+    sp_set_bits(sp, 8);
+    sp_set_parity(sp, SP_PARITY_NONE);
+    sp_set_stopbits(sp, 1);
+    sp_set_flowcontrol(sp, SP_FLOWCONTROL_NONE);
+
+    fwrite(&magic, 4, 1, fp);
+    fwrite(&major, 2, 1, fp);
+    fwrite(&minor, 2, 1, fp);
+    fwrite(&zero, 4, 1, fp);
+    fwrite(&zero, 4, 1, fp);
+    fwrite(&snap, 4, 1, fp);
+    fwrite(&link, 4, 1, fp);
+
+    // bridge time 0 is when it entered the sniffer, close enough to now.
+    sp_set_baudrate(sp, SNIFF_BAUD);
+    sp_blocking_write(sp, line, sizeof(line), 100);
+    base = (long long)time(NULL) * 1000000;
+    printf("sniffing at %d baud for %ds.\n", baud, seconds);
+
+    end = time_us() + seconds * 1000000LL;
+    while (time_us() < end) {
+        n = sp_blocking_read(sp, rx + used, sizeof(rx) - used, 100);
+        if (n > 0)
+            used += n;
+
+        for (o = 0; used - o >= 8; o += 8 + len) {
+            r = rx + o;
+            len = r[2] | r[3] << 8;
+            // lost sync, e.g. bridged bytes from before, look for the next record.
+            if (r[0] != SNIFF_SYNC || (r[1] & 0xf0) || len > SNIFF_MAX_REC) {
+                skipped++;
+                len = -7;
+                continue;
+            }
+            if (used - o < 8 + len)
+                break;
+
+            // times wrap after 71 minutes and the two directions interleave.
+            now += (int)(get_le32(r + 4) - (unsigned int)now);
+            ch = r[1] & SNIFF_USART1;
+            if (!(r[1] & SNIFF_CONT) || burst[ch].len + len > SNIFF_MAX_BURST) {
+                sniff_write_burst(fp, &burst[ch], base);
+                burst[ch].us = now;
+                burst[ch].d[0] = r[1] & SNIFF_USART1;
+                bursts[ch]++;
+            }
+            if ((r[1] & SNIFF_ERROR) && !(burst[ch].d[0] & SNIFF_ERROR))
+                errors[ch]++;
+            if ((r[1] & SNIFF_LOST) && !(burst[ch].d[0] & SNIFF_LOST))
+                lost[ch]++;
+            burst[ch].d[0] |= r[1] & (SNIFF_ERROR | SNIFF_LOST);
+            memcpy(burst[ch].d + 1 + burst[ch].len, r + 8, len);
+            burst[ch].len += len;
+            bytes[ch] += len;
+        }
+        memmove(rx, rx + o, used - o);
+        used -= o;
+    }
+    sniff_write_burst(fp, &burst[0], base);
+    sniff_write_burst(fp, &burst[1], base);
+
+    for (ch = 0; ch < 2; ch++)
+        printf("usart%d: %d bursts, %lld bytes, %d with line errors, %d with lost bytes.\n",
+            ch, bursts[ch], bytes[ch], errors[ch], lost[ch]);
+    if (skipped)
+        printf("%d bytes skipped between records.\n", skipped);
+
+    // any other rate ends the sniffer, the bridge goes back to work.
+    sp_set_baudrate(sp, BAUDRATE);
+    sp_close(sp);
+    sp_free_port(sp);
     fclose(fp);
-    printf("\n");       // end of transfer process line.
+}
 
-    gd32_run_flash(port);
+unsigned short crc16_ccitt(unsigned short crc, const unsigned char *d, int len)
+{
+    int i;
 
-write_end:
-    printf("elapsed time %lds, thank you.\n", time(NULL) - ct);
+    while (len--) {
+        crc ^= *d++ << 8;
+        for (i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
 
-    gd32_uninit_serial(port);
+// output file of a capture, mapped and grown in CAPTURE_GROW steps.
+struct capture_file
+{
+    int fd;
+    unsigned char *map;
+    size_t size;
+    size_t used;
+};
+
+unsigned char *capture_reserve(struct capture_file *c, size_t need)
+{
+    if (c->used + need > c->size) {
+        if (c->map)
+            munmap(c->map, c->size);
+        while (c->used + need > c->size)
+            c->size += CAPTURE_GROW;
+        c->map = NULL;
+        if (ftruncate(c->fd, c->size) < 0)
+            return NULL;
+        c->map = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+        if (c->map == MAP_FAILED) {
+            c->map = NULL;
+            return NULL;
+        }
+    }
+    return c->map + c->used;
+}
+
+// n packed 12 bit samples to le16 words.
+void capture_unpack(unsigned char *d, const unsigned char *p, int n)
+{
+    int a, b;
+
+    for (; n >= 2; n -= 2, p += 3) {
+        a = p[0] | (p[1] & 0x0f) << 8;
+        b = p[1] >> 4 | p[2] << 4;
+        *d++ = a;
+        *d++ = a >> 8;
+        *d++ = b;
+        *d++ = b >> 8;
+    }
+    if (n) {
+        a = p[0] | (p[1] & 0x0f) << 8;
+        *d++ = a;
+        *d++ = a >> 8;
+    }
+}
+
+// a raw frame has no crc, but a sample never sets its high nibble. a frame
+// cut off by the device runs into the next header, whose sync does.
+int capture_raw_ok(const unsigned char *p, int n)
+{
+    for (; n; n--, p += 2)
+        if (p[1] & 0xf0)
+            return 0;
+    return 1;
+}
+
+// decode adc frames into a file of le16 samples, scan after scan. a dropped
+// frame keeps its place in time, filled with 0xffff.
+void adc_capture(const char *name, int baud, int seconds, const char *path)
+{
+    static unsigned char rx[0x10000];
+    struct capture_file c = { -1, NULL, 0, 0 };
+    int used = 0, o, n, len, samples, mask = -1, seq, expect = -1, gap, raw;
+    int frames = 0, dropped = 0, overruns = 0, bad = 0, skipped = 0, windows = 0, scans = 0;
+    long long t, end, bytes = 0, received = 0;
+    struct sp_port *sp;
+    unsigned char *r, *d;
+
+    c.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (c.fd < 0) {
+        printf("can not open file %s.\n", path);
+        return;
+    }
+    if (SP_OK != sp_get_port_by_name(name, &sp)) {
+        printf("can not open serial %s.\n", name);
+        close(c.fd);
+        return;
+    }
+    if (SP_OK != sp_open(sp, SP_MODE_READ_WRITE)) {
+        printf("can not open serial %s.\n", name);
+        sp_free_port(sp);
+        close(c.fd);
+        return;
+    }
+    sp_set_baudrate(sp, baud);
+    sp_set_bits(sp, 8);
+    sp_set_parity(sp, SP_PARITY_NONE);
+    sp_set_stopbits(sp, 1);
+    sp_set_flowcontrol(sp, SP_FLOWCONTROL_NONE);
+
+    t = time_us();
+    end = t + seconds * 1000000LL;
+    while (time_us() < end) {
+        n = sp_blocking_read(sp, rx + used, sizeof(rx) - used, 100);
+        if (n > 0) {
+            used += n;
+            bytes += n;
+        }
+
+        for (o = 0; used - o >= ADC_HEADER; o += len) {
+            r = rx + o;
+            samples = (r[6] | r[7] << 8) * __builtin_popcount(r[4]);
+            raw = r[5] & ADC_RAW;
+            // a RAW frame must also fit rx, or the capture would wait for it forever.
+            if (r[0] != ADC_SYNC0 || r[1] != ADC_SYNC1 || samples == 0 || samples > ADC_MAX_SAMPLES ||
+                (raw && samples > (sizeof(rx) - ADC_HEADER) / 2)) {
+                skipped++;
+                len = 1;
+                continue;
+            }
+            len = ADC_HEADER + (raw ? samples * 2 : (samples * 3 + 1) / 2 + 2);
+            if (used - o < len)
+                break;
+            if (raw ? !(r[5] & ADC_WIDE) && !capture_raw_ok(r + ADC_HEADER, samples) :
+                crc16_ccitt(0xffff, r + 2, len - 4) != (r[len - 2] | r[len - 1] << 8)) {
+                bad++;
+                len = 1;
+                continue;
+            }
+            // project/daq restarts on a new line coding, what came before is
+            // from the last rate.
+            if (r[5] & ADC_START) {
+                c.used = 0;
+                mask = expect = -1;
+                frames = dropped = overruns = windows = 0;
+                bytes = used - o;
+                received = 0;
+                t = time_us();
+            }
+            if (mask >= 0 && r[4] != mask) {
+                printf("channel mask changed, capture stopped.\n");
+                goto capture_end;
+            }
+            mask = r[4];
+
+            seq = r[2] | r[3] << 8;
+            gap = expect < 0 ? 0 : (seq - expect) & 0xffff;
+            expect = (seq + 1) & 0xffff;
+            if (r[5] & ADC_OVERRUN)
+                overruns++;
+            if (r[5] & ADC_TRIGGER) {
+                windows++;
+                scans = r[6] | r[7] << 8;
+            }
+
+            d = capture_reserve(&c, (size_t)(gap + 1) * samples * 2);
+            if (d == NULL) {
+                printf("can not grow %s.\n", path);
+                goto capture_end;
+            }
+            memset(d, ADC_LOST, (size_t)gap * samples * 2);
+            if (raw)
+                memcpy(d + (size_t)gap * samples * 2, r + ADC_HEADER, samples * 2);
+            else
+                capture_unpack(d + (size_t)gap * samples * 2, r + ADC_HEADER, samples);
+            c.used += (size_t)(gap + 1) * samples * 2;
+            dropped += gap;
+            received += samples;
+            frames++;
+        }
+        memmove(rx, rx + o, used - o);
+        used -= o;
+    }
+
+capture_end:
+    t = time_us() - t;
+    printf("%d frames in %.2fs, %d dropped, %d marked overrun by the device, %d bad.\n",
+        frames, t / 1e6, dropped, overruns, bad);
+    bench_print_rate("stream:", bytes, t);
+    if (t)
+        printf("%lld samples, %.0f samples/s.\n", received, received * 1e6 / t);
+    if (skipped)
+        printf("%d bytes skipped between frames.\n", skipped);
+    if (windows)
+        printf("%d trigger windows of %d scans, %.1f per second.\n", windows, scans,
+            t ? windows * 1e6 / t : 0);
+    if (mask >= 0)
+        printf("%s: %zu le16 samples, channel mask 0x%02x, dropped frames read 0xffff.\n",
+            path, c.used / 2, mask);
+
+    if (c.map)
+        munmap(c.map, c.size);
+    if (ftruncate(c.fd, c.used) < 0)
+        printf("can not trim %s.\n", path);
+    close(c.fd);
+    sp_close(sp);
+    sp_free_port(sp);
+}
+
+// a 12 bit adc signal, the same for every run.
+int dsp_check_signal(int kind, int i, unsigned int *lcg)
+{
+    switch (kind) {
+    case 0:
+        return 2730;
+    case 1:
+        return (i / 150) & 1 ? 3500 : 600;
+    case 2:
+        return 600 + abs(i % 1000 - 500) * 5;
+    default:
+        *lcg = *lcg * 1103515245 + 12345;
+        return 1024 + (*lcg >> 21);
+    }
+}
+
+// mean of the last 2^shift inputs, the ones before the first count as 0.
+void dsp_model_average(const double *in, double *out, int n, int shift)
+{
+    double sum;
+    int i, k;
+
+    for (i = 0; i < n; i++) {
+        for (sum = 0, k = 0; k < 1 << shift && k <= i; k++)
+            sum += in[i - k];
+        out[i] = sum / (1 << shift);
+    }
+}
+
+// order boxcars of 2^shift, every 2^shift-th output scaled back to unity
+// gain. returns the output count.
+int dsp_model_cic(const double *in, double *out, int n, int order, int shift)
+{
+    double *a = malloc(n * sizeof(double)), *b = malloc(n * sizeof(double)), *t, sum;
+    int r = 1 << shift, i, j, k;
+
+    memcpy(a, in, n * sizeof(double));
+    for (j = 0; j < order; j++) {
+        for (i = 0; i < n; i++) {
+            for (sum = 0, k = 0; k < r && k <= i; k++)
+                sum += a[i - k];
+            b[i] = sum;
+        }
+        t = a;
+        a = b;
+        b = t;
+    }
+    for (i = 0; (i + 1) * r <= n; i++)
+        out[i] = a[(i + 1) * r - 1] / (1LL << order * shift);
+    free(a);
+    free(b);
+    return i;
+}
+
+// offset binary like dsp_biquad_put, exact coefficients and state.
+void dsp_model_biquad(const double *in, double *out, int n, const int *q)
+{
+    double x, x1 = 0, x2 = 0, y, y1 = 0, y2 = 0, s = 1 << DSP_BIQUAD_SHIFT;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        x = in[i] - 32768;
+        y = (q[0] * x + q[1] * x1 + q[2] * x2 - q[3] * y1 - q[4] * y2) / s;
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+        out[i] = y + 32768;
+    }
+}
+
+// largest and mean difference in lsb, prints them against the tolerances.
+// the mean shows a bias the largest one hides, e.g. truncation.
+int dsp_check_result(const char *stage, const char *signal, const uint16_t *got,
+    const double *want, int n, double tolerance, double bias)
+{
+    double e, max = 0, sum = 0;
+    int i, ok;
+
+    for (i = 0; i < n; i++) {
+        e = got[i] - want[i];
+        sum += e;
+        if (e < 0)
+            e = -e;
+        if (e > max)
+            max = e;
+    }
+    sum /= n;
+    ok = max <= tolerance && sum <= bias && -sum <= bias;
+    printf("%-8s %-9s %5d samples, max error %.3f lsb, mean %+.3f lsb, %s.\n", stage, signal, n,
+        max, sum, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// run every stage and the whole chain on the check signals, gd32up has no
+// hardware for this one.
+int dsp_check(void)
+{
+    static const char *names[] = { "dc", "square", "triangle", "noise" };
+    static const int q[5] = { DSP_CHECK_BIQUAD };
+    double *in = malloc(DSP_CHECK_SAMPLES * sizeof(double));
+    double *want = malloc(DSP_CHECK_SAMPLES * sizeof(double));
+    double *mid = malloc(DSP_CHECK_SAMPLES * sizeof(double));
+    uint16_t *got = malloc(DSP_CHECK_SAMPLES * sizeof(uint16_t)), v;
+    dsp_average_struct avg;
+    dsp_cic_struct cic;
+    dsp_biquad_struct iir;
+    dsp_chain_struct chain;
+    unsigned int lcg;
+    int kind, i, n, ok = 1;
+    uint16_t adc;
+
+    for (kind = 0; kind < 4; kind++) {
+        lcg = 1;
+        for (i = 0; i < DSP_CHECK_SAMPLES; i++)
+            in[i] = dsp_check_signal(kind, i, &lcg) << 4;
+
+        // the integer mean is truncated.
+        dsp_average_init(&avg, DSP_CHECK_AVERAGE);
+        for (i = 0; i < DSP_CHECK_SAMPLES; i++)
+            got[i] = dsp_average_put(&avg, in[i]);
+        dsp_model_average(in, want, DSP_CHECK_SAMPLES, DSP_CHECK_AVERAGE);
+        ok &= dsp_check_result("average", names[kind], got, want, DSP_CHECK_SAMPLES, 1, 1);
+
+        // rounded.
+        dsp_cic_init(&cic, DSP_CHECK_CIC_ORDER, DSP_CHECK_CIC_SHIFT);
+        for (i = 0, n = 0; i < DSP_CHECK_SAMPLES; i++)
+            n += dsp_cic_put(&cic, in[i], got + n);
+        if (n != dsp_model_cic(in, want, DSP_CHECK_SAMPLES, DSP_CHECK_CIC_ORDER, DSP_CHECK_CIC_SHIFT)) {
+            printf("cic      %-9s output count differs, FAIL.\n", names[kind]);
+            ok = 0;
+        } else {
+            ok &= dsp_check_result("cic", names[kind], got, want, n, 0.5, 0.5);
+        }
+
+        // truncation noise, shaped by the error feedback.
+        dsp_biquad_init(&iir, q[0], q[1], q[2], q[3], q[4]);
+        for (i = 0; i < DSP_CHECK_SAMPLES; i++)
+            got[i] = dsp_biquad_put(&iir, in[i]);
+        dsp_model_biquad(in, want, DSP_CHECK_SAMPLES, q);
+        ok &= dsp_check_result("biquad", names[kind], got, want, DSP_CHECK_SAMPLES, 2, 0.1);
+
+        // the chain as project/daq runs it, the model keeps every fraction.
+        dsp_average_init(&chain.avg, DSP_CHECK_AVERAGE);
+        dsp_cic_init(&chain.cic, DSP_CHECK_CIC_ORDER, DSP_CHECK_CIC_SHIFT);
+        dsp_biquad_init(&chain.iir, q[0], q[1], q[2], q[3], q[4]);
+        lcg = 1;
+        for (i = 0, n = 0; i < DSP_CHECK_SAMPLES; i++) {
+            adc = dsp_check_signal(kind, i, &lcg);
+            if (dsp_chain_put(&chain, adc, &v))
+                got[n++] = v;
+        }
+        dsp_model_average(in, mid, DSP_CHECK_SAMPLES, DSP_CHECK_AVERAGE);
+        dsp_model_cic(mid, want, DSP_CHECK_SAMPLES, DSP_CHECK_CIC_ORDER, DSP_CHECK_CIC_SHIFT);
+        memcpy(mid, want, n * sizeof(double));
+        dsp_model_biquad(mid, want, n, q);
+        ok &= dsp_check_result("chain", names[kind], got, want, n, 3, 0.2);
+    }
+    printf(ok ? "all stages match the models.\n" : "some stages FAIL.\n");
+
+    free(in);
+    free(want);
+    free(mid);
+    free(got);
+    return ok;
 }
 
 int block_hex(const char *s, int size)
@@ -479,11 +2374,65 @@ int convert_bin_to_hex(const char *bin, const char *hex)
     return total;
 }
 
+char *prepare_bin_file(const char *file)
+{
+    // convert to bin if input is hex.
+    int len = strlen(file);
+    char *path = (char *)malloc(len + 1);
+    strcpy(path, file);
+    if(len > 4 && !strcmp(file + len - 4, ".hex")) {
+        strcpy(path + len - 4, ".bin");
+        convert_hex_to_bin(file, path);
+    }
+    return path;
+}
+
 int main(int argc, char *argv[])
 {
+    // options go before the command, e.g. gd32up -t write [port] [file].
+    while (argc > 1 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-t"))
+            sp_backend = SP_BACKEND_TERMIOS;
+        if (!strcmp(argv[1], "-c"))
+            sp_pipeline = 1;
+        if (!strcmp(argv[1], "-b"))
+            sp_boot = 1;
+        if (!strcmp(argv[1], "-x"))
+            sp_proxy = 1;
+        if (!strcmp(argv[1], "-r") && argc > 2) {
+            sp_record = argv[2];
+            argc--;
+            argv++;
+        }
+        if (!strcmp(argv[1], "-p") && argc > 2) {
+            sp_replay = argv[2];
+            argc--;
+            argv++;
+        }
+        argc--;
+        argv++;
+    }
+
     if (argc == 1) {
+        printf("options: -t\tuse low latency termios backend (linux only).\n");
+        printf("         -c\tcoalesce command, address and data frames into one write.\n");
+        printf("         -b\treset chip into bootloader by DTR/RTS of the bridge.\n");
+        printf("         -x\tlet the bridge run the bootloader protocol (project/acm2).\n");
+        printf("         -r [log]\trecord the serial session with timestamps.\n");
+        printf("         -p [log]\treplay a recorded session with its timing, port is ignored.\n\n");
         printf("usage: gd32up list\n\tlist current valid serial ports.\n\n");
         printf("usage: gd32up read|write [port] [file bin]\n\tread/write bin file from/to flash.\n\n");
+        printf("usage: gd32up run-ram [port] [file bin] [addr: 20000000]\n\tload image to sram and run it, flash is untouched.\n\n");
+        printf("usage: gd32up stats [usb device|port] [clear]\n\tshow (and clear) the counters of a project/acm2 bridge, a port goes through the proxy.\n\n");
+        printf("usage: gd32up usbbench [port] [seconds: 2]\n\tmeasure a project/acm benchmark device, MB/s per direction and ping latency.\n\n");
+        printf("usage: gd32up capture [port] [baud: 921600] [seconds: 10] [file: capture.bin]\n\tsave the binary adc stream of project/adc1, adc2 or daq (baud is the scan rate there) as le16 samples, report dropped frames and the rate.\n\n");
+        printf("usage: gd32up dspcheck\n\trun the fixed point filters of project/core/dsp.h against double models.\n\n");
+        printf("usage: gd32up sniff [port] [baud] [seconds: 10] [file: sniff.pcap]\n\tcapture both usarts of a project/acm2 bridge as receive only taps, with burst times.\n\n");
+#ifdef __linux__
+        printf("usage: gd32up vendorread [usb device] [file] [seconds: 2] [baud: 115200]\n\tsave the usart of a project/acm2 vendor port, device is /dev/bus/usb/BBB/DDD.\n\n");
+        printf("usage: gd32up daqstats [usb device] [clear]\n\tshow (and clear) the filter cycles and drops of project/daq with DAQ_DSP.\n\n");
+        printf("usage: gd32up trigger [usb device] [off|rising|falling|above|below|outside] [level: 2048] [pre: 256] [post: 256] [high: 4095] [channel: 0]\n\tset (or show) the project/daq trigger, capture then gets the windows around it.\n\n");
+#endif
         printf("usage: gd32up hex2bin [in hex] [out: bin]\n\tconvert hex to bin file.\n\n");
         printf("usage: gd32up bin2hex [in bin] [out: hex]\n\tconvert bin to hex file.\n\n");
         return -1;
@@ -503,14 +2452,7 @@ int main(int argc, char *argv[])
     }
 
     if (!strcmp(argv[1], "write")) {
-        // convert to hex if input is hex.
-        int len = strlen(argv[3]);
-        char *path = (char *)malloc(len + 1);
-        strcpy(path, argv[3]);
-        if(!strcmp(argv[3] + len - 4, ".hex")) {
-            strcpy(path + len - 4, ".bin");
-            convert_hex_to_bin(argv[3], path);
-        }
+        char *path = prepare_bin_file(argv[3]);
 
         gd32_write_file_to_flash(argv[2], path);
 
@@ -518,6 +2460,63 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (!strcmp(argv[1], "run-ram")) {
+        char *path = prepare_bin_file(argv[3]);
+
+        if (argc == 5)
+            gd32_write_file_to_ram(argv[2], path, strtol(argv[4], NULL, 16));
+        else
+            gd32_write_file_to_ram(argv[2], path, RAM_BASE);
+
+        free(path);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "stats")) {
+        gd32_bridge_stats(argv[2], argc == 4 && !strcmp(argv[3], "clear"));
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "usbbench")) {
+        usb_bench(argv[2], argc == 4 ? atoi(argv[3]) : 2);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "capture") && argc > 2) {
+        adc_capture(argv[2], argc > 3 ? atoi(argv[3]) : ADC_BAUD, argc > 4 ? atoi(argv[4]) : 10,
+            argc > 5 ? argv[5] : "capture.bin");
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "dspcheck")) {
+        // 2 tells a script that a stage is off.
+        return dsp_check() ? 1 : 2;
+    }
+
+    if (!strcmp(argv[1], "sniff") && argc > 3) {
+        sniff_capture(argv[2], atoi(argv[3]), argc > 4 ? atoi(argv[4]) : 10,
+            argc > 5 ? argv[5] : "sniff.pcap");
+        return 1;
+    }
+
+#ifdef __linux__
+    if (!strcmp(argv[1], "vendorread") && argc > 3) {
+        vendor_read(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 2,
+            argc > 5 ? atoi(argv[5]) : BAUDRATE);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "daqstats") && argc > 2) {
+        daq_stats(argv[2], argc == 4 && !strcmp(argv[3], "clear"));
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "trigger") && argc > 2) {
+        daq_trigger(argv[2], argc - 3, argv + 3);
+        return 1;
+    }
+#endif
+
     if (!strcmp(argv[1], "hex2bin")) {
         printf("output file size: %d\n", convert_hex_to_bin(argv[2], argv[3]));
         return 1;
@@ -20,14 +20,27 @@
 
 static uint32_t cdc_cmd = 0xFFU;
 static __IO uint32_t usbd_cdc_altset = 0U;
-extern uint32_t pre_packet_send;
 
-uint8_t usb_data_buffer[CDC_ACM_DATA_PACKET_SIZE];
 uint8_t usb_cmd_buffer[CDC_ACM_CMD_PACKET_SIZE];
 
 uint8_t packet_sent = 1U;
 uint8_t packet_receive = 1U;
-uint32_t receive_length = 0U;
+
+/* loopback packets, the OUT endpoint receives into the head slot and the IN
+   endpoint sends from the tail slot, a packet is never copied in between */
+static uint8_t loop_pool[CDC_ACM_LOOP_POOL_SIZE][CDC_ACM_DATA_PACKET_SIZE];
+static uint16_t loop_length[CDC_ACM_LOOP_POOL_SIZE];
+static uint8_t loop_head = 0U;
+static uint8_t loop_tail = 0U;
+static uint8_t loop_count = 0U;
+static uint8_t loop_sending = 0U;
+
+/* benchmark state, see CDC_ACM_BENCH_xxx */
+volatile uint8_t cdc_bench_mode = CDC_ACM_BENCH_LOOPBACK;
+static uint8_t bench_packet[CDC_ACM_DATA_PACKET_SIZE];
+static uint32_t bench_sequence = 0U;
+static uint8_t ping_pending = 0U;
+static uint16_t ping_length = 0U;
 
 usbd_int_cb_struct *usbd_int_fops = NULL;
 
@@ -234,13 +247,21 @@ void *const usbd_strings[] =
 */
 usbd_status_enum cdc_acm_init (void *pudev, uint8_t config_index)
 {
-    /* initialize the data Tx/Rx endpoint */
-    usbd_ep_init(pudev, ENDP_SNG_BUF, &(configuration_descriptor.cdc_loopback_in_endpoint));
-    usbd_ep_init(pudev, ENDP_SNG_BUF, &(configuration_descriptor.cdc_loopback_out_endpoint));
+    /* initialize the data Tx/Rx endpoint, double buffered so the host is not NAKed during copies */
+    usbd_ep_init(pudev, CDC_ACM_DATA_BUF_KIND, &(configuration_descriptor.cdc_loopback_in_endpoint));
+    usbd_ep_init(pudev, CDC_ACM_DATA_BUF_KIND, &(configuration_descriptor.cdc_loopback_out_endpoint));
 
     /* initialize the command Tx endpoint */
     usbd_ep_init(pudev, ENDP_SNG_BUF, &(configuration_descriptor.cdc_loopback_cmd_endpoint));
 
+    /* start empty and take the first OUT packet, a bus reset ends any transfer */
+    loop_head = 0U;
+    loop_tail = 0U;
+    loop_count = 0U;
+    loop_sending = 0U;
+    packet_sent = 1U;
+    cdc_acm_data_receive(pudev);
+
     return USBD_OK;
 }
 
@@ -278,18 +299,62 @@ usbd_status_enum  cdc_acm_data_handler (void *pudev, usbd_dir_enum rx_tx, uint8_
     if ((USBD_TX == rx_tx) && ((CDC_ACM_DATA_IN_EP & 0x7F) == ep_id)) {
         usb_ep_struct *ep = &((usbd_core_handle_struct *)(pudev))->in_ep[ep_id];
         
-        if (ep->trs_count == ep->maxpacket) {
+        packet_sent = 1U;
+        if (1U == loop_sending) {
+            /* the tail packet is out, its slot can take the next OUT packet */
+            loop_sending = 0U;
+            if (++loop_tail >= CDC_ACM_LOOP_POOL_SIZE) {
+                loop_tail = 0U;
+            }
+            loop_count--;
+            if (1U == packet_receive && CDC_ACM_BENCH_LOOPBACK == cdc_bench_mode) {
+                cdc_acm_data_receive(pudev);
+            }
+        }
+
+        /* a full packet only ends a transfer with a zero length packet, a source
+           stream or a queued loopback packet goes on without one */
+        if (ep->trs_count == ep->maxpacket && CDC_ACM_BENCH_SOURCE != cdc_bench_mode &&
+            (CDC_ACM_BENCH_LOOPBACK != cdc_bench_mode || 0U == loop_count)) {
+            packet_sent = 0U;
             usbd_ep_tx(pudev, ep_id, NULL, 0U);
         } else {
-            packet_sent = 1U;
-            pre_packet_send = 1U;
+            cdc_acm_bench_in(pudev);
         }
         return USBD_OK;
     } else if ((USBD_RX == rx_tx) && ((EP0_OUT & 0x7FU) == ep_id)) {
         cdc_acm_EP0_RxReady (pudev);
     } else if ((USBD_RX == rx_tx) && ((CDC_ACM_DATA_OUT_EP & 0x7FU) == ep_id)) {
+        uint16_t len = usbd_rx_count_get(pudev, CDC_ACM_DATA_OUT_EP);
+
         packet_receive = 1U;
-        receive_length = usbd_rx_count_get(pudev, CDC_ACM_DATA_OUT_EP);
+        switch (cdc_bench_mode) {
+        case CDC_ACM_BENCH_SINK:
+            cdc_acm_data_receive(pudev);
+            break;
+        case CDC_ACM_BENCH_PING:
+            /* answered from the receive buffer, it is re-armed once the answer is out */
+            ping_pending = 1U;
+            ping_length = len;
+            if (1U == packet_sent) {
+                cdc_acm_bench_in(pudev);
+            }
+            break;
+        default:
+            /* queue the packet where it landed, receive into the next free slot */
+            loop_length[loop_head] = len;
+            if (++loop_head >= CDC_ACM_LOOP_POOL_SIZE) {
+                loop_head = 0U;
+            }
+            loop_count++;
+            if (loop_count < CDC_ACM_LOOP_POOL_SIZE) {
+                cdc_acm_data_receive(pudev);
+            }
+            if (1U == packet_sent) {
+                cdc_acm_data_send(pudev);
+            }
+            break;
+        }
         return USBD_OK;
     } else {
 
@@ -348,6 +413,13 @@ usbd_status_enum cdc_acm_req_handler (void *pudev, usb_device_req_struct *req)
             break;
         }
         break;
+    case USB_VENDOR_REQ:
+        if (CDC_ACM_BENCH_SET_MODE == req->bRequest && req->wValue < CDC_ACM_BENCH_MODE_COUNT) {
+            cdc_acm_bench_mode_set(pudev, (uint8_t)req->wValue);
+        } else {
+            usbd_enum_error (pudev, req);
+        }
+        break;
     case USB_STANDARD_REQ:
         /* standard device request */
         switch(req->bRequest) {
@@ -389,22 +461,21 @@ usbd_status_enum cdc_acm_req_handler (void *pudev, usb_device_req_struct *req)
 void cdc_acm_data_receive(void *pudev)
 {
     packet_receive = 0;
-    pre_packet_send = 0;
-    usbd_ep_rx(pudev, CDC_ACM_DATA_OUT_EP, (uint8_t*)(usb_data_buffer), CDC_ACM_DATA_PACKET_SIZE);
+    usbd_ep_rx(pudev, CDC_ACM_DATA_OUT_EP, loop_pool[loop_head], CDC_ACM_DATA_PACKET_SIZE);
 }
 
 /*!
-    \brief      send CDC ACM data
+    \brief      send the oldest looped back packet, the slot is freed once it is out
     \param[in]  pudev: pointer to USB device instance
     \param[out] none
     \retval     USB device operation status
 */
-void cdc_acm_data_send (void *pudev, uint32_t data_len)
+void cdc_acm_data_send (void *pudev)
 {
-    /* limit the transfer data length */
-    if (data_len <= CDC_ACM_DATA_PACKET_SIZE) {
+    if (0U != loop_count) {
         packet_sent = 0;
-        usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, (uint8_t*)(usb_data_buffer), data_len);
+        loop_sending = 1U;
+        usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, loop_pool[loop_tail], loop_length[loop_tail]);
     }
 }
 
@@ -427,10 +498,79 @@ usbd_status_enum cdc_acm_EP0_RxReady (void *pudev)
         linecoding.bParityType = usb_cmd_buffer[5];
         linecoding.bDataBits = usb_cmd_buffer[6];
 
-        packet_receive = 1;
-
         cdc_cmd = NO_CMD;
+
+        /* the baud rate picks the benchmark mode */
+        if (linecoding.dwDTERate >= CDC_ACM_BENCH_BAUD &&
+            linecoding.dwDTERate < CDC_ACM_BENCH_BAUD + CDC_ACM_BENCH_MODE_COUNT) {
+            cdc_acm_bench_mode_set(pudev, linecoding.dwDTERate - CDC_ACM_BENCH_BAUD);
+        } else {
+            cdc_acm_bench_mode_set(pudev, CDC_ACM_BENCH_LOOPBACK);
+        }
     }
 
     return USBD_OK;
 }
+
+/*!
+    \brief      keep the benchmark going once the IN endpoint is idle
+    \param[in]  pudev: pointer to USB device instance
+    \param[out] none
+    \retval     none
+*/
+void cdc_acm_bench_in(void *pudev)
+{
+    switch (cdc_bench_mode) {
+    case CDC_ACM_BENCH_SOURCE:
+        /* a running sequence number lets the host spot lost packets */
+        bench_packet[0] = (uint8_t)bench_sequence;
+        bench_packet[1] = (uint8_t)(bench_sequence >> 8);
+        bench_packet[2] = (uint8_t)(bench_sequence >> 16);
+        bench_packet[3] = (uint8_t)(bench_sequence >> 24);
+        bench_sequence++;
+        packet_sent = 0U;
+        usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, bench_packet, CDC_ACM_DATA_PACKET_SIZE);
+        break;
+    case CDC_ACM_BENCH_PING:
+        if (1U == ping_pending) {
+            ping_pending = 0U;
+            packet_sent = 0U;
+            usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, loop_pool[loop_head], ping_length);
+        } else if (1U == packet_receive) {
+            cdc_acm_data_receive(pudev);
+        }
+        break;
+    default:
+        /* loopback, a packet that was held for a zero length packet goes now */
+        cdc_acm_data_send(pudev);
+        break;
+    }
+}
+
+/*!
+    \brief      switch the benchmark mode, called from the USB isr
+    \param[in]  pudev: pointer to USB device instance
+    \param[in]  mode: CDC_ACM_BENCH_xxx
+    \param[out] none
+    \retval     none
+*/
+void cdc_acm_bench_mode_set(void *pudev, uint8_t mode)
+{
+    cdc_bench_mode = mode;
+    bench_sequence = 0U;
+    ping_pending = 0U;
+
+    /* drop what the last mode left, a packet in flight is flushed by the host.
+       the head slot may be armed on the OUT endpoint, so it stays where it is. */
+    if (1U == packet_sent) {
+        loop_tail = loop_head;
+        loop_count = 0U;
+        cdc_acm_bench_in(pudev);
+    }
+
+    /* sink and loopback take OUT packets at once, while a slot is free */
+    if (1U == packet_receive && loop_count < CDC_ACM_LOOP_POOL_SIZE &&
+        (CDC_ACM_BENCH_SINK == mode || CDC_ACM_BENCH_LOOPBACK == mode)) {
+        cdc_acm_data_receive(pudev);
+    }
+}
@@ -35,6 +35,16 @@
 #define SEND_BREAK                              0x23
 #define NO_CMD                                  0xFF
 
+/* vendor request, wValue is the benchmark mode */
+#define CDC_ACM_BENCH_SET_MODE                  0x01
+
+/* benchmark modes */
+#define CDC_ACM_BENCH_LOOPBACK                  0x00    /* echo through the loop ring */
+#define CDC_ACM_BENCH_SOURCE                    0x01    /* IN only, back to back full packets */
+#define CDC_ACM_BENCH_SINK                      0x02    /* OUT only, data is dropped */
+#define CDC_ACM_BENCH_PING                      0x03    /* every OUT packet is answered at once */
+#define CDC_ACM_BENCH_MODE_COUNT                0x04
+
 #pragma pack(1)
 
 typedef struct
@@ -86,6 +96,7 @@ typedef struct
 extern void* const usbd_strings[USB_STRING_COUNT];
 extern const usb_descriptor_device_struct device_descriptor;
 extern const usb_descriptor_configuration_set_struct configuration_descriptor;
+extern volatile uint8_t cdc_bench_mode;
 
 /* function declarations */
 /* initialize the CDC ACM device */
@@ -100,8 +111,12 @@ usbd_status_enum cdc_acm_data_handler(void *pudev, usbd_dir_enum rx_tx, uint8_t
 /* receive CDC ACM data */
 void cdc_acm_data_receive(void *pudev);
 /* send CDC ACM data */
-void cdc_acm_data_send(void *pudev, uint32_t data_len);
+void cdc_acm_data_send(void *pudev);
+/* IN endpoint is idle, keep the current mode going */
+void cdc_acm_bench_in(void *pudev);
 /* command data received on control endpoint */
 usbd_status_enum cdc_acm_EP0_RxReady(void  *pudev);
+/* switch the benchmark mode */
+void cdc_acm_bench_mode_set(void *pudev, uint8_t mode);
 
 #endif  /* CDC_ACM_CORE_H */
@@ -114,6 +114,18 @@ void  USBD_LP_IRQHandler (void)
     usbd_isr();
 }
 
+/*!
+    \brief      this function handles USBD high priority interrupt, raised by
+                the double buffered bulk endpoints
+    \param[in]  none
+    \param[out] none
+    \retval     none
+*/
+void  USBD_HP_IRQHandler (void)
+{
+    usbd_isr();
+}
+
 #ifdef USB_DEVICE_LOW_PWR_MODE_SUPPORT
 
 /*!
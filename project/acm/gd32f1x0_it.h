@@ -36,5 +36,9 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 /* this function handles SysTick exception */
 void SysTick_Handler(void);
+/* this function handles USBD low priority interrupt */
+void USBD_LP_IRQHandler(void);
+/* this function handles USBD high priority interrupt */
+void USBD_HP_IRQHandler(void);
 
 #endif /* GD32F1X0_IT_H */
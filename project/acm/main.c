@@ -14,11 +14,6 @@
 
 #include "cdc_acm_core.h"
 
-extern uint8_t packet_sent, packet_receive;
-extern uint32_t receive_length;
-extern uint8_t usb_data_buffer[CDC_ACM_DATA_PACKET_SIZE];
-uint32_t pre_packet_send = 1;
-
 usbd_core_handle_struct  usb_device_dev = 
 {
     .dev_desc = (uint8_t *)&device_descriptor,
@@ -60,20 +55,10 @@ int main(void)
     /* now the usb device is connected */
     usb_device_dev.status = USBD_CONNECTED;
 
+    /* all transfers run in the USB isr, sleep until the next interrupt */
     while (1)
     {
-        if (USBD_CONFIGURED == usb_device_dev.status) {
-            if (1 == packet_receive && 1 == pre_packet_send) {
-                cdc_acm_data_receive(&usb_device_dev);
-            }
-
-            if (0 != receive_length) {
-                if (1 == packet_sent) {
-                    cdc_acm_data_send(&usb_device_dev, receive_length);
-                    receive_length = 0;
-                }
-            }
-        }
+        __WFI();
     }
 }
 
@@ -121,4 +106,7 @@ void nvic_config(void)
 
     /* enable the USB low priority interrupt */
     nvic_irq_enable(USBD_LP_IRQn, 1, 0);
+
+    /* enable the USB high priority interrupt for the double buffered endpoints */
+    nvic_irq_enable(USBD_HP_IRQn, 1, 0);
 }
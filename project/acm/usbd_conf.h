@@ -35,6 +35,18 @@
 #define CDC_ACM_CMD_PACKET_SIZE            8U
 #define CDC_ACM_DATA_PACKET_SIZE           64U
 
+/* data endpoints buffer kind, ENDP_SNG_BUF to compare against single buffering.
+   the gain is not measured yet, build both and compare the source and sink
+   MB/s of gd32up usbbench. */
+#define CDC_ACM_DATA_BUF_KIND              ENDP_DBL_BUF
+
+/* loopback packet buffers, OUT receives into one while the others wait for IN */
+#define CDC_ACM_LOOP_POOL_SIZE             4U
+
+/* benchmark modes are selected by the line coding, baud rate base + mode,
+   any other rate is a plain loopback */
+#define CDC_ACM_BENCH_BAUD                 1000U
+
 /* endpoint count used by the CDC ACM device */
 #define EP_COUNT                           (4U)
 
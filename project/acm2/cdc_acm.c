@@ -2,26 +2,20 @@
 #include "usbd_int.h"
 #include "usbd_conf.h"
 #include "gd32f1x0_usart.h"
+#include "gd32f1x0_dma.h"
+#include "ring.h"
+#include "usbd_pma.h"
+#include <string.h>
 
 #define USBD_VID                          0x28E9
 #define USBD_PID                          0x018A
 
-uint8_t usb_cmd_buffer[CDC_ACM_CMD_PACKET_SIZE];
-uint8_t usart_data_buffer[CDC_ACM_DATA_PACKET_SIZE];
-uint8_t usb_usart_buffer[1024];
-volatile uint16_t usb_usart_used = 0;
-volatile uint16_t usb_usart_tcur = 0;
-volatile uint16_t usb_usart_hcur = 0;
-
-volatile uint8_t cdc_altset = 0;
-volatile uint8_t cdc_cmd = NO_CMD;
-volatile uint8_t cdc_tx = 0;
-volatile uint8_t cdc_send_end = 0;
-volatile uint32_t cdc_usart = USART0;
-
-uint8_t cdc_acm_sof(usbd_core_handle_struct *pudev);
-usbd_int_cb_struct usb_inthandler = { cdc_acm_sof };
-usbd_int_cb_struct *usbd_int_fops = &usb_inthandler;
+// the direct copy arms the IN buffer in the descriptor table itself, it does
+// not know about the toggling buffers. checked here, usbd_conf.h is read
+// before the driver defines the buffer kinds.
+#if defined(CDC_ACM_PMA_DIRECT) && CDC_ACM_DATA_BUF_KIND == ENDP_DBL_BUF
+#error "CDC_ACM_PMA_DIRECT needs single buffered data endpoints"
+#endif
 
 typedef struct
 {
@@ -31,27 +25,169 @@ typedef struct
     uint8_t  bDataBits;   /* data bits */
 }line_coding_struct;
 
-line_coding_struct linecoding =
+// one usart bridged to one CDC ACM function.
+typedef struct
+{
+    uint32_t usart;
+    uint32_t tx_pin;
+    exti_line_enum rx_exti;
+    dma_channel_enum rx_dma;
+    dma_channel_enum tx_dma;
+    uint8_t in_ep;
+    uint8_t out_ep;
+    ring_struct *rx_ring;
+    ring_struct *in_ring;           // IN data, the rx ring or the sniffer records
+    line_coding_struct linecoding;
+
+    // OUT packets queued for usart dma, head is armed on the endpoint.
+    uint8_t tx_queue[CDC_ACM_TX_QUEUE_LEN][CDC_ACM_DATA_PACKET_SIZE];
+    volatile uint16_t tx_len[CDC_ACM_TX_QUEUE_LEN];
+    volatile uint8_t tx_head;
+    volatile uint8_t tx_tail;
+    volatile uint8_t tx_count;
+    volatile uint8_t out_paused;
+
+    volatile uint8_t in_busy;
+    volatile uint8_t in_proxy;      // the IN transfer is a proxy reply
+    volatile uint8_t in_drain;
+    volatile uint8_t in_age;
+    volatile uint16_t in_len;
+    uint16_t in_end;                // ring position after the packet in flight
+    cdc_port_stats_struct *stats;
+
+    uint16_t line_state;            // DTR bit 0, RTS bit 1
+    volatile uint16_t break_ms;     // 0xFFFF holds until the host ends it
+
+    // sniffer tap, time of the burst start and flags of its next record.
+    volatile uint8_t sniff_armed;
+    uint8_t sniff_flags;
+    volatile uint32_t sniff_time;
+    uint32_t sniff_lost;            // rx ring overflow already reported
+} cdc_port_struct;
+
+// one step of a target control sequence, levels then time to the next step.
+typedef struct
+{
+    uint8_t nrst;
+    uint8_t boot0;
+    uint16_t us;                    // 0 ends the sequence
+} cdc_line_step_struct;
+
+uint8_t usb_cmd_buffer[CDC_ACM_CMD_PACKET_SIZE];
+
+// live counters, the ring fields are filled in when they are read.
+cdc_stats_struct cdc_stats;
+cdc_stats_struct cdc_stats_reply;
+
+// usart rx dma runs circular over the ring storage, the IN path consumes it.
+RING_DEFINE(cdc_rx_ring0, CDC_ACM_RX_RING_SIZE);
+RING_DEFINE(cdc_rx_ring1, CDC_ACM_RX_RING_SIZE);
+#ifdef CDC_ACM_SNIFFER
+RING_DEFINE(cdc_sniff_ring, CDC_ACM_SNIFF_RING_SIZE);
+#endif
+
+cdc_port_struct cdc_port[CDC_ACM_PORT_COUNT] =
 {
-    115200, /* baud rate     */
-    0x00,   /* stop bits - 1 */
-    0x00,   /* parity - none */
-    0x08    /* num of bits 8 */
+    {
+        .usart = USART0,
+        .tx_pin = GPIO_PIN_9,
+        .rx_exti = EXTI_10,
+        .rx_dma = DMA_CH2,
+        .tx_dma = DMA_CH1,
+        .in_ep = CDC_ACM0_DATA_IN_EP,
+        .out_ep = CDC_ACM0_DATA_OUT_EP,
+        .rx_ring = &cdc_rx_ring0,
+        .in_ring = &cdc_rx_ring0,
+        .stats = &cdc_stats.port[0],
+        .linecoding = { 115200, 0x00, 0x00, 0x08 }
+    },
+    {
+        .usart = USART1,
+        .tx_pin = GPIO_PIN_2,
+        .rx_exti = EXTI_3,
+        .rx_dma = DMA_CH4,
+        .tx_dma = DMA_CH3,
+        .in_ep = CDC_ACM1_DATA_IN_EP,
+        .out_ep = CDC_ACM1_DATA_OUT_EP,
+        .rx_ring = &cdc_rx_ring1,
+        .in_ring = &cdc_rx_ring1,
+        .stats = &cdc_stats.port[1],
+        .linecoding = { 115200, 0x00, 0x00, 0x08 }
+    }
 };
 
+volatile uint8_t cdc_altset = 0;
+volatile uint8_t cdc_cmd = NO_CMD;
+volatile uint8_t cdc_cmd_port = 0;
+
+// IN flush policy, see CDC_ACM_IN_BATCH_SIZE and CDC_ACM_IN_MAX_LATENCY,
+// changed by CDC_VENDOR_SET_IN_BATCH and CDC_VENDOR_SET_IN_LATENCY.
+uint16_t cdc_in_batch = CDC_ACM_IN_BATCH_SIZE;
+uint8_t cdc_in_latency = CDC_ACM_IN_MAX_LATENCY;
+void *cdc_pudev = NULL;
+cdc_port_struct *cdc_flow_port = NULL;
+volatile uint8_t cdc_rts_held = 0;
+cdc_port_struct *cdc_line_port = NULL;
+const cdc_line_step_struct *volatile cdc_line_step = NULL;
+
+// bootloader proxy, one request frame at a time. the reply is built in place,
+// its header goes to offset 4 so it runs straight into the data at offset 8.
+uint8_t cdc_proxy_buf[8 + CDC_ACM_PROXY_PAGE_SIZE];
+volatile uint16_t cdc_proxy_used = 0;
+volatile uint8_t cdc_proxy_ready = 0;
+volatile uint8_t cdc_proxy_flush = 0;
+volatile uint8_t cdc_proxy_zlp = 0;
+uint8_t *cdc_proxy_tx_ptr = NULL;
+volatile uint16_t cdc_proxy_tx_left = 0;
+cdc_port_struct *volatile cdc_proxy_port = NULL;
+cdc_port_struct *volatile cdc_sniff_port = NULL;
+volatile uint32_t cdc_ms = 0;   // SOF count
+
+#ifdef CDC_ACM_LINE_CONTROL
+// BOOT0 high across the reset pulse starts the ROM bootloader.
+const cdc_line_step_struct cdc_line_boot[] =
+{
+    { 1, 1, CDC_ACM_NRST_PULSE_US },
+    { 0, 1, CDC_ACM_NRST_PULSE_US },
+    { 1, 1, CDC_ACM_BOOT0_HOLD_US },
+    { 1, 0, 0 }
+};
+
+const cdc_line_step_struct cdc_line_reset[] =
+{
+    { 0, 0, CDC_ACM_NRST_PULSE_US },
+    { 1, 0, 0 }
+};
+#endif
+
+uint8_t cdc_acm_sof(usbd_core_handle_struct *pudev);
+void cdc_acm_rx_update(cdc_port_struct *p, uint8_t idle);
+void cdc_acm_cts_update(cdc_port_struct *p);
+void cdc_acm_proxy_enter(cdc_port_struct *p);
+void cdc_acm_proxy_out(void *pudev, cdc_port_struct *p, uint16_t rx_len);
+void cdc_acm_proxy_send(void *pudev, cdc_port_struct *p);
+void cdc_acm_sniff_enter(cdc_port_struct *p);
+void cdc_acm_sniff_leave(void);
+void cdc_acm_sniff_out(void *pudev, cdc_port_struct *p, uint16_t rx_len);
+void cdc_acm_sniff_update(cdc_port_struct *p, uint8_t idle);
+void cdc_acm_sniff_pump(void);
+usbd_int_cb_struct usb_inthandler = { cdc_acm_sof };
+usbd_int_cb_struct *usbd_int_fops = &usb_inthandler;
+
 /* note:it should use the C99 standard when compiling the below codes */
 /* USB standard device descriptor */
 const usb_descriptor_device_struct device_descriptor =
 {
-    .Header = 
+    .Header =
      {
-         .bLength = USB_DEVICE_DESC_SIZE, 
+         .bLength = USB_DEVICE_DESC_SIZE,
          .bDescriptorType = USB_DESCTYPE_DEVICE
      },
     .bcdUSB = 0x0200,
-    .bDeviceClass = 0x02,
-    .bDeviceSubClass = 0x00,
-    .bDeviceProtocol = 0x00,
+    // miscellaneous class with IADs, each CDC function is grouped by its IAD.
+    .bDeviceClass = 0xEF,
+    .bDeviceSubClass = 0x02,
+    .bDeviceProtocol = 0x01,
     .bMaxPacketSize0 = USBD_EP0_MAX_SIZE,
     .idVendor = USBD_VID,
     .idProduct = USBD_PID,
@@ -62,154 +198,228 @@ const usb_descriptor_device_struct device_descriptor =
     .bNumberConfigurations = USBD_CFG_MAX_NUM
 };
 
+/* one CDC ACM function, its comm and data interfaces are itf and itf + 1 */
+#define CDC_ACM_FUNCTION_DESC(itf, cmd_ep, out_ep, in_ep) \
+{ \
+    .iad = \
+    { \
+        .Header = \
+         { \
+            .bLength = sizeof(usb_descriptor_iad_struct), \
+            .bDescriptorType = USB_DESCTYPE_IAD \
+         }, \
+        .bFirstInterface = (itf), \
+        .bInterfaceCount = 0x02, \
+        .bFunctionClass = 0x02, \
+        .bFunctionSubClass = 0x02, \
+        .bFunctionProtocol = 0x01, \
+        .iFunction = 0x00 \
+    }, \
+ \
+    .cmd_interface = \
+    { \
+        .Header = \
+         { \
+             .bLength = sizeof(usb_descriptor_interface_struct), \
+             .bDescriptorType = USB_DESCTYPE_INTERFACE \
+         }, \
+        .bInterfaceNumber = (itf), \
+        .bAlternateSetting = 0x00, \
+        .bNumEndpoints = 0x01, \
+        .bInterfaceClass = 0x02, \
+        .bInterfaceSubClass = 0x02, \
+        .bInterfaceProtocol = 0x01, \
+        .iInterface = 0x00 \
+    }, \
+ \
+    .header = \
+    { \
+        .Header = \
+         { \
+            .bLength = sizeof(usb_descriptor_header_function_struct), \
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE \
+         }, \
+        .bDescriptorSubtype = 0x00, \
+        .bcdCDC = 0x0110 \
+    }, \
+ \
+    .call_managment = \
+    { \
+        .Header = \
+         { \
+            .bLength = sizeof(usb_descriptor_call_managment_function_struct), \
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE \
+         }, \
+        .bDescriptorSubtype = 0x01, \
+        .bmCapabilities = 0x00, \
+        .bDataInterface = (itf) + 1 \
+    }, \
+ \
+    .acm = \
+    { \
+        .Header = \
+         { \
+            .bLength = sizeof(usb_descriptor_acm_function_struct), \
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE \
+         }, \
+        .bDescriptorSubtype = 0x02, \
+        .bmCapabilities = 0x02, \
+    }, \
+ \
+    .union_function = \
+    { \
+        .Header = \
+         { \
+            .bLength = sizeof(usb_descriptor_union_function_struct), \
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE \
+         }, \
+        .bDescriptorSubtype = 0x06, \
+        .bMasterInterface = (itf), \
+        .bSlaveInterface0 = (itf) + 1, \
+    }, \
+ \
+    .cmd_endpoint = \
+    { \
+        .Header = \
+         { \
+            .bLength = sizeof(usb_descriptor_endpoint_struct), \
+            .bDescriptorType = USB_DESCTYPE_ENDPOINT \
+         }, \
+        .bEndpointAddress = (cmd_ep), \
+        .bmAttributes = 0x03, \
+        .wMaxPacketSize = CDC_ACM_CMD_PACKET_SIZE, \
+        .bInterval = 0x0A \
+    }, \
+ \
+    .data_interface = \
+    { \
+        .Header = \
+         { \
+            .bLength = sizeof(usb_descriptor_interface_struct), \
+            .bDescriptorType = USB_DESCTYPE_INTERFACE \
+         }, \
+        .bInterfaceNumber = (itf) + 1, \
+        .bAlternateSetting = 0x00, \
+        .bNumEndpoints = 0x02, \
+        .bInterfaceClass = 0x0A, \
+        .bInterfaceSubClass = 0x00, \
+        .bInterfaceProtocol = 0x00, \
+        .iInterface = 0x00 \
+    }, \
+ \
+    .out_endpoint = \
+    { \
+        .Header = \
+         { \
+             .bLength = sizeof(usb_descriptor_endpoint_struct), \
+             .bDescriptorType = USB_DESCTYPE_ENDPOINT \
+         }, \
+        .bEndpointAddress = (out_ep), \
+        .bmAttributes = 0x02, \
+        .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE, \
+        .bInterval = 0x00 \
+    }, \
+ \
+    .in_endpoint = \
+    { \
+        .Header = \
+         { \
+             .bLength = sizeof(usb_descriptor_endpoint_struct), \
+             .bDescriptorType = USB_DESCTYPE_ENDPOINT \
+         }, \
+        .bEndpointAddress = (in_ep), \
+        .bmAttributes = 0x02, \
+        .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE, \
+        .bInterval = 0x00 \
+    } \
+}
+
 /* USB device configuration descriptor */
-const usb_descriptor_configuration_set_struct configuration_descriptor = 
+const usb_descriptor_configuration_set_struct configuration_descriptor =
 {
-    .config = 
+    .config =
     {
-        .Header = 
+        .Header =
          {
-            .bLength = sizeof(usb_descriptor_configuration_struct), 
+            .bLength = sizeof(usb_descriptor_configuration_struct),
             .bDescriptorType = USB_DESCTYPE_CONFIGURATION
          },
         .wTotalLength = USB_CDC_ACM_CONFIG_DESC_SIZE,
-        .bNumInterfaces = 0x02,
+        .bNumInterfaces = CDC_ACM_INTERFACE_COUNT,
         .bConfigurationValue = 0x01,
         .iConfiguration = 0x00,
         .bmAttributes = 0x80,
         .bMaxPower = 0x32
     },
 
-    .cdc_loopback_interface = 
+    .cdc =
     {
-        .Header = 
-         {
-             .bLength = sizeof(usb_descriptor_interface_struct), 
-             .bDescriptorType = USB_DESCTYPE_INTERFACE 
-         },
-        .bInterfaceNumber = 0x00,
-        .bAlternateSetting = 0x00,
-        .bNumEndpoints = 0x01,
-        .bInterfaceClass = 0x02,
-        .bInterfaceSubClass = 0x02,
-        .bInterfaceProtocol = 0x01,
-        .iInterface = 0x00
+        CDC_ACM_FUNCTION_DESC(0x00, CDC_ACM0_CMD_EP, CDC_ACM0_DATA_OUT_EP, CDC_ACM0_DATA_IN_EP),
+#ifndef CDC_ACM_VENDOR_PORT
+        CDC_ACM_FUNCTION_DESC(0x02, CDC_ACM1_CMD_EP, CDC_ACM1_DATA_OUT_EP, CDC_ACM1_DATA_IN_EP)
+#endif
     },
 
-    .cdc_loopback_header = 
+#ifdef CDC_ACM_VENDOR_PORT
+    .vendor =
     {
-        .Header =
-         {
-            .bLength = sizeof(usb_descriptor_header_function_struct), 
-            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
-         },
-        .bDescriptorSubtype = 0x00,
-        .bcdCDC = 0x0110
-    },
+        .data_interface =
+        {
+            .Header =
+             {
+                 .bLength = sizeof(usb_descriptor_interface_struct),
+                 .bDescriptorType = USB_DESCTYPE_INTERFACE
+             },
+            .bInterfaceNumber = 0x02,
+            .bAlternateSetting = 0x00,
+            .bNumEndpoints = 0x02,
+            .bInterfaceClass = 0xFF,
+            .bInterfaceSubClass = 0x00,
+            .bInterfaceProtocol = 0x00,
+            .iInterface = 0x00
+        },
 
-    .cdc_loopback_call_managment = 
-    {
-        .Header = 
-         {
-            .bLength = sizeof(usb_descriptor_call_managment_function_struct), 
-            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
-         },
-        .bDescriptorSubtype = 0x01,
-        .bmCapabilities = 0x00,
-        .bDataInterface = 0x01
-    },
+        .out_endpoint =
+        {
+            .Header =
+             {
+                 .bLength = sizeof(usb_descriptor_endpoint_struct),
+                 .bDescriptorType = USB_DESCTYPE_ENDPOINT
+             },
+            .bEndpointAddress = CDC_ACM1_DATA_OUT_EP,
+            .bmAttributes = 0x02,
+            .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE,
+            .bInterval = 0x00
+        },
 
-    .cdc_loopback_acm = 
-    {
-        .Header = 
-         {
-            .bLength = sizeof(usb_descriptor_acm_function_struct), 
-            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
-         },
-        .bDescriptorSubtype = 0x02,
-        .bmCapabilities = 0x02,
-    },
-
-    .cdc_loopback_union = 
-    {
-        .Header = 
-         {
-            .bLength = sizeof(usb_descriptor_union_function_struct), 
-            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
-         },
-        .bDescriptorSubtype = 0x06,
-        .bMasterInterface = 0x00,
-        .bSlaveInterface0 = 0x01,
-    },
-
-    .cdc_loopback_cmd_endpoint = 
-    {
-        .Header = 
-         {
-            .bLength = sizeof(usb_descriptor_endpoint_struct), 
-            .bDescriptorType = USB_DESCTYPE_ENDPOINT
-         },
-        .bEndpointAddress = CDC_ACM_CMD_EP,
-        .bmAttributes = 0x03,
-        .wMaxPacketSize = CDC_ACM_CMD_PACKET_SIZE,
-        .bInterval = 0x0A
-    },
-
-    .cdc_loopback_data_interface = 
-    {
-        .Header = 
-         {
-            .bLength = sizeof(usb_descriptor_interface_struct), 
-            .bDescriptorType = USB_DESCTYPE_INTERFACE
-         },
-        .bInterfaceNumber = 0x01,
-        .bAlternateSetting = 0x00,
-        .bNumEndpoints = 0x02,
-        .bInterfaceClass = 0x0A,
-        .bInterfaceSubClass = 0x00,
-        .bInterfaceProtocol = 0x00,
-        .iInterface = 0x00
-    },
-
-    .cdc_loopback_out_endpoint = 
-    {
-        .Header = 
-         {
-             .bLength = sizeof(usb_descriptor_endpoint_struct), 
-             .bDescriptorType = USB_DESCTYPE_ENDPOINT 
-         },
-        .bEndpointAddress = CDC_ACM_DATA_OUT_EP,
-        .bmAttributes = 0x02,
-        .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE,
-        .bInterval = 0x00
-    },
-
-    .cdc_loopback_in_endpoint = 
-    {
-        .Header = 
-         {
-             .bLength = sizeof(usb_descriptor_endpoint_struct), 
-             .bDescriptorType = USB_DESCTYPE_ENDPOINT 
-         },
-        .bEndpointAddress = CDC_ACM_DATA_IN_EP,
-        .bmAttributes = 0x02,
-        .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE,
-        .bInterval = 0x00
+        .in_endpoint =
+        {
+            .Header =
+             {
+                 .bLength = sizeof(usb_descriptor_endpoint_struct),
+                 .bDescriptorType = USB_DESCTYPE_ENDPOINT
+             },
+            .bEndpointAddress = CDC_ACM1_DATA_IN_EP,
+            .bmAttributes = 0x02,
+            .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE,
+            .bInterval = 0x00
+        }
     }
+#endif
 };
 
 /* USB language ID Descriptor */
-const usb_descriptor_language_id_struct usbd_language_id_desc = 
+const usb_descriptor_language_id_struct usbd_language_id_desc =
 {
-    .Header = 
+    .Header =
      {
-         .bLength = sizeof(usb_descriptor_language_id_struct), 
+         .bLength = sizeof(usb_descriptor_language_id_struct),
          .bDescriptorType = USB_DESCTYPE_STRING
      },
     .wLANGID = ENG_LANGID
 };
 
-void *const usbd_strings[] = 
+void *const usbd_strings[] =
 {
     [USBD_LANGID_STR_IDX] = (uint8_t *)&usbd_language_id_desc,
     [USBD_MFC_STR_IDX] = USBD_STRING_DESC("GigaDevice"),
@@ -217,41 +427,42 @@ void *const usbd_strings[] =
     [USBD_SERIAL_STR_IDX] = USBD_STRING_DESC("GD32F1x0-3.0.0-7z8x9yer")
 };
 
-void cdc_acm_usart_configure()
+// the usart takes the line coding as it is, no magic rates.
+void cdc_acm_usart_format(cdc_port_struct *p)
 {
     uint32_t stop_type, parity_type, data_type;;
-    
-    switch (linecoding.bParityType) {
+
+    switch (p->linecoding.bParityType) {
     case 0:
         parity_type = USART_PM_NONE;
         break;
     case 1:
         parity_type = USART_PM_EVEN;
         break;
-    case 2: 
+    case 2:
         parity_type = USART_PM_ODD;
         break;
     default:
         parity_type = USART_PM_NONE;
         break;
     }
-    
-    switch (linecoding.bCharFormat) {
-    case 0: 
-        stop_type = USART_STB_1BIT; 
+
+    switch (p->linecoding.bCharFormat) {
+    case 0:
+        stop_type = USART_STB_1BIT;
         break;
-    case 1: 
-        stop_type = USART_STB_1_5BIT; 
+    case 1:
+        stop_type = USART_STB_1_5BIT;
         break;
-    case 2: 
-        stop_type = USART_STB_2BIT; 
+    case 2:
+        stop_type = USART_STB_2BIT;
         break;
     default:
-        stop_type = USART_STB_1BIT; 
+        stop_type = USART_STB_1BIT;
         break;
     }
-    
-    switch (linecoding.bDataBits) {
+
+    switch (p->linecoding.bDataBits) {
     case 0x07:
         data_type = USART_WL_8BIT;
         break;
@@ -265,72 +476,249 @@ void cdc_acm_usart_configure()
         data_type = USART_WL_8BIT;
         break;
     }
-    
-    usart_baudrate_set(cdc_usart, linecoding.dwDTERate);
-    usart_parity_config(cdc_usart, parity_type);
-    usart_stop_bit_set(cdc_usart, stop_type); 
-    usart_word_length_set(cdc_usart, data_type);
-    usart_enable(cdc_usart);
+
+    usart_baudrate_set(p->usart, p->linecoding.dwDTERate);
+    usart_parity_config(p->usart, parity_type);
+    usart_stop_bit_set(p->usart, stop_type);
+    usart_word_length_set(p->usart, data_type);
+    usart_enable(p->usart);
 }
 
-void cdc_acm_update_linecoding_from_usb_buffer()
-{   
-    linecoding.dwDTERate = usb_cmd_buffer[0];
-    linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[1] << 8;
-    linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[2] << 16;
-    linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[3] << 24;
-    linecoding.bCharFormat = usb_cmd_buffer[4];
-    linecoding.bParityType = usb_cmd_buffer[5];
-    linecoding.bDataBits = usb_cmd_buffer[6];
+void cdc_acm_usart_configure(cdc_port_struct *p)
+{
+#ifdef CDC_ACM_SNIFFER
+    // the sniffer streams on the port that asked for it, any other rate ends it.
+    if (p == cdc_sniff_port && p->linecoding.dwDTERate != CDC_ACM_SNIFF_BAUD)
+        cdc_acm_sniff_leave();
+    if (p->linecoding.dwDTERate == CDC_ACM_SNIFF_BAUD) {
+        cdc_acm_sniff_enter(p);
+        return;
+    }
+#endif
+
+    // the magic rate turns the port into a bootloader proxy.
+    if (p->linecoding.dwDTERate == CDC_ACM_PROXY_BAUD) {
+        cdc_acm_proxy_enter(p);
+        return;
+    }
+    if (p == cdc_proxy_port)
+        cdc_proxy_port = NULL;
+
+    cdc_acm_usart_format(p);
 }
 
-void cdc_acm_update_linecoding_to_usb_buffer()
+void cdc_acm_update_linecoding_from_usb_buffer(cdc_port_struct *p)
 {
-    usb_cmd_buffer[0] = linecoding.dwDTERate;
-    usb_cmd_buffer[1] = linecoding.dwDTERate >> 8;
-    usb_cmd_buffer[2] = linecoding.dwDTERate >> 16;
-    usb_cmd_buffer[3] = linecoding.dwDTERate >> 24;
-    usb_cmd_buffer[4] = linecoding.bCharFormat;
-    usb_cmd_buffer[5] = linecoding.bParityType;
-    usb_cmd_buffer[6] = linecoding.bDataBits;
+    p->linecoding.dwDTERate = usb_cmd_buffer[0];
+    p->linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[1] << 8;
+    p->linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[2] << 16;
+    p->linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[3] << 24;
+    p->linecoding.bCharFormat = usb_cmd_buffer[4];
+    p->linecoding.bParityType = usb_cmd_buffer[5];
+    p->linecoding.bDataBits = usb_cmd_buffer[6];
+}
+
+void cdc_acm_update_linecoding_to_usb_buffer(cdc_port_struct *p)
+{
+    usb_cmd_buffer[0] = p->linecoding.dwDTERate;
+    usb_cmd_buffer[1] = p->linecoding.dwDTERate >> 8;
+    usb_cmd_buffer[2] = p->linecoding.dwDTERate >> 16;
+    usb_cmd_buffer[3] = p->linecoding.dwDTERate >> 24;
+    usb_cmd_buffer[4] = p->linecoding.bCharFormat;
+    usb_cmd_buffer[5] = p->linecoding.bParityType;
+    usb_cmd_buffer[6] = p->linecoding.bDataBits;
 }
 
 usbd_status_enum cdc_acm_init(void *pudev, uint8_t config_index)
 {
-    usbd_ep_init(pudev, ENDP_SNG_BUF, &(configuration_descriptor.cdc_loopback_in_endpoint));
-    usbd_ep_init(pudev, ENDP_SNG_BUF, &(configuration_descriptor.cdc_loopback_out_endpoint));
-    usbd_ep_init(pudev, ENDP_SNG_BUF, &(configuration_descriptor.cdc_loopback_cmd_endpoint));
-    usbd_ep_rx(pudev, CDC_ACM_DATA_OUT_EP, usart_data_buffer, CDC_ACM_DATA_PACKET_SIZE);
+    const usb_descriptor_cdc_acm_function_struct *desc;
+    cdc_port_struct *p;
+    uint8_t i;
+
+    cdc_pudev = pudev;
+    for (i = 0; i < CDC_ACM_FUNCTION_COUNT; i++) {
+        desc = &configuration_descriptor.cdc[i];
+
+        // data endpoints are CDC_ACM_DATA_BUF_KIND, single buffered unless
+        // usbd_conf.h asks for double buffers.
+        usbd_ep_init(pudev, CDC_ACM_DATA_BUF_KIND, &desc->in_endpoint);
+        usbd_ep_init(pudev, CDC_ACM_DATA_BUF_KIND, &desc->out_endpoint);
+        usbd_ep_init(pudev, ENDP_SNG_BUF, &desc->cmd_endpoint);
+    }
+#ifdef CDC_ACM_VENDOR_PORT
+    usbd_ep_init(pudev, CDC_ACM_DATA_BUF_KIND, &configuration_descriptor.vendor.in_endpoint);
+    usbd_ep_init(pudev, CDC_ACM_DATA_BUF_KIND, &configuration_descriptor.vendor.out_endpoint);
+#endif
+
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+        p = &cdc_port[i];
+
+        // a transfer cut off by a bus reset never completes.
+        p->in_busy = 0;
+        p->in_proxy = 0;
+
+        // the queue drains by itself, arm the endpoint on the free head slot.
+        p->out_paused = 0;
+        if (p->tx_count < CDC_ACM_TX_QUEUE_LEN)
+            usbd_ep_rx(pudev, p->out_ep, p->tx_queue[p->tx_head], CDC_ACM_DATA_PACKET_SIZE);
+        else
+            p->out_paused = 1;
+    }
     return USBD_OK;
 }
 
 usbd_status_enum cdc_acm_deinit(void *pudev, uint8_t config_index)
 {
-    usbd_ep_deinit(pudev, CDC_ACM_DATA_IN_EP);
-    usbd_ep_deinit(pudev, CDC_ACM_DATA_OUT_EP);
-    usbd_ep_deinit(pudev, CDC_ACM_CMD_EP);
+    uint8_t i;
+
+    for (i = 0; i < CDC_ACM_FUNCTION_COUNT; i++) {
+        usbd_ep_deinit(pudev, configuration_descriptor.cdc[i].in_endpoint.bEndpointAddress);
+        usbd_ep_deinit(pudev, configuration_descriptor.cdc[i].out_endpoint.bEndpointAddress);
+        usbd_ep_deinit(pudev, configuration_descriptor.cdc[i].cmd_endpoint.bEndpointAddress);
+    }
+#ifdef CDC_ACM_VENDOR_PORT
+    usbd_ep_deinit(pudev, configuration_descriptor.vendor.in_endpoint.bEndpointAddress);
+    usbd_ep_deinit(pudev, configuration_descriptor.vendor.out_endpoint.bEndpointAddress);
+#endif
     return USBD_OK;
 }
 
 usbd_status_enum cdc_acm_data_handler(void *pudev, usbd_dir_enum rx_tx, uint8_t ep_id)
 {
+    cdc_port_struct *p;
+    uint8_t i;
+
     if ((USBD_RX == rx_tx) && ((EP0_OUT & 0x7FU) == ep_id)) {
         if (NO_CMD == cdc_cmd)
             return USBD_OK;
-        cdc_acm_update_linecoding_from_usb_buffer();
-        cdc_acm_usart_configure();
+        p = &cdc_port[cdc_cmd_port];
+        cdc_acm_update_linecoding_from_usb_buffer(p);
+        cdc_acm_usart_configure(p);
         cdc_cmd = NO_CMD;
-    } else if ((USBD_TX == rx_tx) && ((CDC_ACM_DATA_IN_EP & 0x7F) == ep_id)) {
-        cdc_acm_data_in(pudev);
-    } else if ((USBD_RX == rx_tx) && ((CDC_ACM_DATA_OUT_EP & 0x7FU) == ep_id)) {
-        cdc_acm_data_out(pudev);
+        return USBD_OK;
+    }
+
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+        p = &cdc_port[i];
+        if ((USBD_TX == rx_tx) && ((p->in_ep & 0x7F) == ep_id)) {
+            cdc_acm_data_in(pudev, i);
+            return USBD_OK;
+        } else if ((USBD_RX == rx_tx) && ((p->out_ep & 0x7FU) == ep_id)) {
+            cdc_acm_data_out(pudev, i);
+            return USBD_OK;
+        }
+    }
+    return USBD_FAIL;
+}
+
+void cdc_acm_line_step()
+{
+#ifdef CDC_ACM_LINE_CONTROL
+    const cdc_line_step_struct *s = cdc_line_step;
+    uint16_t us;
+
+    if (s == NULL)
+        return;
+
+    // BOOT0 first, it has to be stable when NRST rises.
+    if (s->boot0)
+        gpio_bit_set(CDC_ACM_BOOT0_PORT, CDC_ACM_BOOT0_PIN);
+    else
+        gpio_bit_reset(CDC_ACM_BOOT0_PORT, CDC_ACM_BOOT0_PIN);
+    if (s->nrst)
+        gpio_bit_set(CDC_ACM_NRST_PORT, CDC_ACM_NRST_PIN);
+    else
+        gpio_bit_reset(CDC_ACM_NRST_PORT, CDC_ACM_NRST_PIN);
+
+    if (s->us == 0) {
+        cdc_line_step = NULL;
+        return;
+    }
+
+    // single pulse mode, the update event stops the timer after us ticks.
+    us = s->us < 2 ? 2 : s->us;
+    cdc_line_step = s + 1;
+    timer_autoreload_value_config(TIMER13, us - 1);
+    timer_counter_value_config(TIMER13, 0);
+    timer_enable(TIMER13);
+#endif
+}
+
+void cdc_acm_line_run(const cdc_line_step_struct *seq)
+{
+#ifdef CDC_ACM_LINE_CONTROL
+    // a new request cuts a running sequence short.
+    timer_disable(TIMER13);
+    timer_interrupt_flag_clear(TIMER13, TIMER_INT_UP);
+    cdc_line_step = seq;
+    cdc_acm_line_step();
+#endif
+}
+
+void cdc_acm_line_isr(void)
+{
+#ifdef CDC_ACM_LINE_CONTROL
+    if (RESET != timer_interrupt_flag_get(TIMER13, TIMER_INT_UP)) {
+        timer_interrupt_flag_clear(TIMER13, TIMER_INT_UP);
+        cdc_acm_line_step();
+    }
+#endif
+}
+
+void cdc_acm_line_init(cdc_port_struct *p)
+{
+#ifdef CDC_ACM_LINE_CONTROL
+    timer_parameter_struct timer_initpara;
+
+    // NRST is open drain, the target keeps its own pull-up.
+    gpio_bit_set(CDC_ACM_NRST_PORT, CDC_ACM_NRST_PIN);
+    gpio_mode_set(CDC_ACM_NRST_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, CDC_ACM_NRST_PIN);
+    gpio_output_options_set(CDC_ACM_NRST_PORT, GPIO_OTYPE_OD, GPIO_OSPEED_10MHZ, CDC_ACM_NRST_PIN);
+    gpio_bit_reset(CDC_ACM_BOOT0_PORT, CDC_ACM_BOOT0_PIN);
+    gpio_mode_set(CDC_ACM_BOOT0_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, CDC_ACM_BOOT0_PIN);
+    gpio_output_options_set(CDC_ACM_BOOT0_PORT, GPIO_OTYPE_PP, GPIO_OSPEED_10MHZ, CDC_ACM_BOOT0_PIN);
+
+    // 1 MHz ticks, the timer clock runs at the core clock.
+    rcu_periph_clock_enable(RCU_TIMER13);
+    timer_deinit(TIMER13);
+    timer_initpara.prescaler = SystemCoreClock / 1000000U - 1;
+    timer_initpara.alignedmode = TIMER_COUNTER_EDGE;
+    timer_initpara.counterdirection = TIMER_COUNTER_UP;
+    timer_initpara.period = 0xFFFF;
+    timer_initpara.clockdivision = TIMER_CKDIV_DIV1;
+    timer_initpara.repetitioncounter = 0;
+    timer_init(TIMER13, &timer_initpara);
+    timer_single_pulse_mode_config(TIMER13, TIMER_SP_MODE_SINGLE);
+    timer_update_source_config(TIMER13, TIMER_UPDATE_SRC_REGULAR);
+    timer_interrupt_flag_clear(TIMER13, TIMER_INT_UP);
+    timer_interrupt_enable(TIMER13, TIMER_INT_UP);
+    cdc_line_port = p;
+#endif
+}
+
+void cdc_acm_line_state(cdc_port_struct *p, uint16_t state)
+{
+#ifdef CDC_ACM_LINE_CONTROL
+    // a rising DTR resets the target, RTS picks the boot mode.
+    if (p == cdc_line_port && (state & ~p->line_state & 0x01))
+        cdc_acm_line_run((state & 0x02) ? cdc_line_boot : cdc_line_reset);
+#endif
+    p->line_state = state;
+}
+
+void cdc_acm_break(cdc_port_struct *p, uint16_t ms)
+{
+    // the usart can only send a one frame break, hold the tx pin low instead.
+    if (ms) {
+        gpio_bit_reset(GPIOA, p->tx_pin);
+        gpio_mode_set(GPIOA, GPIO_MODE_OUTPUT, GPIO_PUPD_PULLUP, p->tx_pin);
     } else {
-        return USBD_FAIL;
+        gpio_mode_set(GPIOA, GPIO_MODE_AF, GPIO_PUPD_PULLUP, p->tx_pin);
     }
-    return USBD_OK;
+    p->break_ms = ms;
 }
 
-void usb_acm_control(usb_device_req_struct *req)
+void usb_acm_control(cdc_port_struct *p, usb_device_req_struct *req)
 {
     switch (req->bRequest) {
     case SEND_ENCAPSULATED_COMMAND:
@@ -344,64 +732,130 @@ void usb_acm_control(usb_device_req_struct *req)
     case CLEAR_COMM_FEATURE:
         break;
     case SET_LINE_CODING:
-        cdc_acm_update_linecoding_from_usb_buffer();
-        cdc_acm_usart_configure();
+        cdc_acm_update_linecoding_from_usb_buffer(p);
+        cdc_acm_usart_configure(p);
         break;
     case GET_LINE_CODING:
-        cdc_acm_update_linecoding_to_usb_buffer();
+        cdc_acm_update_linecoding_to_usb_buffer(p);
         break;
     case SET_CONTROL_LINE_STATE:
+        cdc_acm_line_state(p, req->wValue);
         break;
     case SEND_BREAK:
+        cdc_acm_break(p, req->wValue);
         break;
     default:
         break;
     }
 }
 
+// a line control request of a port, a data stage goes through usb_cmd_buffer.
+void cdc_acm_port_request(void *pudev, uint8_t port, usb_device_req_struct *req)
+{
+    if (req->wLength) {
+        if (req->bmRequestType & 0x80) {
+            usb_acm_control(&cdc_port[port], req);
+            usbd_ep_tx(pudev, EP0_IN, usb_cmd_buffer, req->wLength);
+        } else {
+            cdc_cmd = req->bRequest;
+            cdc_cmd_port = port;
+            usbd_ep_rx(pudev, EP0_OUT, usb_cmd_buffer, req->wLength);
+        }
+    } else
+        usb_acm_control(&cdc_port[port], req);
+}
+
 usbd_status_enum cdc_acm_req_handler(void *pudev, usb_device_req_struct *req)
 {
+    // each function owns two interfaces, the comm interface is the even one.
+    // the vendor interface follows them, so it maps to the vendor port too.
+    uint8_t port = (uint8_t)req->wIndex >> 1;
+
     switch (req->bmRequestType & USB_REQ_MASK) {
     case USB_CLASS_REQ:
-        if (req->wLength) {
-            if (req->bmRequestType & 0x80) {
-                usb_acm_control(req);
-                usbd_ep_tx(pudev, EP0_IN, usb_cmd_buffer, req->wLength);
-            } else {
-                cdc_cmd = req->bRequest;
-                usbd_ep_rx(pudev, EP0_OUT, usb_cmd_buffer, req->wLength);
+        if (port >= CDC_ACM_FUNCTION_COUNT) {
+            usbd_enum_error(pudev, req);
+            break;
+        }
+        cdc_acm_port_request(pudev, port, req);
+        break;
+
+    case USB_VENDOR_REQ:
+        switch (req->bRequest) {
+        case CDC_VENDOR_GET_STATS:
+            if (!(req->bmRequestType & 0x80)) {
+                usbd_enum_error(pudev, req);
+                break;
+            }
+            cdc_acm_stats_get(&cdc_stats_reply, req->wValue == 1);
+            usbd_ep_tx(pudev, EP0_IN, (uint8_t *)&cdc_stats_reply,
+                MIN(sizeof(cdc_stats_reply), req->wLength));
+            break;
+
+        // a waiting batch goes out by the new latency at the latest.
+        case CDC_VENDOR_SET_IN_BATCH:
+            if ((req->bmRequestType & 0x80) || req->wLength != 0 ||
+                req->wValue == 0 || req->wValue > CDC_ACM_RX_HIGH_WATER) {
+                usbd_enum_error(pudev, req);
+                break;
             }
-        } else
-            usb_acm_control(req);
+            cdc_in_batch = req->wValue;
+            break;
+
+        case CDC_VENDOR_SET_IN_LATENCY:
+            if ((req->bmRequestType & 0x80) || req->wLength != 0 ||
+                req->wValue == 0 || req->wValue > 255) {
+                usbd_enum_error(pudev, req);
+                break;
+            }
+            cdc_in_latency = req->wValue;
+            break;
+
+#ifdef CDC_ACM_VENDOR_PORT
+        case CDC_VENDOR_SET_LINE_CODING:
+        case CDC_VENDOR_GET_LINE_CODING:
+            if (port != CDC_ACM_FUNCTION_COUNT || req->wLength != 7) {
+                usbd_enum_error(pudev, req);
+                break;
+            }
+            cdc_acm_port_request(pudev, port, req);
+            break;
+#endif
+
+        default:
+            usbd_enum_error(pudev, req);
+            break;
+        }
         break;
-        
+
     case USB_STANDARD_REQ:
         /* standard device request */
         switch(req->bRequest) {
         case USBREQ_GET_INTERFACE: {
             usbd_ep_tx(pudev, EP0_IN, (uint8_t *)&cdc_altset, 1);
             break; }
-            
+
+        // every interface has alternate setting 0 only.
         case USBREQ_SET_INTERFACE: {
-            if ((uint8_t)(req->wValue) < USBD_ITF_MAX_NUM) {
+            if ((uint8_t)req->wIndex < USBD_ITF_MAX_NUM && req->wValue == 0) {
                 cdc_altset = req->wValue;
             } else {
                 /* call the error management function (command will be nacked */
                 usbd_enum_error(pudev, req);
             }
             break; }
-            
-        case USBREQ_GET_DESCRIPTOR: {
-            uint16_t len = CDC_ACM_DESC_SIZE;
-            uint8_t  *pbuf= (uint8_t*)(&configuration_descriptor) + 9;
 
-            if (CDC_ACM_DESC_TYPE == (req->wValue >> 8)) {
-                len = MIN(CDC_ACM_DESC_SIZE, req->wLength);
-                pbuf = (uint8_t*)(&configuration_descriptor) + 9 + (9 * USBD_ITF_MAX_NUM);
+        // only a comm interface has class descriptors, those of its own function.
+        case USBREQ_GET_DESCRIPTOR: {
+            if (CDC_ACM_DESC_TYPE != (req->wValue >> 8) ||
+                port >= CDC_ACM_FUNCTION_COUNT || (req->wIndex & 1U)) {
+                usbd_enum_error(pudev, req);
+                break;
             }
-            usbd_ep_tx(pudev, EP0_IN, pbuf, len);
+            usbd_ep_tx(pudev, EP0_IN, (uint8_t *)&configuration_descriptor.cdc[port].header,
+                MIN(CDC_ACM_DESC_SIZE, req->wLength));
             break; }
-            
+
         default:
             break;
         }
@@ -412,111 +866,878 @@ usbd_status_enum cdc_acm_req_handler(void *pudev, usb_device_req_struct *req)
     return USBD_OK;
 }
 
-void cdc_acm_enable_usart(uint32_t usart_periph)
+void cdc_acm_rx_dma_configure(cdc_port_struct *p)
+{
+    dma_parameter_struct dma_init_struct;
+
+    // usart rx runs circular into the ring storage, dma is the producer.
+    dma_deinit(p->rx_dma);
+    dma_init_struct.direction = DMA_PERIPHERAL_TO_MEMORY;
+    dma_init_struct.memory_addr = (uint32_t)p->rx_ring->buf;
+    dma_init_struct.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+    dma_init_struct.memory_width = DMA_MEMORY_WIDTH_8BIT;
+    dma_init_struct.number = ring_size(p->rx_ring);
+    dma_init_struct.periph_addr = (uint32_t)&USART_RDATA(p->usart);
+    dma_init_struct.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+    dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_8BIT;
+    dma_init_struct.priority = DMA_PRIORITY_ULTRA_HIGH;
+    dma_init(p->rx_dma, dma_init_struct);
+    dma_circulation_enable(p->rx_dma);
+    dma_interrupt_enable(p->rx_dma, DMA_INT_HTF);
+    dma_interrupt_enable(p->rx_dma, DMA_INT_FTF);
+    dma_channel_enable(p->rx_dma);
+
+    ring_reset(p->rx_ring);
+    usart_dma_receive_config(p->usart, USART_DENR_ENABLE);
+}
+
+void cdc_acm_tx_dma_configure(cdc_port_struct *p)
+{
+    dma_parameter_struct dma_init_struct;
+
+    // one transfer per queued OUT packet, address and size set on start.
+    dma_deinit(p->tx_dma);
+    dma_init_struct.direction = DMA_MEMORY_TO_PERIPHERAL;
+    dma_init_struct.memory_addr = (uint32_t)p->tx_queue[0];
+    dma_init_struct.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+    dma_init_struct.memory_width = DMA_MEMORY_WIDTH_8BIT;
+    dma_init_struct.number = 0;
+    dma_init_struct.periph_addr = (uint32_t)&USART_TDATA(p->usart);
+    dma_init_struct.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+    dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_8BIT;
+    dma_init_struct.priority = DMA_PRIORITY_HIGH;
+    dma_init(p->tx_dma, dma_init_struct);
+    dma_interrupt_enable(p->tx_dma, DMA_INT_FTF);
+
+    usart_dma_transmit_config(p->usart, USART_DENT_ENABLE);
+    cdc_acm_cts_update(p);
+}
+
+void cdc_acm_tx_dma_start(cdc_port_struct *p)
 {
-    cdc_usart = usart_periph;
-    cdc_acm_usart_configure();
+    dma_channel_disable(p->tx_dma);
+    dma_memory_address_config(p->tx_dma, (uint32_t)p->tx_queue[p->tx_tail]);
+    dma_transfer_number_config(p->tx_dma, p->tx_len[p->tx_tail]);
+    dma_channel_enable(p->tx_dma);
 }
 
-void cdc_acm_data_out(void *pudev)
+void cdc_acm_flow_init(cdc_port_struct *p)
 {
-    uint16_t rx_len, i;
-    
-    rx_len = usbd_rx_count_get(pudev, CDC_ACM_DATA_OUT_EP);
-    for (i = 0; i < rx_len; i++) {
-        usart_data_transmit(cdc_usart, usart_data_buffer[i]);
-        while(RESET == usart_flag_get(cdc_usart, USART_FLAG_TBE));
+#ifdef CDC_ACM_FLOW_CONTROL
+    // RTS low lets the peer send, start ready.
+    cdc_rts_held = 0;
+    gpio_bit_reset(CDC_ACM_RTS_PORT, CDC_ACM_RTS_PIN);
+    gpio_mode_set(CDC_ACM_RTS_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, CDC_ACM_RTS_PIN);
+    gpio_output_options_set(CDC_ACM_RTS_PORT, GPIO_OTYPE_PP, GPIO_OSPEED_10MHZ, CDC_ACM_RTS_PIN);
+
+    // an unconnected CTS reads low, i.e. clear to send.
+    gpio_mode_set(CDC_ACM_CTS_PORT, GPIO_MODE_INPUT, GPIO_PUPD_PULLDOWN, CDC_ACM_CTS_PIN);
+    rcu_periph_clock_enable(RCU_CFGCMP);
+    syscfg_exti_line_config(CDC_ACM_CTS_EXTI_PORT, CDC_ACM_CTS_EXTI_PIN);
+    exti_init(CDC_ACM_CTS_EXTI, EXTI_INTERRUPT, EXTI_TRIG_BOTH);
+    exti_interrupt_flag_clear(CDC_ACM_CTS_EXTI);
+    cdc_flow_port = p;
+#endif
+}
+
+void cdc_acm_rts_update(cdc_port_struct *p)
+{
+#ifdef CDC_ACM_FLOW_CONTROL
+    uint16_t used;
+
+    if (p != cdc_flow_port)
+        return;
+
+    // hysteresis keeps RTS from toggling on every packet.
+    used = ring_used(p->rx_ring);
+    if (!cdc_rts_held && used >= CDC_ACM_RX_HIGH_WATER) {
+        cdc_rts_held = 1;
+        gpio_bit_set(CDC_ACM_RTS_PORT, CDC_ACM_RTS_PIN);
+    } else if (cdc_rts_held && used <= CDC_ACM_RX_LOW_WATER) {
+        cdc_rts_held = 0;
+        gpio_bit_reset(CDC_ACM_RTS_PORT, CDC_ACM_RTS_PIN);
     }
-    
-    usbd_ep_rx(pudev, CDC_ACM_DATA_OUT_EP, usart_data_buffer, CDC_ACM_DATA_PACKET_SIZE);
+#endif
 }
 
-uint8_t cdc_acm_sof(usbd_core_handle_struct *pudev)
+void cdc_acm_cts_update(cdc_port_struct *p)
 {
-    static uint8_t frame_count;
-    uint16_t tx_len;
-    
-    if (frame_count++ != CDC_ACM_IN_FRAME_INTERVAL)
-        return USBD_OK;
-    frame_count = 0;
-    
-    if (cdc_tx == 1)
-        return USBD_OK;
-    
-    if (usb_usart_tcur == usb_usart_hcur)
-        return USBD_OK; // no data received.
-    
-    if (usb_usart_hcur > usb_usart_tcur)
-        usb_usart_used = sizeof(usb_usart_buffer) - usb_usart_hcur;
+#ifdef CDC_ACM_FLOW_CONTROL
+    if (p != cdc_flow_port)
+        return;
+
+    // dropping the dma request pauses the transfer where it is.
+    if (SET == gpio_input_bit_get(CDC_ACM_CTS_PORT, CDC_ACM_CTS_PIN))
+        usart_dma_transmit_config(p->usart, USART_DENT_DISABLE);
     else
-        usb_usart_used = usb_usart_tcur - usb_usart_hcur;
-    
-    if (usb_usart_used > CDC_ACM_DATA_PACKET_SIZE) {
+        usart_dma_transmit_config(p->usart, USART_DENT_ENABLE);
+#endif
+}
+
+void cdc_acm_cts_isr(void)
+{
+#ifdef CDC_ACM_FLOW_CONTROL
+    if (RESET != exti_interrupt_flag_get(CDC_ACM_CTS_EXTI)) {
+        exti_interrupt_flag_clear(CDC_ACM_CTS_EXTI);
+        if (cdc_flow_port)
+            cdc_acm_cts_update(cdc_flow_port);
+    }
+#endif
+}
+
+void cdc_acm_enable_usart(uint8_t port, uint32_t usart_periph)
+{
+    cdc_port_struct *p = &cdc_port[port];
+
+    p->usart = usart_periph;
+    p->tx_pin = (usart_periph == USART0) ? GPIO_PIN_9 : GPIO_PIN_2;
+    p->rx_exti = (usart_periph == USART0) ? EXTI_10 : EXTI_3;
+    p->rx_dma = (usart_periph == USART0) ? DMA_CH2 : DMA_CH4;
+    p->tx_dma = (usart_periph == USART0) ? DMA_CH1 : DMA_CH3;
+    // flow control pins are only wired for usart0.
+    if (usart_periph == USART0)
+        cdc_acm_flow_init(p);
+#ifdef CDC_ACM_LINE_CONTROL
+    if (port == CDC_ACM_LINE_PORT)
+        cdc_acm_line_init(p);
+#endif
+    cdc_acm_usart_configure(p);
+    cdc_acm_rx_dma_configure(p);
+    cdc_acm_tx_dma_configure(p);
+}
+
+void cdc_acm_data_out(void *pudev, uint8_t port)
+{
+    cdc_port_struct *p = &cdc_port[port];
+    uint16_t rx_len;
+
+    // packet is already in the head slot, hand it to the usart dma.
+    rx_len = usbd_rx_count_get(pudev, p->out_ep);
+    if (p == cdc_proxy_port) {
+        cdc_acm_proxy_out(pudev, p, rx_len);
+        return;
+    }
+#ifdef CDC_ACM_SNIFFER
+    if (p == cdc_sniff_port) {
+        cdc_acm_sniff_out(pudev, p, rx_len);
+        return;
+    }
+#endif
+    if (rx_len) {
+        p->stats->usart_tx += rx_len;
+        p->tx_len[p->tx_head] = rx_len;
+        if (++p->tx_head >= CDC_ACM_TX_QUEUE_LEN)
+            p->tx_head = 0;
+        if (p->tx_count++ == 0)
+            cdc_acm_tx_dma_start(p);
+    }
+
+    // queue full, leave the endpoint NAKing until dma frees a slot.
+    if (p->tx_count < CDC_ACM_TX_QUEUE_LEN)
+        usbd_ep_rx(pudev, p->out_ep, p->tx_queue[p->tx_head], CDC_ACM_DATA_PACKET_SIZE);
+    else {
+        p->out_paused = 1;
+        p->stats->out_paused++;
+    }
+}
+
+#ifdef CDC_ACM_PMA_DIRECT
+// usbd_ep_tx without the driver copy. the driver still tracks the transfer,
+// so its completion reaches cdc_acm_data_handler as before.
+void cdc_acm_ep_tx_ring(void *pudev, uint8_t ep_addr, ring_struct *r, uint16_t len)
+{
+    uint8_t ep_num = ep_addr & 0x7F;
+
+    usbd_pma_write_ring(USBD_TX_ADDR(ep_num), r, len);
+    usbd_pma_ep_tx(pudev, ep_num, len);
+}
+#endif
+
+void cdc_acm_in_start(void *pudev, cdc_port_struct *p)
+{
+    uint16_t tx_len;
+    uint32_t t;
+#ifndef CDC_ACM_PMA_DIRECT
+    uint8_t *data;
+#endif
+
+    // send straight from the ring, the bytes are released once the packet is out.
+#ifdef CDC_ACM_PMA_DIRECT
+    tx_len = ring_used(p->in_ring);
+#else
+    tx_len = ring_read_span(p->in_ring, &data);
+#endif
+    if (tx_len > CDC_ACM_DATA_PACKET_SIZE)
         tx_len = CDC_ACM_DATA_PACKET_SIZE;
-    } else {
-        tx_len = usb_usart_used;
-        if (tx_len == CDC_ACM_DATA_PACKET_SIZE)
-            cdc_send_end = 1;
-    }
-    
-    usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, usb_usart_buffer + usb_usart_hcur, tx_len);
-    usb_usart_hcur += tx_len;
-    usb_usart_used -= tx_len;
-    
-    cdc_tx = 1;
-    if (usb_usart_hcur >= sizeof(usb_usart_buffer))
-        usb_usart_hcur = 0;
-    
+
+    p->in_busy = 1;
+    p->in_age = 0;
+    p->in_len = tx_len;
+    p->in_end = p->in_ring->tail + tx_len;
+
+    t = dwt_cycles();
+#ifdef CDC_ACM_PMA_DIRECT
+    cdc_acm_ep_tx_ring(pudev, p->in_ep, p->in_ring, tx_len);
+#else
+    usbd_ep_tx(pudev, p->in_ep, data, tx_len);
+#endif
+    dwt_stat_add(&cdc_stats.in_copy, t);
+}
+
+void cdc_acm_in_flush(cdc_port_struct *p, uint8_t force)
+{
+    // a proxy port only talks to the target bootloader, a sniffer tap only
+    // feeds the records of the sniffing port.
+    if (p->in_busy == 1 || cdc_pudev == NULL || p == cdc_proxy_port)
+        return;
+    if (cdc_sniff_port != NULL && p != cdc_sniff_port)
+        return;
+    if (((usbd_core_handle_struct *)cdc_pudev)->status != USBD_CONFIGURED)
+        return;
+
+    if (ring_used(p->in_ring) == 0)
+        return; // no data received.
+
+    // under load wait for a full batch, unless the line went idle or timed out.
+    if (!force && !p->in_drain && ring_used(p->in_ring) < cdc_in_batch)
+        return;
+
+    cdc_acm_in_start(cdc_pudev, p);
+}
+
+uint8_t cdc_acm_sof(usbd_core_handle_struct *pudev)
+{
+    cdc_port_struct *p;
+    uint8_t i;
+
+    cdc_ms++;
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+        p = &cdc_port[i];
+
+        // a timed break ends on its own.
+        if (p->break_ms && p->break_ms != 0xFFFF && --p->break_ms == 0)
+            cdc_acm_break(p, 0);
+
+        // half transfer interrupts are too coarse for RTS, sample the dma every frame.
+        if (p == cdc_flow_port || p == cdc_proxy_port || cdc_sniff_port != NULL)
+            cdc_acm_rx_update(p, 0);
+
+        // bound the latency of data left waiting for a batch.
+        if (ring_used(p->in_ring) == 0 || p->in_busy == 1) {
+            p->in_age = 0;
+            continue;
+        }
+
+        if (++p->in_age >= cdc_in_latency)
+            cdc_acm_in_flush(p, 1);
+    }
+
     return USBD_OK;
 }
 
-void cdc_acm_data_in(void *pudev)
+void cdc_acm_data_in(void *pudev, uint8_t port)
 {
-    uint16_t tx_len;
-    
-    if (cdc_tx == 0)
+    cdc_port_struct *p = &cdc_port[port];
+    uint16_t sent;
+
+    if (p->in_busy == 0)
+        return;
+    if (p->in_proxy) {
+        cdc_acm_proxy_send(pudev, p);
         return;
+    }
 
-    if (usb_usart_used == 0) {
-        if (cdc_send_end == 1) {
-            cdc_send_end = 0;
-            usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, 0, 0);
-        } else {
-            cdc_tx = 0;
+    // an rx overflow may have moved the tail past the packet meanwhile, a
+    // zlp or a detached packet holds nothing.
+    sent = p->in_len;
+    if (sent)
+        ring_release_to(p->in_ring, p->in_end);
+    cdc_acm_rts_update(p);
+#ifdef CDC_ACM_SNIFFER
+    // records the taps could not place before have room now.
+    if (p == cdc_sniff_port)
+        cdc_acm_sniff_pump();
+#endif
+
+    if (ring_used(p->in_ring) == 0) {
+        p->in_drain = 0;
+        // a full packet does not end the transfer, close it with a zlp.
+        if (sent == CDC_ACM_DATA_PACKET_SIZE) {
+            p->in_len = 0;
+            usbd_ep_tx(pudev, p->in_ep, 0, 0);
+            return;
         }
+    }
+
+    p->in_busy = 0;
+    cdc_acm_in_flush(p, 0);
+}
+
+void cdc_acm_rx_update(cdc_port_struct *p, uint8_t idle)
+{
+    ring_struct *r = p->rx_ring;
+    uint16_t pos, i;
+
+    // dma write position, everything before it is published to the IN path.
+    pos = ring_size(r) - dma_transfer_number_get(p->rx_dma);
+
+    if (p->linecoding.bDataBits == 7) {
+        for (i = r->head; ((i ^ pos) & r->mask) != 0; i++)
+            r->buf[i & r->mask] &= 0x7f;
+    }
+    p->stats->usart_rx += ring_dma_update(r, pos);
+    cdc_acm_rts_update(p);
+#ifdef CDC_ACM_SNIFFER
+    if (cdc_sniff_port != NULL) {
+        cdc_acm_sniff_update(p, idle);
         return;
     }
-    
-    if (usb_usart_used > CDC_ACM_DATA_PACKET_SIZE) {
-        tx_len = CDC_ACM_DATA_PACKET_SIZE;
-    } else {
-        tx_len = usb_usart_used;
-        if (usb_usart_used == CDC_ACM_DATA_PACKET_SIZE)
-            cdc_send_end = 1;
+#endif
+
+    // idle line ends a burst, e.g. a bootloader reply, drain it right away.
+    if (idle)
+        p->in_drain = 1;
+    cdc_acm_in_flush(p, idle);
+}
+
+void cdc_acm_proxy_enter(cdc_port_struct *p)
+{
+    // the bootloader speaks 8e1, parity makes a 9 bit word.
+    usart_baudrate_set(p->usart, CDC_ACM_PROXY_TARGET_BAUD);
+    usart_parity_config(p->usart, USART_PM_EVEN);
+    usart_stop_bit_set(p->usart, USART_STB_1BIT);
+    usart_word_length_set(p->usart, USART_WL_9BIT);
+    usart_enable(p->usart);
+
+    cdc_proxy_used = 0;
+    cdc_proxy_ready = 0;
+    cdc_proxy_flush = 1;
+    cdc_proxy_port = p;
+}
+
+void cdc_acm_proxy_out(void *pudev, cdc_port_struct *p, uint16_t rx_len)
+{
+    uint16_t need = 8;
+
+    // collect one frame, the host waits for its reply before the next one.
+    if (rx_len > sizeof(cdc_proxy_buf) - cdc_proxy_used)
+        rx_len = sizeof(cdc_proxy_buf) - cdc_proxy_used;
+    memcpy(cdc_proxy_buf + cdc_proxy_used, p->tx_queue[p->tx_head], rx_len);
+    cdc_proxy_used += rx_len;
+
+    if (cdc_proxy_used >= 8)
+        need += cdc_proxy_buf[2] | (cdc_proxy_buf[3] << 8);
+    if (cdc_proxy_used >= need || cdc_proxy_used == sizeof(cdc_proxy_buf)) {
+        // the endpoint stays NAKing until the reply is out.
+        cdc_proxy_ready = 1;
+        return;
+    }
+    usbd_ep_rx(pudev, p->out_ep, p->tx_queue[p->tx_head], CDC_ACM_DATA_PACKET_SIZE);
+}
+
+void cdc_acm_proxy_send(void *pudev, cdc_port_struct *p)
+{
+    uint16_t len = cdc_proxy_tx_left;
+
+    if (len == 0) {
+        if (cdc_proxy_zlp) {
+            cdc_proxy_zlp = 0;
+            usbd_ep_tx(pudev, p->in_ep, 0, 0);
+            return;
+        }
+        // reply is out, take the next request.
+        p->in_proxy = 0;
+        p->in_busy = 0;
+        cdc_proxy_used = 0;
+        usbd_ep_rx(pudev, p->out_ep, p->tx_queue[p->tx_head], CDC_ACM_DATA_PACKET_SIZE);
+        return;
+    }
+
+    if (len > CDC_ACM_DATA_PACKET_SIZE)
+        len = CDC_ACM_DATA_PACKET_SIZE;
+    usbd_ep_tx(pudev, p->in_ep, cdc_proxy_tx_ptr, len);
+    cdc_proxy_tx_ptr += len;
+    cdc_proxy_tx_left -= len;
+    cdc_proxy_zlp = (cdc_proxy_tx_left == 0 && len == CDC_ACM_DATA_PACKET_SIZE);
+}
+
+void cdc_proxy_put(cdc_port_struct *p, const uint8_t *d, uint16_t size)
+{
+    uint16_t i;
+
+    for (i = 0; i < size; i++) {
+        while (RESET == usart_flag_get(p->usart, USART_FLAG_TBE));
+        usart_data_transmit(p->usart, d[i]);
+    }
+}
+
+void cdc_proxy_put_byte(cdc_port_struct *p, uint8_t c)
+{
+    // commands and lengths go out with their complement.
+    uint8_t buf[2] = { c, ~c };
+
+    cdc_proxy_put(p, buf, 2);
+}
+
+uint16_t cdc_proxy_get(cdc_port_struct *p, uint8_t *d, uint16_t size, uint32_t timeout)
+{
+    uint32_t start = cdc_ms;
+    uint16_t got = 0;
+
+    // rx dma keeps filling the ring, idle line and SOF publish it.
+    while (got < size) {
+        got += ring_read(p->rx_ring, d + got, size - got);
+        if (got < size && cdc_ms - start > timeout)
+            break;
+    }
+    return got;
+}
+
+uint8_t cdc_proxy_ack(cdc_port_struct *p, uint32_t timeout)
+{
+    uint8_t c;
+
+    if (cdc_proxy_get(p, &c, 1, timeout) != 1)
+        return CDC_PROXY_TIMEOUT;
+    return c == 0x79 ? CDC_PROXY_OK : CDC_PROXY_NACK;
+}
+
+uint8_t cdc_proxy_addr(cdc_port_struct *p, uint32_t addr)
+{
+    uint8_t buf[5];
+
+    buf[0] = addr >> 24;
+    buf[1] = addr >> 16;
+    buf[2] = addr >> 8;
+    buf[3] = addr;
+    buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
+    cdc_proxy_put(p, buf, 5);
+    return cdc_proxy_ack(p, CDC_ACM_PROXY_TIMEOUT_MS);
+}
+
+uint8_t cdc_proxy_write(cdc_port_struct *p, uint32_t addr, const uint8_t *d, uint16_t size)
+{
+    uint8_t status, n, x;
+    uint16_t i, len;
+
+    // 0x31 takes up to 256 bytes, run as many as the page needs.
+    for (; size; addr += len, d += len, size -= len) {
+        len = size > 256 ? 256 : size;
+        cdc_proxy_put_byte(p, 0x31);
+        if ((status = cdc_proxy_ack(p, CDC_ACM_PROXY_TIMEOUT_MS)) != CDC_PROXY_OK)
+            return status;
+        if ((status = cdc_proxy_addr(p, addr)) != CDC_PROXY_OK)
+            return status;
+
+        n = len - 1;
+        for (x = n, i = 0; i < len; i++)
+            x ^= d[i];
+        cdc_proxy_put(p, &n, 1);
+        cdc_proxy_put(p, d, len);
+        cdc_proxy_put(p, &x, 1);
+        if ((status = cdc_proxy_ack(p, CDC_ACM_PROXY_TIMEOUT_MS)) != CDC_PROXY_OK)
+            return status;
+    }
+    return CDC_PROXY_OK;
+}
+
+uint8_t cdc_proxy_read(cdc_port_struct *p, uint32_t addr, uint8_t *d, uint16_t size)
+{
+    uint8_t status;
+    uint16_t len;
+
+    for (; size; addr += len, d += len, size -= len) {
+        len = size > 256 ? 256 : size;
+        cdc_proxy_put_byte(p, 0x11);
+        if ((status = cdc_proxy_ack(p, CDC_ACM_PROXY_TIMEOUT_MS)) != CDC_PROXY_OK)
+            return status;
+        if ((status = cdc_proxy_addr(p, addr)) != CDC_PROXY_OK)
+            return status;
+        cdc_proxy_put_byte(p, len - 1);
+        if ((status = cdc_proxy_ack(p, CDC_ACM_PROXY_TIMEOUT_MS)) != CDC_PROXY_OK)
+            return status;
+        if (cdc_proxy_get(p, d, len, CDC_ACM_PROXY_TIMEOUT_MS) != len)
+            return CDC_PROXY_TIMEOUT;
     }
-    
-    usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, usb_usart_buffer + usb_usart_hcur, tx_len);
-    usb_usart_hcur += tx_len;
-    usb_usart_used -= tx_len;
+    return CDC_PROXY_OK;
 }
 
-void cdc_acm_isr(void)
+uint8_t cdc_proxy_erase(cdc_port_struct *p, uint8_t cmd)
 {
-    if (RESET != usart_interrupt_flag_get(cdc_usart, USART_INT_FLAG_RBNE)) {
-        switch (linecoding.bDataBits) {
-        case 7:
-            usb_usart_buffer[usb_usart_tcur] = usart_data_receive(cdc_usart) & 0x7f;
+    // global erase, 0xffff with checksum for extended erase.
+    uint8_t all[3] = { 0xff, cmd == 0x44 ? 0xff : 0x00, 0x00 };
+    uint8_t status;
+
+    cdc_proxy_put_byte(p, cmd);
+    if ((status = cdc_proxy_ack(p, CDC_ACM_PROXY_TIMEOUT_MS)) != CDC_PROXY_OK)
+        return status;
+    cdc_proxy_put(p, all, cmd == 0x44 ? 3 : 2);
+    return cdc_proxy_ack(p, CDC_ACM_PROXY_ERASE_MS);
+}
+
+void cdc_acm_proxy_poll(void)
+{
+    cdc_port_struct *p = cdc_proxy_port;
+    uint8_t *data = cdc_proxy_buf + 8;
+    uint8_t op, status = CDC_PROXY_BAD_FRAME;
+    uint16_t len, rlen = 0;
+    uint32_t addr;
+
+    // wait for a whole request, bridged data still going out and a free IN endpoint.
+    if (p == NULL || !cdc_proxy_ready || p->in_busy || p->tx_count)
+        return;
+
+    // whatever the bridge received before is not a bootloader reply.
+    if (cdc_proxy_flush) {
+        cdc_proxy_flush = 0;
+        ring_release(p->rx_ring, ring_used(p->rx_ring));
+    }
+
+    op = cdc_proxy_buf[0];
+    len = cdc_proxy_buf[2] | (cdc_proxy_buf[3] << 8);
+    addr = cdc_proxy_buf[4] | (cdc_proxy_buf[5] << 8) |
+        ((uint32_t)cdc_proxy_buf[6] << 16) | ((uint32_t)cdc_proxy_buf[7] << 24);
+
+    if (cdc_proxy_used >= 8 && len <= CDC_ACM_PROXY_PAGE_SIZE) {
+        switch (op) {
+        case CDC_PROXY_XFER:
+            cdc_proxy_put(p, data, len);
+            if (addr > CDC_ACM_PROXY_PAGE_SIZE)
+                addr = CDC_ACM_PROXY_PAGE_SIZE;
+            rlen = cdc_proxy_get(p, data, addr, CDC_ACM_PROXY_TIMEOUT_MS);
+            status = rlen == addr ? CDC_PROXY_OK : CDC_PROXY_TIMEOUT;
+            break;
+        case CDC_PROXY_WRITE:
+            status = cdc_proxy_write(p, addr, data, len);
+            break;
+        case CDC_PROXY_READ:
+            rlen = data[0] | (data[1] << 8);
+            if (len != 2 || rlen > CDC_ACM_PROXY_PAGE_SIZE) {
+                rlen = 0;
+                break;
+            }
+            status = cdc_proxy_read(p, addr, data, rlen);
+            if (status != CDC_PROXY_OK)
+                rlen = 0;
             break;
-        case 8:
-            usb_usart_buffer[usb_usart_tcur] = usart_data_receive(cdc_usart);
+        case CDC_PROXY_ERASE:
+            status = cdc_proxy_erase(p, addr);
+            break;
+        case CDC_PROXY_STATS:
+            cdc_acm_stats_get(&cdc_stats_reply, addr == 1);
+            memcpy(data, &cdc_stats_reply, sizeof(cdc_stats_reply));
+            rlen = sizeof(cdc_stats_reply);
+            status = CDC_PROXY_OK;
+            break;
+        default:
             break;
         }
-        
-        usb_usart_tcur++;
-        if (usb_usart_tcur >= sizeof(usb_usart_buffer))
-            usb_usart_tcur = 0;
-    }
-    
-    if (RESET != usart_interrupt_flag_get(cdc_usart, USART_INT_FLAG_RBNE_ORERR))
-        usart_data_receive(cdc_usart);
+    }
+
+    cdc_proxy_buf[4] = status;
+    cdc_proxy_buf[5] = op;
+    cdc_proxy_buf[6] = rlen;
+    cdc_proxy_buf[7] = rlen >> 8;
+    cdc_proxy_ready = 0;
+
+    // the USB isr must not run between setting up and starting the reply.
+    __disable_irq();
+    cdc_proxy_tx_ptr = cdc_proxy_buf + 4;
+    cdc_proxy_tx_left = 4 + rlen;
+    cdc_proxy_zlp = 0;
+    p->in_proxy = 1;
+    p->in_busy = 1;
+    cdc_acm_proxy_send(cdc_pudev, p);
+    __enable_irq();
+}
+
+void cdc_acm_isr(uint8_t port)
+{
+    cdc_port_struct *p = &cdc_port[port];
+
+    // a byte with an error still goes through dma, only count it.
+    if (RESET != usart_flag_get(p->usart, USART_FLAG_ORERR)) {
+        usart_flag_clear(p->usart, USART_FLAG_ORERR);
+        p->stats->overrun++;
+        p->sniff_flags |= CDC_SNIFF_LOST;
+    }
+    if (RESET != usart_flag_get(p->usart, USART_FLAG_FERR)) {
+        usart_flag_clear(p->usart, USART_FLAG_FERR);
+        p->stats->frame_err++;
+        p->sniff_flags |= CDC_SNIFF_ERROR;
+    }
+    if (RESET != usart_flag_get(p->usart, USART_FLAG_PERR)) {
+        usart_flag_clear(p->usart, USART_FLAG_PERR);
+        p->stats->parity_err++;
+        p->sniff_flags |= CDC_SNIFF_ERROR;
+    }
+    if (RESET != usart_flag_get(p->usart, USART_FLAG_NERR)) {
+        usart_flag_clear(p->usart, USART_FLAG_NERR);
+        p->stats->noise_err++;
+        p->sniff_flags |= CDC_SNIFF_ERROR;
+    }
+
+    // line went idle after a burst, publish what dma got so far.
+    if (RESET != usart_interrupt_flag_get(p->usart, USART_INT_FLAG_IDLE)) {
+        usart_interrupt_flag_clear(p->usart, USART_INT_FLAG_IDLE);
+        cdc_acm_rx_update(p, 1);
+    }
+}
+
+#ifdef CDC_ACM_SNIFFER
+// an IN packet in flight holds in_len bytes of its ring, release them now so the
+// ring can change under it. the packet itself is already in packet memory.
+void cdc_acm_in_detach(cdc_port_struct *p)
+{
+    if (p->in_busy && !p->in_proxy) {
+        ring_release_to(p->in_ring, p->in_end);
+        p->in_len = 0;
+    }
+}
+
+void cdc_acm_sniff_timer_init(void)
+{
+    timer_parameter_struct timer_initpara;
+
+    // free running us counter, TIMER1 is the 32 bit one.
+    rcu_periph_clock_enable(RCU_TIMER1);
+    timer_deinit(TIMER1);
+    timer_initpara.prescaler = SystemCoreClock / 1000000U - 1;
+    timer_initpara.alignedmode = TIMER_COUNTER_EDGE;
+    timer_initpara.counterdirection = TIMER_COUNTER_UP;
+    timer_initpara.period = 0xFFFFFFFF;
+    timer_initpara.clockdivision = TIMER_CKDIV_DIV1;
+    timer_initpara.repetitioncounter = 0;
+    timer_init(TIMER1, &timer_initpara);
+    timer_enable(TIMER1);
+}
+
+// stamp the next falling edge on the rx pin, the start bit of the next burst.
+void cdc_acm_sniff_arm(cdc_port_struct *p)
+{
+    exti_interrupt_flag_clear(p->rx_exti);
+    p->sniff_armed = 1;
+    exti_interrupt_enable(p->rx_exti);
+}
+
+void cdc_acm_sniff_enter(cdc_port_struct *p)
+{
+    cdc_port_struct *q;
+    uint8_t i;
+
+    if (cdc_sniff_port != NULL)
+        cdc_acm_sniff_leave();
+
+    // time 0 is the start of the capture. the rx pins are PA10 and PA3.
+    cdc_acm_sniff_timer_init();
+    rcu_periph_clock_enable(RCU_CFGCMP);
+    syscfg_exti_line_config(EXTI_SOURCE_GPIOA, EXTI_SOURCE_PIN10);
+    syscfg_exti_line_config(EXTI_SOURCE_GPIOA, EXTI_SOURCE_PIN3);
+
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+        q = &cdc_port[i];
+
+        // bridged data from before is not part of the capture.
+        cdc_acm_in_detach(q);
+        ring_release(q->rx_ring, ring_used(q->rx_ring));
+        q->sniff_flags = 0;
+        q->sniff_lost = q->rx_ring->overflow;
+
+        // a tap only listens, its tx pin floats.
+        gpio_mode_set(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_NONE, q->tx_pin);
+        exti_init(q->rx_exti, EXTI_INTERRUPT, EXTI_TRIG_FALLING);
+        cdc_acm_sniff_arm(q);
+    }
+
+    ring_reset(&cdc_sniff_ring);
+    p->in_ring = &cdc_sniff_ring;
+    cdc_sniff_port = p;
+}
+
+void cdc_acm_sniff_leave(void)
+{
+    cdc_port_struct *p = cdc_sniff_port;
+    cdc_port_struct *q;
+    uint8_t i;
+
+    cdc_sniff_port = NULL;
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+        q = &cdc_port[i];
+        exti_interrupt_disable(q->rx_exti);
+        q->sniff_armed = 0;
+        gpio_mode_set(GPIOA, GPIO_MODE_AF, GPIO_PUPD_PULLUP, q->tx_pin);
+    }
+
+    // records nobody read go with the capture, the port bridges again.
+    cdc_acm_in_detach(p);
+    p->in_ring = p->rx_ring;
+    ring_reset(&cdc_sniff_ring);
+    timer_disable(TIMER1);
+}
+
+// a 7 byte packet is the line coding of the sniffed link, anything else is dropped.
+void cdc_acm_sniff_out(void *pudev, cdc_port_struct *p, uint16_t rx_len)
+{
+    uint8_t *d = p->tx_queue[p->tx_head];
+    cdc_port_struct *q;
+    uint8_t i;
+
+    if (rx_len == 7) {
+        for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+            q = &cdc_port[i];
+            q->linecoding.dwDTERate = d[0] | (d[1] << 8) |
+                ((uint32_t)d[2] << 16) | ((uint32_t)d[3] << 24);
+            q->linecoding.bCharFormat = d[4];
+            q->linecoding.bParityType = d[5];
+            q->linecoding.bDataBits = d[6];
+            cdc_acm_usart_format(q);
+        }
+    }
+    usbd_ep_rx(pudev, p->out_ep, d, CDC_ACM_DATA_PACKET_SIZE);
+}
+
+// move what a tap received into one record, as much as the record ring takes.
+void cdc_acm_sniff_record(cdc_port_struct *p)
+{
+    ring_struct *r = &cdc_sniff_ring;
+    uint8_t head[8], *d;
+    uint16_t len, n;
+    uint32_t t;
+
+    len = ring_used(p->rx_ring);
+    if (len == 0 || ring_free(r) <= sizeof(head))
+        return;
+    if (len > ring_free(r) - sizeof(head))
+        len = ring_free(r) - sizeof(head);
+
+    if (p->rx_ring->overflow != p->sniff_lost) {
+        p->sniff_lost = p->rx_ring->overflow;
+        p->sniff_flags |= CDC_SNIFF_LOST;
+    }
+
+    // no edge seen, the burst began before the tap was armed. stamp it late.
+    if (!(p->sniff_flags & CDC_SNIFF_CONT) && p->sniff_armed) {
+        exti_interrupt_disable(p->rx_exti);
+        if (p->sniff_armed) {
+            p->sniff_armed = 0;
+            p->sniff_time = TIMER_CNT(TIMER1);
+        }
+    }
+
+    t = p->sniff_time;
+    head[0] = CDC_SNIFF_SYNC;
+    head[1] = p->sniff_flags | (p->usart == USART1 ? CDC_SNIFF_USART1 : 0);
+    head[2] = len;
+    head[3] = len >> 8;
+    head[4] = t;
+    head[5] = t >> 8;
+    head[6] = t >> 16;
+    head[7] = t >> 24;
+    ring_write(r, head, sizeof(head));
+
+    while (len) {
+        n = ring_read_span(p->rx_ring, &d);
+        if (n > len)
+            n = len;
+        ring_write(r, d, n);
+        ring_release(p->rx_ring, n);
+        len -= n;
+    }
+    p->sniff_flags = CDC_SNIFF_CONT;
+}
+
+void cdc_acm_sniff_update(cdc_port_struct *p, uint8_t idle)
+{
+    uint16_t left;
+
+    cdc_acm_sniff_record(p);
+
+    // the burst is over, what did not fit is lost and the next edge starts a new one.
+    if (idle) {
+        left = ring_used(p->rx_ring);
+        ring_release(p->rx_ring, left);
+        p->rx_ring->overflow += left;
+        p->sniff_flags = 0;
+        cdc_acm_sniff_arm(p);
+    }
+    cdc_acm_in_flush(cdc_sniff_port, idle);
+}
+
+void cdc_acm_sniff_pump(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++)
+        cdc_acm_sniff_record(&cdc_port[i]);
+}
+#endif
+
+void cdc_acm_sniff_isr(void)
+{
+#ifdef CDC_ACM_SNIFFER
+    cdc_port_struct *p;
+    uint8_t i;
+
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+        p = &cdc_port[i];
+        if (p->sniff_armed && RESET != exti_interrupt_flag_get(p->rx_exti)) {
+            // the timer first, it is the whole point of this isr.
+            p->sniff_time = TIMER_CNT(TIMER1);
+            exti_interrupt_disable(p->rx_exti);
+            exti_interrupt_flag_clear(p->rx_exti);
+            p->sniff_armed = 0;
+        }
+    }
+#endif
+}
+
+void cdc_acm_stats_get(cdc_stats_struct *s, uint8_t clear)
+{
+    uint8_t i;
+
+    // one consistent snapshot, the counters move in every isr.
+    __disable_irq();
+    for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+        cdc_stats.port[i].ring_overflow = cdc_port[i].rx_ring->overflow;
+        cdc_stats.port[i].ring_high_water = cdc_port[i].rx_ring->high_water;
+        cdc_stats.port[i].ring_size = ring_size(cdc_port[i].rx_ring);
+    }
+    cdc_stats.core_hz = SystemCoreClock;
+    cdc_stats.port_count = CDC_ACM_PORT_COUNT;
+    memcpy(s, &cdc_stats, sizeof(cdc_stats));
+
+    if (clear) {
+        memset(&cdc_stats, 0, sizeof(cdc_stats));
+        for (i = 0; i < CDC_ACM_PORT_COUNT; i++) {
+            cdc_port[i].rx_ring->overflow = 0;
+            cdc_port[i].rx_ring->high_water = ring_used(cdc_port[i].rx_ring);
+        }
+    }
+    __enable_irq();
+}
+
+void cdc_acm_dma_isr(uint8_t port)
+{
+    cdc_port_struct *p = &cdc_port[port];
+
+    // half and full transfer keep long bursts flowing before idle.
+    if (RESET != dma_interrupt_flag_get(p->rx_dma, DMA_INT_FLAG_HTF) ||
+        RESET != dma_interrupt_flag_get(p->rx_dma, DMA_INT_FLAG_FTF)) {
+        dma_interrupt_flag_clear(p->rx_dma, DMA_INT_FLAG_G);
+        cdc_acm_rx_update(p, 0);
+    }
+
+    // one OUT packet went out, start the next and re-arm the endpoint.
+    if (RESET != dma_interrupt_flag_get(p->tx_dma, DMA_INT_FLAG_FTF)) {
+        dma_interrupt_flag_clear(p->tx_dma, DMA_INT_FLAG_G);
+        if (++p->tx_tail >= CDC_ACM_TX_QUEUE_LEN)
+            p->tx_tail = 0;
+        if (--p->tx_count)
+            cdc_acm_tx_dma_start(p);
+
+        if (p->out_paused && cdc_pudev) {
+            p->out_paused = 0;
+            usbd_ep_rx(cdc_pudev, p->out_ep, p->tx_queue[p->tx_head], CDC_ACM_DATA_PACKET_SIZE);
+        }
+    }
 }
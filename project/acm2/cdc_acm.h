@@ -2,13 +2,27 @@
 #define CDC_ACM_CORE_H
 
 #include "usbd_std.h"
+#include "dwt.h"
 
 #define USB_DESCTYPE_CS_INTERFACE               0x24
-#define USB_CDC_ACM_CONFIG_DESC_SIZE            0x43
+#define USB_DESCTYPE_IAD                        0x0B
 
-#define CDC_ACM_DESC_SIZE                       0x3A
+/* the vendor port takes the place of the last CDC function */
+#ifdef CDC_ACM_VENDOR_PORT
+#define CDC_ACM_FUNCTION_COUNT                  (CDC_ACM_PORT_COUNT - 1U)
+#define CDC_ACM_VENDOR_DESC_SIZE                23
+#else
+#define CDC_ACM_FUNCTION_COUNT                  CDC_ACM_PORT_COUNT
+#define CDC_ACM_VENDOR_DESC_SIZE                0
+#endif
 
-#define CDC_ACM_DESC_TYPE                       0x21
+#define USB_CDC_ACM_CONFIG_DESC_SIZE            (9 + 66 * CDC_ACM_FUNCTION_COUNT + CDC_ACM_VENDOR_DESC_SIZE)
+
+/* GET_DESCRIPTOR of a comm interface returns the functional descriptors of
+   its function, header, call management, acm and union */
+#define CDC_ACM_DESC_SIZE                       19
+
+#define CDC_ACM_DESC_TYPE                       USB_DESCTYPE_CS_INTERFACE
 
 #define SEND_ENCAPSULATED_COMMAND               0x00
 #define GET_ENCAPSULATED_RESPONSE               0x01
@@ -21,8 +35,66 @@
 #define SEND_BREAK                              0x23
 #define NO_CMD                                  0xFF
 
+/* bootloader proxy frames. request: op, 0, len (le16), addr (le32), len bytes.
+   reply: status, op, len (le16), len bytes. XFER sends the bytes to the target
+   and collects addr reply bytes, WRITE writes the bytes at addr, READ reads the
+   le16 count it carries from addr, ERASE runs a global erase with the erase
+   command in addr, STATS returns cdc_stats_struct and clears it if addr is 1. */
+#define CDC_PROXY_XFER                          0x58
+#define CDC_PROXY_WRITE                         0x57
+#define CDC_PROXY_READ                          0x52
+#define CDC_PROXY_ERASE                         0x45
+#define CDC_PROXY_STATS                         0x53
+
+#define CDC_PROXY_OK                            0x00
+#define CDC_PROXY_NACK                          0x01
+#define CDC_PROXY_TIMEOUT                       0x02
+#define CDC_PROXY_BAD_FRAME                     0x03
+
+/* sniffer records: sync, flags, len (le16), time (le32), len bytes. time is the
+   first start bit of the burst in us since the sniffer started, it wraps after
+   71 minutes. a burst that does not fit one record goes on in records flagged
+   CONT with the same time. */
+#define CDC_SNIFF_SYNC                          0xA5
+#define CDC_SNIFF_USART1                        0x01    /* else usart0 */
+#define CDC_SNIFF_CONT                          0x02
+#define CDC_SNIFF_ERROR                         0x04    /* framing, parity or noise error */
+#define CDC_SNIFF_LOST                          0x08    /* bytes lost before this record */
+
+/* vendor request, device to host, returns cdc_stats_struct. wValue 1 clears
+   the counters once they are read. */
+#define CDC_VENDOR_GET_STATS                    0x01
+
+/* vendor requests, host to device without data, set the IN flush policy of
+   all ports (CDC_ACM_IN_BATCH_SIZE, CDC_ACM_IN_MAX_LATENCY) to wValue: the
+   batch in bytes, 1 to CDC_ACM_RX_HIGH_WATER, and the latency in frames, 1
+   to 255. other values are stalled. */
+#define CDC_VENDOR_SET_IN_BATCH                 0x02
+#define CDC_VENDOR_SET_IN_LATENCY               0x03
+
+/* vendor requests to the vendor port interface, same codes and 7 byte line
+   coding as the CDC class requests. */
+#define CDC_VENDOR_SET_LINE_CODING              0x20
+#define CDC_VENDOR_GET_LINE_CODING              0x21
+
+#define CDC_STATS_ISR_USB                       0
+#define CDC_STATS_ISR_USART                     1
+#define CDC_STATS_ISR_DMA                       2
+#define CDC_STATS_ISR_COUNT                     3
+
 #pragma pack(1)
 
+typedef struct
+{
+    usb_descriptor_header_struct Header;  /*!< descriptor header, including type and size. */
+    uint8_t  bFirstInterface;             /*!< bFirstInterface: first interface of the function */
+    uint8_t  bInterfaceCount;             /*!< bInterfaceCount: contiguous interfaces in the function */
+    uint8_t  bFunctionClass;              /*!< bFunctionClass: class code */
+    uint8_t  bFunctionSubClass;           /*!< bFunctionSubClass: subclass code */
+    uint8_t  bFunctionProtocol;           /*!< bFunctionProtocol: protocol code */
+    uint8_t  iFunction;                   /*!< iFunction: index of the function string */
+} usb_descriptor_iad_struct;
+
 typedef struct
 {
     usb_descriptor_header_struct Header;  /*!< descriptor header, including type and size. */
@@ -53,22 +125,64 @@ typedef struct
     uint8_t  bSlaveInterface0;            /*!< bSlaveInterface0: data class interface */
 } usb_descriptor_union_function_struct;
 
+/* one CDC ACM function of the composite device, 66 bytes */
+typedef struct
+{
+    usb_descriptor_iad_struct                         iad;
+    usb_descriptor_interface_struct                   cmd_interface;
+    usb_descriptor_header_function_struct             header;
+    usb_descriptor_call_managment_function_struct     call_managment;
+    usb_descriptor_acm_function_struct                acm;
+    usb_descriptor_union_function_struct              union_function;
+    usb_descriptor_endpoint_struct                    cmd_endpoint;
+    usb_descriptor_interface_struct                   data_interface;
+    usb_descriptor_endpoint_struct                    out_endpoint;
+    usb_descriptor_endpoint_struct                    in_endpoint;
+} usb_descriptor_cdc_acm_function_struct;
+
+/* the vendor port, one interface with a bulk pair, 23 bytes */
+typedef struct
+{
+    usb_descriptor_interface_struct                   data_interface;
+    usb_descriptor_endpoint_struct                    out_endpoint;
+    usb_descriptor_endpoint_struct                    in_endpoint;
+} usb_descriptor_vendor_function_struct;
+
 #pragma pack()
 
 typedef struct
 {
     usb_descriptor_configuration_struct               config;
-    usb_descriptor_interface_struct                   cdc_loopback_interface;
-    usb_descriptor_header_function_struct             cdc_loopback_header;
-    usb_descriptor_call_managment_function_struct     cdc_loopback_call_managment;
-    usb_descriptor_acm_function_struct                cdc_loopback_acm;
-    usb_descriptor_union_function_struct              cdc_loopback_union;
-    usb_descriptor_endpoint_struct                    cdc_loopback_cmd_endpoint;
-    usb_descriptor_interface_struct                   cdc_loopback_data_interface;
-    usb_descriptor_endpoint_struct                    cdc_loopback_out_endpoint;
-    usb_descriptor_endpoint_struct                    cdc_loopback_in_endpoint;
+    usb_descriptor_cdc_acm_function_struct            cdc[CDC_ACM_FUNCTION_COUNT];
+#ifdef CDC_ACM_VENDOR_PORT
+    usb_descriptor_vendor_function_struct             vendor;
+#endif
 } usb_descriptor_configuration_set_struct;
 
+/* bridge counters of one port, little endian words on the wire */
+typedef struct
+{
+    uint32_t usart_rx;          /* bytes from the usart to the host */
+    uint32_t usart_tx;          /* bytes from the host to the usart */
+    uint32_t overrun;           /* bytes lost before the rx dma got them */
+    uint32_t frame_err;
+    uint32_t parity_err;
+    uint32_t noise_err;
+    uint32_t ring_overflow;     /* bytes lost because the host did not read */
+    uint32_t ring_high_water;
+    uint32_t ring_size;
+    uint32_t out_paused;        /* OUT endpoint held NAKing on a full tx queue */
+} cdc_port_stats_struct;
+
+typedef struct
+{
+    uint32_t core_hz;           /* converts the isr cycles to time */
+    uint32_t port_count;
+    cdc_port_stats_struct port[CDC_ACM_PORT_COUNT];
+    dwt_stat_struct isr[CDC_STATS_ISR_COUNT];
+    dwt_stat_struct in_copy;    /* one IN packet into packet memory */
+} cdc_stats_struct;
+
 extern void* const usbd_strings[USB_STRING_COUNT];
 extern const usb_descriptor_device_struct device_descriptor;
 extern const usb_descriptor_configuration_set_struct configuration_descriptor;
@@ -83,11 +197,19 @@ usbd_status_enum cdc_acm_req_handler(void *pudev, usb_device_req_struct *req);
 /* handle CDC ACM data */
 usbd_status_enum cdc_acm_data_handler(void *pudev, usbd_dir_enum rx_tx, uint8_t ep_id);
 
-/* receive/send CDC ACM data */
-void cdc_acm_data_in(void *pudev);
-void cdc_acm_data_out(void *pudev);
+/* receive/send CDC ACM data of one port */
+void cdc_acm_data_in(void *pudev, uint8_t port);
+void cdc_acm_data_out(void *pudev, uint8_t port);
+
+extern void cdc_acm_enable_usart(uint8_t port, uint32_t usart_periph);
+extern void cdc_acm_isr(uint8_t port);
+extern void cdc_acm_dma_isr(uint8_t port);
+extern void cdc_acm_cts_isr(void);
+extern void cdc_acm_sniff_isr(void);
+extern void cdc_acm_line_isr(void);
+extern void cdc_acm_proxy_poll(void);
+extern void cdc_acm_stats_get(cdc_stats_struct *s, uint8_t clear);
 
-extern void cdc_acm_enable_usart(uint32_t usart_periph);
-extern void cdc_acm_isr(void);
+extern cdc_stats_struct cdc_stats;
 
 #endif  /* CDC_ACM_CORE_H */
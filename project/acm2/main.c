@@ -12,23 +12,83 @@ usbd_core_handle_struct usb_device_dev =
     .class_data_handler = cdc_acm_data_handler
 };
 
+// the bridge isrs are timed with the cycle counter, see cdc_stats.
 void  USBD_LP_IRQHandler(void)
 {
+    uint32_t t = dwt_cycles();
+
+    usbd_isr();
+    dwt_stat_add(&cdc_stats.isr[CDC_STATS_ISR_USB], t);
+}
+
+// bulk endpoints complete here only when CDC_ACM_DATA_BUF_KIND is double
+// buffered, the single buffered default uses the low priority line.
+void  USBD_HP_IRQHandler(void)
+{
+    uint32_t t = dwt_cycles();
+
     usbd_isr();
+    dwt_stat_add(&cdc_stats.isr[CDC_STATS_ISR_USB], t);
 }
 
 void USART0_IRQHandler(void) 
 {
-    cdc_acm_isr();
+    uint32_t t = dwt_cycles();
+
+    cdc_acm_isr(0);
+    dwt_stat_add(&cdc_stats.isr[CDC_STATS_ISR_USART], t);
+}
+
+void USART1_IRQHandler(void)
+{
+    uint32_t t = dwt_cycles();
+
+    cdc_acm_isr(1);
+    dwt_stat_add(&cdc_stats.isr[CDC_STATS_ISR_USART], t);
+}
+
+void DMA_Channel1_2_IRQHandler(void)
+{
+    uint32_t t = dwt_cycles();
+
+    cdc_acm_dma_isr(0);
+    dwt_stat_add(&cdc_stats.isr[CDC_STATS_ISR_DMA], t);
+}
+
+void DMA_Channel3_4_IRQHandler(void)
+{
+    uint32_t t = dwt_cycles();
+
+    cdc_acm_dma_isr(1);
+    dwt_stat_add(&cdc_stats.isr[CDC_STATS_ISR_DMA], t);
+}
+
+void EXTI4_15_IRQHandler(void)
+{
+    cdc_acm_cts_isr();
+    cdc_acm_sniff_isr();
+}
+
+void EXTI2_3_IRQHandler(void)
+{
+    cdc_acm_sniff_isr();
+}
+
+void TIMER13_IRQHandler(void)
+{
+    cdc_acm_line_isr();
 }
 
 int main(void)
 {
     rcu_periph_clock_enable(RCU_GPIOA);
     rcu_periph_clock_enable(RCU_USART0);
+    rcu_periph_clock_enable(RCU_USART1);
+    rcu_periph_clock_enable(RCU_DMA);
     rcu_periph_clock_enable(RCU_USBD);
     
     rcu_usbd_clock_config(RCU_USBD_CKPLL_DIV1_5);
+    dwt_init();
 
     gpio_mode_set(GPIOA, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO_PIN_13);
     gpio_output_options_set(GPIOA, GPIO_OTYPE_PP, GPIO_OSPEED_50MHZ, GPIO_PIN_13);    
@@ -45,17 +105,50 @@ int main(void)
     usart_deinit(USART0);
     usart_transmit_config(USART0, USART_TRANSMIT_ENABLE);
     usart_receive_config(USART0, USART_RECEIVE_ENABLE);
-    usart_interrupt_enable(USART0, USART_INT_RBNE);
-    cdc_acm_enable_usart(USART0);
+    // rx goes through dma, only idle line and line errors interrupt the core.
+    usart_interrupt_enable(USART0, USART_INT_IDLE);
+    usart_interrupt_enable(USART0, USART_INT_ERR);
+    usart_interrupt_enable(USART0, USART_INT_PERR);
+    cdc_acm_enable_usart(0, USART0);
+    
+    // second port on usart1, PA2 tx and PA3 rx.
+    gpio_af_set(GPIOA, GPIO_AF_1, GPIO_PIN_2);
+    gpio_af_set(GPIOA, GPIO_AF_1, GPIO_PIN_3);
+    gpio_mode_set(GPIOA, GPIO_MODE_AF, GPIO_PUPD_PULLUP, GPIO_PIN_2);
+    gpio_mode_set(GPIOA, GPIO_MODE_AF, GPIO_PUPD_PULLUP, GPIO_PIN_3);
+    gpio_output_options_set(GPIOA, GPIO_OTYPE_PP, GPIO_OSPEED_10MHZ, GPIO_PIN_2);
+    gpio_output_options_set(GPIOA, GPIO_OTYPE_PP, GPIO_OSPEED_10MHZ, GPIO_PIN_3);
+    
+    usart_deinit(USART1);
+    usart_transmit_config(USART1, USART_TRANSMIT_ENABLE);
+    usart_receive_config(USART1, USART_RECEIVE_ENABLE);
+    usart_interrupt_enable(USART1, USART_INT_IDLE);
+    usart_interrupt_enable(USART1, USART_INT_ERR);
+    usart_interrupt_enable(USART1, USART_INT_PERR);
+    cdc_acm_enable_usart(1, USART1);
     
     usbd_core_init(&usb_device_dev);
     usb_device_dev.status = USBD_CONNECTED;
 
     nvic_priority_group_set(NVIC_PRIGROUP_PRE1_SUB3);
     nvic_irq_enable(USBD_LP_IRQn, 1, 0);
-    nvic_irq_enable(USART0_IRQn, 0, 0);
+    nvic_irq_enable(USBD_HP_IRQn, 1, 0);
+    // idle line starts IN transfers, keep it at the USB priority level.
+    nvic_irq_enable(USART0_IRQn, 1, 2);
+    nvic_irq_enable(USART1_IRQn, 1, 2);
+    // shares usart dma tx with the USB OUT path, so same priority as USB.
+    nvic_irq_enable(DMA_Channel1_2_IRQn, 1, 1);
+    nvic_irq_enable(DMA_Channel3_4_IRQn, 1, 1);
+    // a peer dropping CTS wants tx stopped before its fifo fills.
+    nvic_irq_enable(EXTI4_15_IRQn, 0, 0);
+    // sniffer burst stamps, anything later than the start bit is timing error.
+    nvic_irq_enable(EXTI2_3_IRQn, 0, 0);
+    // target reset pulses are timed in microseconds, do not wait for USB.
+    nvic_irq_enable(TIMER13_IRQn, 0, 1);
 
+    // the bootloader proxy waits on the target, so it runs here and not in an isr.
     while (1) {
+        cdc_acm_proxy_poll();
     }
 }
 
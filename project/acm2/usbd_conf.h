@@ -4,7 +4,7 @@
 #include "gd32f1x0.h"
 
 #define USBD_CFG_MAX_NUM                   1U
-#define USBD_ITF_MAX_NUM                   1U
+#define USBD_ITF_MAX_NUM                   CDC_ACM_INTERFACE_COUNT
 
 /* define if low power mode is enabled; it allows entering the device into DEEP_SLEEP mode
    following USB suspend event and wakes up after the USB wakeup event is received. */
@@ -13,17 +13,112 @@
 /* USB feature -- Self Powered */
 /* #define USBD_SELF_POWERED */
 
-/* endpoint count used by the CDC ACM device */
-#define CDC_ACM_CMD_EP                     EP2_IN
-#define CDC_ACM_DATA_IN_EP                 EP1_IN
-#define CDC_ACM_DATA_OUT_EP                EP3_OUT
+/* two CDC ACM functions, port 0 bridges usart0 and port 1 usart1 */
+#define CDC_ACM_PORT_COUNT                 2U
+
+#define CDC_ACM0_CMD_EP                    EP2_IN
+#define CDC_ACM0_DATA_IN_EP                EP1_IN
+#define CDC_ACM0_DATA_OUT_EP               EP3_OUT
+#define CDC_ACM1_CMD_EP                    EP5_IN
+#define CDC_ACM1_DATA_IN_EP                EP4_IN
+#define CDC_ACM1_DATA_OUT_EP               EP6_OUT
+
+/* port 1 as a vendor specific interface (class 0xFF) with only the bulk pair
+   of CDC_ACM1_DATA_IN_EP/CDC_ACM1_DATA_OUT_EP, no cmd endpoint. no driver binds
+   to it, the host opens it through usbfs or libusb and queues transfers of many
+   packets without a tty layer in between. the usart line coding is set by the
+   vendor requests in cdc_acm.h, the bridge behaves like a CDC port otherwise. */
+//#define CDC_ACM_VENDOR_PORT
+
+/* interfaces the configuration enumerates, two per CDC function and one for
+   the vendor port */
+#ifdef CDC_ACM_VENDOR_PORT
+#define CDC_ACM_INTERFACE_COUNT            (2U * CDC_ACM_PORT_COUNT - 1U)
+#else
+#define CDC_ACM_INTERFACE_COUNT            (2U * CDC_ACM_PORT_COUNT)
+#endif
 
 #define CDC_ACM_CMD_PACKET_SIZE            8U
 #define CDC_ACM_DATA_PACKET_SIZE           64U
-#define CDC_ACM_IN_FRAME_INTERVAL          4U
+
+/* IN flush policy: an idle endpoint sends at once when the usart line goes idle
+   or CDC_ACM_IN_BATCH_SIZE bytes are waiting, anything left is sent after
+   CDC_ACM_IN_MAX_LATENCY frames. request/response links want 1 and 1,
+   bulk streaming wants a full packet and a few frames. */
+#define CDC_ACM_IN_BATCH_SIZE              CDC_ACM_DATA_PACKET_SIZE
+#define CDC_ACM_IN_MAX_LATENCY             1U
+
+/* data endpoints buffer kind. the 512 byte packet memory holds the descriptor
+   table (8 bytes per endpoint), 2 x 64 for EP0, 2 x 8 for the cmd endpoints and
+   4 x 64 for the data endpoints, 456 bytes (448 with CDC_ACM_VENDOR_PORT).
+   double buffering would need another 256, so it is only an option with a
+   single port. */
+#define CDC_ACM_DATA_BUF_KIND              ENDP_SNG_BUF
+
+/* IN packets are copied from the rx ring to packet memory by core/usbd_pma.h
+   instead of the driver, a packet also spans the ring wrap. the cycles per
+   copy are in the bridge statistics, undefine it to time the driver copy.
+   needs single buffered IN endpoints. */
+#define CDC_ACM_PMA_DIRECT
+
+/* OUT packets buffered per port for usart dma transmit before the endpoint NAKs */
+#define CDC_ACM_TX_QUEUE_LEN               4U
+
+/* usart rx ring of each port filled by circular dma, power of two */
+#define CDC_ACM_RX_RING_SIZE               1024U
+
+/* RTS/CTS for usart0 on plain gpio, its hardware flow pins are the USB pins.
+   RTS goes high once the rx ring holds CDC_ACM_RX_HIGH_WATER bytes and low again
+   at CDC_ACM_RX_LOW_WATER, the gap must cover a ms of data at the line rate.
+   CTS high pauses the usart tx dma. comment out to free the pins. */
+#define CDC_ACM_FLOW_CONTROL
+#define CDC_ACM_RTS_PORT                   GPIOA
+#define CDC_ACM_RTS_PIN                    GPIO_PIN_4
+#define CDC_ACM_CTS_PORT                   GPIOA
+#define CDC_ACM_CTS_PIN                    GPIO_PIN_5
+#define CDC_ACM_CTS_EXTI_PORT              EXTI_SOURCE_GPIOA
+#define CDC_ACM_CTS_EXTI_PIN               EXTI_SOURCE_PIN5
+#define CDC_ACM_CTS_EXTI                   EXTI_5
+#define CDC_ACM_RX_HIGH_WATER              (CDC_ACM_RX_RING_SIZE / 2U)
+#define CDC_ACM_RX_LOW_WATER               (CDC_ACM_RX_RING_SIZE / 4U)
+
+/* target control from the DTR/RTS lines of port CDC_ACM_LINE_PORT. a rising DTR
+   pulses NRST low for CDC_ACM_NRST_PULSE_US, with RTS set BOOT0 is high across
+   the pulse and CDC_ACM_BOOT0_HOLD_US after it, so the target starts its ROM
+   bootloader. steps are timed by TIMER13 in microseconds, at least 2 each.
+   comment out to free the pins. */
+#define CDC_ACM_LINE_CONTROL
+#define CDC_ACM_LINE_PORT                  0U
+#define CDC_ACM_NRST_PORT                  GPIOA
+#define CDC_ACM_NRST_PIN                   GPIO_PIN_6
+#define CDC_ACM_BOOT0_PORT                 GPIOA
+#define CDC_ACM_BOOT0_PIN                  GPIO_PIN_7
+#define CDC_ACM_NRST_PULSE_US              100U
+#define CDC_ACM_BOOT0_HOLD_US              5000U
+
+/* bootloader proxy. a port set to CDC_ACM_PROXY_BAUD stops bridging and runs
+   framed requests (see cdc_acm.h) against the target bootloader itself at
+   CDC_ACM_PROXY_TARGET_BAUD 8e1, so the ACKs never cross USB. a page is the
+   largest read/write request, sent to the target in 256 byte commands. */
+#define CDC_ACM_PROXY_BAUD                 1234U
+#define CDC_ACM_PROXY_TARGET_BAUD          115200U
+#define CDC_ACM_PROXY_PAGE_SIZE            1024U
+#define CDC_ACM_PROXY_TIMEOUT_MS           100U
+#define CDC_ACM_PROXY_ERASE_MS             10000U
+
+/* serial sniffer. a port set to CDC_ACM_SNIFF_BAUD stops bridging, both usarts
+   become receive only taps of one link (tx pins float) and their bursts are
+   streamed on that port as records, see cdc_acm.h. a 7 byte OUT packet in the
+   CDC line coding layout sets the line of both taps. the first start bit of a
+   burst is stamped from TIMER1 at 1 MHz by an edge interrupt of the rx pin,
+   armed when the line goes idle. records wait in a CDC_ACM_SNIFF_RING_SIZE
+   ring for the host. comment out to free TIMER1. */
+#define CDC_ACM_SNIFFER
+#define CDC_ACM_SNIFF_BAUD                 4321U
+#define CDC_ACM_SNIFF_RING_SIZE            1024U
 
 /* endpoint count used by the CDC ACM device */
-#define EP_COUNT                           4U
+#define EP_COUNT                           7U
 #define USB_STRING_COUNT                   4U
 
 /* base address of the allocation buffer, used for buffer descriptor table and packet memory */
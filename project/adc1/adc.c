@@ -1,9 +1,20 @@
 #include "gd32f1x0.h"
 #include "printf.h"
+#include "ring.h"
+#include "adc_frame.h"
+
+// each conversion goes out as a one scan frame of PA0 (core/adc_frame.h) at
+// ADC_STREAM_BAUD, for "gd32up capture". comment out for text at 115200.
+#define ADC_STREAM
+#define ADC_STREAM_BAUD         921600U
 
 volatile uint32_t delay = 0;
 uint16_t adc_value;
 
+#ifdef ADC_STREAM
+uint8_t adc_frame[ADC_FRAME_SIZE(1)];
+#endif
+
 void SysTick_Handler(void)
 {
         if (0 != delay) 
@@ -16,14 +27,49 @@ void delay_1ms(uint32_t count)
         while(0 != delay);
 }
 
+// printf output and frames, drained by the usart TBE interrupt.
+RING_DEFINE(uart_tx_ring, 256);
+
+void USART0_IRQHandler(void)
+{
+        int c;
+        
+        if (RESET != usart_interrupt_flag_get(USART0, USART_INT_FLAG_TBE)) {
+                c = ring_get(&uart_tx_ring);
+                if (c < 0)
+                        usart_interrupt_disable(USART0, USART_INT_TBE);
+                else
+                        usart_data_transmit(USART0, (uint8_t)c);
+        }
+}
+
 void sys_putchar(char c)
 {
-        usart_data_transmit(USART0, (uint8_t)c);
-        while(RESET == usart_flag_get(USART0, USART_FLAG_TBE));
+        // only wait when the ring is full, printf must not lose text.
+        while (ring_free(&uart_tx_ring) == 0);
+        ring_put(&uart_tx_ring, (uint8_t)c);
+        usart_interrupt_enable(USART0, USART_INT_TBE);
+}
+
+#ifdef ADC_STREAM
+// a frame goes into the ring whole, so the host never sees half of one.
+void adc_stream_send(const uint8_t *f, uint16_t len)
+{
+        while (ring_free(&uart_tx_ring) < len);
+        ring_write(&uart_tx_ring, f, len);
+        usart_interrupt_enable(USART0, USART_INT_TBE);
 }
+#endif
 
 int main(void)
 {
+#ifdef ADC_STREAM
+        uint16_t seq = 0, len;
+#endif
+#ifdef RUN_IN_RAM
+        // vector table is at the start of sram, see gd32f150g8_ram.ld.
+        nvic_vector_table_set(NVIC_VECTTAB_RAM, 0);
+#endif
         if (SysTick_Config(SystemCoreClock / 1000))
                 while (1);
         NVIC_SetPriority(SysTick_IRQn, 0x00);
@@ -42,10 +88,15 @@ int main(void)
         gpio_output_options_set(GPIOA, GPIO_OTYPE_PP, GPIO_OSPEED_10MHZ, GPIO_PIN_10);
         
         usart_deinit(USART0);
+#ifdef ADC_STREAM
+        usart_baudrate_set(USART0, ADC_STREAM_BAUD);
+#else
         usart_baudrate_set(USART0, 115200U);
+#endif
         usart_transmit_config(USART0, USART_TRANSMIT_ENABLE);
         usart_receive_config(USART0, USART_RECEIVE_ENABLE);
         usart_enable(USART0);
+        nvic_irq_enable(USART0_IRQn, 1, 0);
         
         gpio_mode_set(GPIOA, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, GPIO_PIN_0);
         
@@ -65,7 +116,12 @@ int main(void)
                 while(SET != adc_flag_get(ADC_FLAG_EOC));
                 
                 adc_value = ADC_RDATA;
+#ifdef ADC_STREAM
+                len = adc_frame_pack(adc_frame, seq++, 0x1, 0, 1, &adc_value, 1);
+                adc_stream_send(adc_frame, len);
+#else
                 printf("ADC: %d\r\n", adc_value);
+#endif
                
                 delay_1ms(1000);
         }
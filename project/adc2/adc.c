@@ -1,8 +1,37 @@
 #include "gd32f1x0.h"
 #include "printf.h"
+#include "ring.h"
+#include "adc_frame.h"
+
+// PA0..PA7 (ADC_IN0..7) are converted as one scan per TIMER2 update, dma writes
+// the scans circularly into adc_buf. each half is a block of ADC_BLOCK_SCANS
+// scans, the main loop gets it while dma fills the other half. a scan takes
+// 8 x (ADC_SAMPLETIME + 12.5) adc clocks, 168us at 239.5 and 12 MHz, so keep
+// ADC_SAMPLE_RATE below ~5 kHz there or pick a shorter sample time.
+#define ADC_CHANNELS            8
+#define ADC_SAMPLE_RATE         1000U           // scans per second, at least 16
+#define ADC_BLOCK_SCANS         (ADC_SAMPLE_RATE / 20U)  // 50ms blocks, 1.6KB buffer
+#define ADC_SAMPLETIME          ADC_SAMPLETIME_239POINT5
+#define ADC_CHANNEL_MASK        ((1U << ADC_CHANNELS) - 1)
+
+// each block goes out as one binary frame (core/adc_frame.h) by usart dma at
+// ADC_STREAM_BAUD, for "gd32up capture". 8 channels at 1 kHz are 12 KB/s of
+// packed samples. comment out for the block means as text at 115200.
+#define ADC_STREAM
+#define ADC_STREAM_BAUD         921600U
 
 volatile uint32_t delay = 0;
-volatile uint16_t adc_value[8] = {0};
+uint16_t adc_value[ADC_CHANNELS];           // block means
+
+volatile uint16_t adc_buf[2][ADC_BLOCK_SCANS][ADC_CHANNELS];
+volatile int8_t adc_ready = -1;         // half that is complete, -1 none
+volatile uint16_t adc_ready_seq = 0;    // its block number
+volatile uint16_t adc_seq = 0;
+volatile uint32_t adc_overrun = 0;      // blocks the main loop was too late for
+
+#ifdef ADC_STREAM
+uint8_t adc_frame[ADC_FRAME_SIZE(ADC_BLOCK_SCANS * ADC_CHANNELS)];
+#endif
 
 void SysTick_Handler(void)
 {
@@ -16,14 +45,151 @@ void delay_1ms(uint32_t count)
         while(0 != delay);
 }
 
+// printf output, drained by the usart TBE interrupt.
+RING_DEFINE(uart_tx_ring, 256);
+
+void USART0_IRQHandler(void)
+{
+        int c;
+        
+        if (RESET != usart_interrupt_flag_get(USART0, USART_INT_FLAG_TBE)) {
+                c = ring_get(&uart_tx_ring);
+                if (c < 0)
+                        usart_interrupt_disable(USART0, USART_INT_TBE);
+                else
+                        usart_data_transmit(USART0, (uint8_t)c);
+        }
+}
+
+void adc_block_done(int8_t half)
+{
+        // the previous block was not taken, dma is already writing over it.
+        if (adc_ready >= 0)
+                adc_overrun++;
+        adc_ready = half;
+        adc_ready_seq = adc_seq++;
+}
+
+void DMA_Channel0_IRQHandler(void)
+{
+        // half transfer completes block 0, full transfer block 1.
+        if (RESET != dma_interrupt_flag_get(DMA_CH0, DMA_INT_FLAG_HTF)) {
+                dma_interrupt_flag_clear(DMA_CH0, DMA_INT_FLAG_HTF);
+                adc_block_done(0);
+        }
+        if (RESET != dma_interrupt_flag_get(DMA_CH0, DMA_INT_FLAG_FTF)) {
+                dma_interrupt_flag_clear(DMA_CH0, DMA_INT_FLAG_FTF);
+                adc_block_done(1);
+        }
+}
+
 void sys_putchar(char c)
 {
-        usart_data_transmit(USART0, (uint8_t)c);
-        while(RESET == usart_flag_get(USART0, USART_FLAG_TBE));
+        // only wait when the ring is full, printf must not lose text.
+        while (ring_free(&uart_tx_ring) == 0);
+        ring_put(&uart_tx_ring, (uint8_t)c);
+        usart_interrupt_enable(USART0, USART_INT_TBE);
+}
+
+void adc_timer_init(uint32_t rate)
+{
+        timer_parameter_struct timer_initpara;
+
+        // 1 MHz ticks, every update event triggers one scan.
+        rcu_periph_clock_enable(RCU_TIMER2);
+        timer_deinit(TIMER2);
+        timer_initpara.prescaler = SystemCoreClock / 1000000U - 1;
+        timer_initpara.alignedmode = TIMER_COUNTER_EDGE;
+        timer_initpara.counterdirection = TIMER_COUNTER_UP;
+        timer_initpara.period = 1000000U / rate - 1;
+        timer_initpara.clockdivision = TIMER_CKDIV_DIV1;
+        timer_initpara.repetitioncounter = 0;
+        timer_init(TIMER2, &timer_initpara);
+        timer_master_output_trigger_source_select(TIMER2, TIMER_TRI_OUT_SRC_UPDATE);
+}
+
+void adc_dma_init(void)
+{
+        dma_parameter_struct dma_init_struct;
+
+        dma_deinit(DMA_CH0);
+        dma_init_struct.direction = DMA_PERIPHERAL_TO_MEMORY;
+        dma_init_struct.memory_addr = (uint32_t)adc_buf;
+        dma_init_struct.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+        dma_init_struct.memory_width = DMA_MEMORY_WIDTH_16BIT;
+        dma_init_struct.number = sizeof(adc_buf) / sizeof(adc_buf[0][0][0]);
+        dma_init_struct.periph_addr = (uint32_t)&ADC_RDATA;
+        dma_init_struct.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+        dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_16BIT;
+        dma_init_struct.priority = DMA_PRIORITY_HIGH;
+        dma_init(DMA_CH0, dma_init_struct);
+        dma_circulation_enable(DMA_CH0);
+        dma_interrupt_enable(DMA_CH0, DMA_INT_HTF);
+        dma_interrupt_enable(DMA_CH0, DMA_INT_FTF);
+        dma_channel_enable(DMA_CH0);
+}
+
+#ifdef ADC_STREAM
+void adc_stream_init(void)
+{
+        dma_parameter_struct dma_init_struct;
+
+        // one transfer per frame, address and size are set on start.
+        dma_deinit(DMA_CH1);
+        dma_init_struct.direction = DMA_MEMORY_TO_PERIPHERAL;
+        dma_init_struct.memory_addr = (uint32_t)adc_frame;
+        dma_init_struct.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+        dma_init_struct.memory_width = DMA_MEMORY_WIDTH_8BIT;
+        dma_init_struct.number = 0;
+        dma_init_struct.periph_addr = (uint32_t)&USART_TDATA(USART0);
+        dma_init_struct.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+        dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_8BIT;
+        dma_init_struct.priority = DMA_PRIORITY_MEDIUM;
+        dma_init(DMA_CH1, dma_init_struct);
+        usart_dma_transmit_config(USART0, USART_DENT_ENABLE);
+}
+
+// the frame goes out while the next block is sampled, nothing waits for it.
+void adc_stream_send(uint8_t *f, uint16_t len)
+{
+        dma_channel_disable(DMA_CH1);
+        dma_memory_address_config(DMA_CH1, (uint32_t)f);
+        dma_transfer_number_config(DMA_CH1, len);
+        dma_channel_enable(DMA_CH1);
+}
+
+uint8_t adc_stream_busy(void)
+{
+        return dma_transfer_number_get(DMA_CH1) != 0;
+}
+#endif
+
+// mean of each channel over one block.
+void adc_block_mean(volatile uint16_t (*scan)[ADC_CHANNELS], uint16_t *mean)
+{
+        uint32_t sum[ADC_CHANNELS] = {0};
+        uint32_t i, c;
+
+        for (i = 0; i < ADC_BLOCK_SCANS; i++)
+                for (c = 0; c < ADC_CHANNELS; c++)
+                        sum[c] += scan[i][c];
+        for (c = 0; c < ADC_CHANNELS; c++)
+                mean[c] = sum[c] / ADC_BLOCK_SCANS;
 }
 
 int main(void)
 {
+        uint32_t overrun = 0;
+        uint16_t seq;
+        int8_t half;
+#ifdef ADC_STREAM
+        uint8_t flags = 0;
+        uint16_t len;
+#endif
+#ifdef RUN_IN_RAM
+        // vector table is at the start of sram, see gd32f150g8_ram.ld.
+        nvic_vector_table_set(NVIC_VECTTAB_RAM, 0);
+#endif
         if (SysTick_Config(SystemCoreClock / 1000))
                 while (1);
         NVIC_SetPriority(SysTick_IRQn, 0x00);
@@ -31,6 +197,7 @@ int main(void)
         rcu_periph_clock_enable(RCU_GPIOA);
         rcu_periph_clock_enable(RCU_USART0);
         rcu_periph_clock_enable(RCU_ADC);
+        rcu_periph_clock_enable(RCU_DMA);
         rcu_adc_clock_config(RCU_ADCCK_APB2_DIV6);
         
         gpio_af_set(GPIOA, GPIO_AF_1, GPIO_PIN_9);
@@ -41,10 +208,15 @@ int main(void)
         gpio_output_options_set(GPIOA, GPIO_OTYPE_PP, GPIO_OSPEED_10MHZ, GPIO_PIN_10);
         
         usart_deinit(USART0);
+#ifdef ADC_STREAM
+        usart_baudrate_set(USART0, ADC_STREAM_BAUD);
+#else
         usart_baudrate_set(USART0, 115200U);
+#endif
         usart_transmit_config(USART0, USART_TRANSMIT_ENABLE);
         usart_receive_config(USART0, USART_RECEIVE_ENABLE);
         usart_enable(USART0);
+        nvic_irq_enable(USART0_IRQn, 1, 0);
         
         gpio_mode_set(GPIOA, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, GPIO_PIN_0);
         gpio_mode_set(GPIOA, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, GPIO_PIN_1);
@@ -55,24 +227,60 @@ int main(void)
         gpio_mode_set(GPIOA, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, GPIO_PIN_6);
         gpio_mode_set(GPIOA, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, GPIO_PIN_7);
         
-        adc_external_trigger_config(ADC_REGULAR_CHANNEL, ENABLE);
-        adc_external_trigger_source_config(ADC_REGULAR_CHANNEL, ADC_EXTTRIG_REGULAR_SWRCST); 
+        // one trigger converts all channels in rank order, no cpu per sample.
+        adc_special_function_config(ADC_SCAN_MODE, ENABLE);
+        adc_special_function_config(ADC_CONTINUOUS_MODE, DISABLE);
         adc_data_alignment_config(ADC_DATAALIGN_RIGHT);
-        adc_channel_length_config(ADC_REGULAR_CHANNEL, 1);
+        adc_channel_length_config(ADC_REGULAR_CHANNEL, ADC_CHANNELS);
+        for (uint8_t i = 0; i < ADC_CHANNELS; i++)
+                adc_regular_channel_config(i, i, ADC_SAMPLETIME);
+        adc_external_trigger_source_config(ADC_REGULAR_CHANNEL, ADC_EXTTRIG_REGULAR_T2_TRGO);
+        adc_external_trigger_config(ADC_REGULAR_CHANNEL, ENABLE);
+        adc_dma_mode_enable();
         adc_enable();
         adc_calibration_enable();
+
+        adc_dma_init();
+#ifdef ADC_STREAM
+        adc_stream_init();
+#endif
+        nvic_irq_enable(DMA_Channel0_IRQn, 0, 0);
+        adc_timer_init(ADC_SAMPLE_RATE);
+        timer_enable(TIMER2);
         
         while(1) {
-                for (uint8_t i = 0; i < 8; i++) {
-                        adc_regular_channel_config(0, i, ADC_SAMPLETIME_239POINT5);
-                        adc_software_trigger_enable(ADC_REGULAR_CHANNEL);
-                        while (SET != adc_flag_get(ADC_FLAG_EOC));
-                        adc_flag_clear(ADC_FLAG_EOC);
-                        
-                        adc_value[i] = ADC_RDATA;
+                // sleep until dma hands over a block.
+                while (adc_ready < 0)
+                        __WFI();
+                __disable_irq();
+                half = adc_ready;
+                seq = adc_ready_seq;
+                adc_ready = -1;
+                __enable_irq();
+
+#ifdef ADC_STREAM
+                // lost blocks show as a seq gap, the next frame says it was us.
+                if (overrun != adc_overrun) {
+                        overrun = adc_overrun;
+                        flags |= ADC_FRAME_OVERRUN;
+                }
+                if (adc_stream_busy()) {
+                        flags |= ADC_FRAME_OVERRUN;
+                        continue;
+                }
+                len = adc_frame_pack(adc_frame, seq, ADC_CHANNEL_MASK, flags, ADC_BLOCK_SCANS,
+                        &adc_buf[half][0][0], ADC_BLOCK_SCANS * ADC_CHANNELS);
+                adc_stream_send(adc_frame, len);
+                flags = 0;
+#else
+                (void)seq;
+                adc_block_mean(adc_buf[half], adc_value);
+                for (uint8_t i = 0; i < ADC_CHANNELS; i++)
                         printf("ADC[%d]: %d\r\n", i, (uint32_t)adc_value[i] * 3300 / 4096);
+                if (overrun != adc_overrun) {
+                        overrun = adc_overrun;
+                        printf("ADC: %d blocks overrun\r\n", overrun);
                 }
-                
-                delay_1ms(100);
+#endif
         }
 }
@@ -0,0 +1,84 @@
+#ifndef ADC_FRAME_H
+#define ADC_FRAME_H
+
+#include <stdint.h>
+
+/* binary adc sample frames, little endian: sync (2), seq (le16), channel mask,
+   flags, scans (le16), samples, crc (le16). seq counts blocks at the source, a
+   gap is a dropped frame. samples are 12 bit, scan after scan in channel order,
+   two in three bytes (a0..7, a8..11 | b0..3 << 4, b4..11), an odd last sample
+   takes two bytes. the crc is crc16-ccitt (0x1021, init 0xFFFF) of everything
+   after the sync. gd32up capture decodes it.
+   a RAW frame carries the samples as le16 words and no crc, for links that
+   check their data themselves (usb). the high nibble of a sample is 0, so the
+   sync never shows up in its samples and a cut off frame is seen. START marks
+   the first frame after the source (re)started, at a new rate perhaps. WIDE
+   samples are filtered and use all 16 bits (12 bit full scale shifted left
+   by 4), their source never cuts a frame off. a TRIGGER frame is a window
+   around an event, it is not contiguous in time with the frame before, seq
+   counts the windows and scans may differ from the blocks. */
+
+#define ADC_FRAME_SYNC0         0xA5
+#define ADC_FRAME_SYNC1         0x5A
+#define ADC_FRAME_HEADER        8
+#define ADC_FRAME_OVERRUN       0x01    /* the source dropped blocks before this one */
+#define ADC_FRAME_RAW           0x02
+#define ADC_FRAME_START         0x04
+#define ADC_FRAME_WIDE          0x08
+#define ADC_FRAME_TRIGGER       0x10
+
+#define ADC_FRAME_SIZE(samples) (ADC_FRAME_HEADER + ((samples) * 3 + 1) / 2 + 2)
+#define ADC_FRAME_RAW_SIZE(samples) (ADC_FRAME_HEADER + (samples) * 2)
+
+/* a nibble at a time, 16 entries instead of 256 */
+static inline uint16_t crc16_ccitt(uint16_t crc, const uint8_t *d, uint32_t len)
+{
+    static const uint16_t t[16] =
+    {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+    };
+
+    while (len--) {
+        crc = (crc << 4) ^ t[(crc >> 12) ^ (*d >> 4)];
+        crc = (crc << 4) ^ t[(crc >> 12) ^ (*d++ & 0x0F)];
+    }
+    return crc;
+}
+
+/* build a frame of n samples at f, returns its size */
+static inline uint16_t adc_frame_pack(uint8_t *f, uint16_t seq, uint8_t mask, uint8_t flags,
+    uint16_t scans, const volatile uint16_t *s, uint16_t n)
+{
+    uint8_t *p = f + ADC_FRAME_HEADER;
+    uint16_t a, b, crc;
+
+    f[0] = ADC_FRAME_SYNC0;
+    f[1] = ADC_FRAME_SYNC1;
+    f[2] = seq;
+    f[3] = seq >> 8;
+    f[4] = mask;
+    f[5] = flags;
+    f[6] = scans;
+    f[7] = scans >> 8;
+
+    for (; n >= 2; n -= 2, s += 2) {
+        a = s[0] & 0x0FFF;
+        b = s[1] & 0x0FFF;
+        *p++ = a;
+        *p++ = (a >> 8) | (b << 4);
+        *p++ = b >> 4;
+    }
+    if (n) {
+        a = s[0] & 0x0FFF;
+        *p++ = a;
+        *p++ = a >> 8;
+    }
+
+    crc = crc16_ccitt(0xFFFF, f + 2, p - f - 2);
+    *p++ = crc;
+    *p++ = crc >> 8;
+    return p - f;
+}
+
+#endif  /* ADC_FRAME_H */
@@ -0,0 +1,158 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdint.h>
+
+/* fixed point decimation pipeline for adc samples: moving average, cic
+   decimator, biquad. samples between the stages are 16 bit full scale, a 12
+   bit adc sample goes in shifted left by 4 and the stages fill the low bits.
+   each stage keeps its state in a struct and takes one sample per call, one
+   chain per channel. integer only, the biquad is five 32 bit multiply
+   accumulates (MLA, one cycle on the m3). gd32up dspcheck runs this code
+   against floating point models. */
+
+#define DSP_AVERAGE_MAX_SHIFT   4       /* up to 16 samples */
+#define DSP_CIC_MAX_ORDER       4
+#define DSP_BIQUAD_SHIFT        14      /* coefficients are Q14 */
+
+/* moving average of 2^shift samples, the sum is updated, not recomputed */
+typedef struct
+{
+    uint16_t hist[1 << DSP_AVERAGE_MAX_SHIFT];
+    uint32_t sum;
+    uint8_t shift;
+    uint8_t pos;
+} dsp_average_struct;
+
+/* cic decimator by 2^shift, order stages. the registers wrap modulo 2^32,
+   which the combs undo as long as 16 + order * shift <= 32. */
+typedef struct
+{
+    uint32_t integ[DSP_CIC_MAX_ORDER];
+    uint32_t comb[DSP_CIC_MAX_ORDER];   /* last input of each comb */
+    uint8_t order;
+    uint8_t shift;
+    uint16_t phase;
+} dsp_cic_struct;
+
+/* direct form 1 biquad, y = b0 x + b1 x1 + b2 x2 - a1 y1 - a2 y2. the sum of
+   the absolute coefficients must stay below 4.0 (65536 in Q14), the
+   accumulator can not overflow then. the truncated bits are fed back into
+   the next output (first order error feedback). */
+typedef struct
+{
+    int32_t b0, b1, b2, a1, a2;
+    int32_t x1, x2, y1, y2;
+    int32_t err;
+} dsp_biquad_struct;
+
+typedef struct
+{
+    dsp_average_struct avg;
+    dsp_cic_struct cic;
+    dsp_biquad_struct iir;
+} dsp_chain_struct;
+
+/* 0 is a pass through */
+static inline void dsp_average_init(dsp_average_struct *a, uint8_t shift)
+{
+    uint8_t i;
+
+    for (i = 0; i < (1 << DSP_AVERAGE_MAX_SHIFT); i++)
+        a->hist[i] = 0;
+    a->sum = 0;
+    a->shift = shift;
+    a->pos = 0;
+}
+
+static inline uint16_t dsp_average_put(dsp_average_struct *a, uint16_t x)
+{
+    a->sum += x - a->hist[a->pos];
+    a->hist[a->pos] = x;
+    a->pos = (a->pos + 1) & ((1 << a->shift) - 1);
+    return a->sum >> a->shift;
+}
+
+/* shift 0 is a pass through, returns -1 if the registers are too small */
+static inline int dsp_cic_init(dsp_cic_struct *c, uint8_t order, uint8_t shift)
+{
+    uint8_t i;
+
+    if (order == 0 || order > DSP_CIC_MAX_ORDER || 16 + order * shift > 32)
+        return -1;
+    for (i = 0; i < DSP_CIC_MAX_ORDER; i++)
+        c->integ[i] = c->comb[i] = 0;
+    c->order = order;
+    c->shift = shift;
+    c->phase = 0;
+    return 0;
+}
+
+/* returns 1 with a sample in *out for every 2^shift inputs */
+static inline int dsp_cic_put(dsp_cic_struct *c, uint16_t x, uint16_t *out)
+{
+    uint32_t v = x, d;
+    uint8_t i, gain = c->order * c->shift;
+
+    for (i = 0; i < c->order; i++)
+        v = c->integ[i] += v;
+    if (++c->phase < (1U << c->shift))
+        return 0;
+    c->phase = 0;
+
+    for (i = 0; i < c->order; i++) {
+        d = v - c->comb[i];
+        c->comb[i] = v;
+        v = d;
+    }
+    /* the gain is 2^gain, rounded back to 16 bit full scale */
+    *out = gain ? ((v >> (gain - 1)) + 1) >> 1 : v;
+    return 1;
+}
+
+/* Q14 coefficients, a0 is 1 */
+static inline void dsp_biquad_init(dsp_biquad_struct *q, int16_t b0, int16_t b1, int16_t b2,
+    int16_t a1, int16_t a2)
+{
+    q->b0 = b0;
+    q->b1 = b1;
+    q->b2 = b2;
+    q->a1 = a1;
+    q->a2 = a2;
+    q->x1 = q->x2 = q->y1 = q->y2 = 0;
+    q->err = 0;
+}
+
+/* offset binary in and out, the filter runs on the signed value */
+static inline uint16_t dsp_biquad_put(dsp_biquad_struct *q, uint16_t in)
+{
+    int32_t x = (int32_t)in - 32768, acc, y;
+
+    acc = q->b0 * x + q->b1 * q->x1 + q->b2 * q->x2 - q->a1 * q->y1 - q->a2 * q->y2 + q->err;
+    y = acc >> DSP_BIQUAD_SHIFT;
+    q->err = acc & ((1 << DSP_BIQUAD_SHIFT) - 1);
+    if (y > 32767)
+        y = 32767;
+    else if (y < -32768)
+        y = -32768;
+
+    q->x2 = q->x1;
+    q->x1 = x;
+    q->y2 = q->y1;
+    q->y1 = y;
+    return y + 32768;
+}
+
+/* one 12 bit adc sample in, returns 1 with a 16 bit sample in *out once the
+   cic has one */
+static inline int dsp_chain_put(dsp_chain_struct *p, uint16_t adc, uint16_t *out)
+{
+    uint16_t v = dsp_average_put(&p->avg, adc << 4);
+
+    if (!dsp_cic_put(&p->cic, v, &v))
+        return 0;
+    *out = dsp_biquad_put(&p->iir, v);
+    return 1;
+}
+
+#endif  /* DSP_H */
@@ -0,0 +1,48 @@
+#ifndef DWT_H
+#define DWT_H
+
+#include <stdint.h>
+
+/* cortex-m3 cycle counter, counts core clocks while TRCENA is set, also
+   without a debugger. the cmsis header of this tree has no DWT block, so the
+   registers are addressed directly. */
+
+#define DWT_CTRL                (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT              (*(volatile uint32_t *)0xE0001004)
+#define DWT_DEMCR               (*(volatile uint32_t *)0xE000EDFC)
+
+#define DWT_DEMCR_TRCENA        (1UL << 24)
+#define DWT_CTRL_CYCCNTENA      (1UL << 0)
+
+/* cycles spent in one piece of code, e.g. an isr */
+typedef struct
+{
+    uint32_t count;
+    uint32_t cycles;            /* total, wraps after 2^32 cycles */
+    uint32_t max;
+} dwt_stat_struct;
+
+static inline void dwt_init(void)
+{
+    DWT_DEMCR |= DWT_DEMCR_TRCENA;
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+static inline uint32_t dwt_cycles(void)
+{
+    return DWT_CYCCNT;
+}
+
+/* account the cycles since start, unsigned math survives a counter wrap */
+static inline void dwt_stat_add(dwt_stat_struct *s, uint32_t start)
+{
+    uint32_t t = DWT_CYCCNT - start;
+
+    s->count++;
+    s->cycles += t;
+    if (t > s->max)
+        s->max = t;
+}
+
+#endif  /* DWT_H */
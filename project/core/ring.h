@@ -0,0 +1,191 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+/* single producer / single consumer byte ring, e.g. usart isr -> usb isr.
+   head is only written by the producer and tail only by the consumer, so no
+   locking is needed. ring_dma_update is the exception, see there. both run freely and wrap at 65536, which keeps full and
+   empty apart, size must be a power of two up to 32768. */
+
+/* order data accesses against index updates, also a compiler barrier */
+#define RING_BARRIER()          __asm volatile ("dmb" ::: "memory")
+
+typedef struct
+{
+    uint8_t *buf;
+    uint16_t mask;                  /* size - 1 */
+    volatile uint16_t head;         /* producer position */
+    volatile uint16_t tail;         /* consumer position */
+    uint16_t dma_pos;               /* offset the dma of ring_dma_update was at */
+    uint16_t high_water;            /* most bytes ever waiting */
+    volatile uint32_t overflow;     /* bytes dropped because the ring was full */
+} ring_struct;
+
+/* define a ring and its storage, a size that is not a power of two fails to compile */
+#define RING_DEFINE(name, size) \
+    static uint8_t name##_buf[size] __attribute__((aligned(4))); \
+    typedef char name##_size_is_power_of_two[((((size) & ((size) - 1)) == 0) && ((size) <= 32768)) ? 1 : -1]; \
+    ring_struct name = { name##_buf, (size) - 1, 0, 0, 0, 0, 0 }
+
+static inline uint16_t ring_size(const ring_struct *r)
+{
+    return r->mask + 1;
+}
+
+static inline uint16_t ring_used(const ring_struct *r)
+{
+    return (uint16_t)(r->head - r->tail);
+}
+
+static inline uint16_t ring_free(const ring_struct *r)
+{
+    return ring_size(r) - ring_used(r);
+}
+
+static inline void ring_reset(ring_struct *r)
+{
+    r->head = 0;
+    r->tail = 0;
+    r->dma_pos = 0;
+}
+
+/* producer: contiguous free space at head, fill it then ring_commit() */
+static inline uint16_t ring_write_span(const ring_struct *r, uint8_t **p)
+{
+    uint16_t head = r->head & r->mask;
+    uint16_t len = ring_size(r) - head;
+    uint16_t space = ring_free(r);
+
+    *p = r->buf + head;
+    return len < space ? len : space;
+}
+
+/* producer: publish len bytes written at head */
+static inline void ring_commit(ring_struct *r, uint16_t len)
+{
+    uint16_t used;
+
+    /* data must land before the consumer can see the new head */
+    RING_BARRIER();
+    r->head = r->head + len;
+
+    used = ring_used(r);
+    if (used > r->high_water)
+        r->high_water = used;
+}
+
+static inline uint8_t ring_put(ring_struct *r, uint8_t c)
+{
+    if (ring_free(r) == 0) {
+        r->overflow++;
+        return 0;
+    }
+    r->buf[r->head & r->mask] = c;
+    ring_commit(r, 1);
+    return 1;
+}
+
+/* copy in as much as fits, the rest is counted as overflow */
+static inline uint16_t ring_write(ring_struct *r, const uint8_t *d, uint16_t len)
+{
+    uint16_t done = 0, n, i;
+    uint8_t *p;
+
+    while (done < len) {
+        n = ring_write_span(r, &p);
+        if (n == 0)
+            break;
+        if (n > len - done)
+            n = len - done;
+        for (i = 0; i < n; i++)
+            p[i] = d[done + i];
+        ring_commit(r, n);
+        done += n;
+    }
+    r->overflow += len - done;
+    return done;
+}
+
+/* producer: a circular dma owns the writes, pos is its offset in buf. head
+   follows the dma, so call it at least once per lap, e.g. on half transfer.
+   bytes the dma wrote over unread data are counted once and the tail is moved
+   past them, what stays readable is still in buf. as it writes tail too, the
+   consumer must not preempt it or be preempted by it, and a span held across
+   an update is given back with ring_release_to. */
+static inline uint16_t ring_dma_update(ring_struct *r, uint16_t pos)
+{
+    uint16_t len = (uint16_t)(pos - r->dma_pos) & r->mask;
+    uint16_t used = ring_used(r) + len;
+
+    r->dma_pos = pos;
+    ring_commit(r, len);
+    if (used > ring_size(r)) {
+        r->overflow += used - ring_size(r);
+        r->tail = r->head - ring_size(r);
+    }
+    return len;
+}
+
+/* consumer: contiguous data at tail, e.g. for usbd_ep_tx or a dma, then ring_release() */
+static inline uint16_t ring_read_span(const ring_struct *r, uint8_t **p)
+{
+    uint16_t tail = r->tail & r->mask;
+    uint16_t len = ring_size(r) - tail;
+    uint16_t used = ring_used(r);
+
+    /* head is read before the data it covers */
+    RING_BARRIER();
+    *p = r->buf + tail;
+    return len < used ? len : used;
+}
+
+/* consumer: hand len bytes at tail back to the producer */
+static inline void ring_release(ring_struct *r, uint16_t len)
+{
+    /* done with the data before the producer may reuse it */
+    RING_BARRIER();
+    r->tail = r->tail + len;
+}
+
+/* consumer: the span that ends at position end is done, the tail only moves
+   forward in case ring_dma_update already dropped it */
+static inline void ring_release_to(ring_struct *r, uint16_t end)
+{
+    RING_BARRIER();
+    if ((int16_t)(end - r->tail) > 0)
+        r->tail = end;
+}
+
+static inline int ring_get(ring_struct *r)
+{
+    uint8_t c;
+
+    if (ring_used(r) == 0)
+        return -1;
+    RING_BARRIER();
+    c = r->buf[r->tail & r->mask];
+    ring_release(r, 1);
+    return c;
+}
+
+static inline uint16_t ring_read(ring_struct *r, uint8_t *d, uint16_t len)
+{
+    uint16_t done = 0, n, i;
+    uint8_t *p;
+
+    while (done < len) {
+        n = ring_read_span(r, &p);
+        if (n == 0)
+            break;
+        if (n > len - done)
+            n = len - done;
+        for (i = 0; i < n; i++)
+            d[done + i] = p[i];
+        ring_release(r, n);
+        done += n;
+    }
+    return done;
+}
+
+#endif  /* RING_H */
@@ -0,0 +1,110 @@
+#ifndef USBD_PMA_H
+#define USBD_PMA_H
+
+#include <stdint.h>
+#include "usbd_core.h"
+#include "ring.h"
+
+/* usb packet memory copies. the 512 byte packet memory sits on a 16 bit bus,
+   every halfword takes a 32 bit slot in the cpu address space. the usbd driver
+   assembles each halfword from two byte loads, these copy four halfwords per
+   iteration and load whole halfwords from aligned buffers. registers are
+   addressed directly. only usbd_pma_ep_tx touches driver state. */
+
+#define USBD_PMA_BASE           0x40006000U
+#define USBD_REG_BASE           0x40005C00U
+
+#define USBD_EPCS(ep)           (*(volatile uint32_t *)(USBD_REG_BASE + (ep) * 4U))
+#define USBD_BADDR              (*(volatile uint32_t *)(USBD_REG_BASE + 0x50U))
+
+/* halfword at a packet memory address */
+#define USBD_PMA_WORD(addr)     (*(volatile uint32_t *)(USBD_PMA_BASE + (uint32_t)(addr) * 2U))
+
+/* buffer descriptor table entries of an endpoint */
+#define USBD_TX_ADDR(ep)        USBD_PMA_WORD((USBD_BADDR & 0xFFF8U) + (ep) * 8U)
+#define USBD_TX_COUNT(ep)       USBD_PMA_WORD((USBD_BADDR & 0xFFF8U) + (ep) * 8U + 2U)
+
+#define USBD_EPCS_KEEP          0x8F8FU     /* complete flags, setup, type, kind, address */
+#define USBD_EPCS_TX_STAT       0x0030U     /* toggled by writing 1 */
+#define USBD_EPCS_TX_VALID      0x0030U
+#define USBD_EPCS_CTR           0x8080U     /* complete flags, writing 1 keeps them */
+
+/* an odd len reads one byte past the data, like the driver does */
+static inline void usbd_pma_write(uint16_t addr, const uint8_t *d, uint16_t len)
+{
+    volatile uint32_t *p = &USBD_PMA_WORD(addr);
+    uint16_t n = (len + 1U) >> 1;
+    const uint16_t *h;
+
+    if (((uint32_t)d & 1U) == 0U) {
+        for (h = (const uint16_t *)d; n >= 4U; n -= 4U, h += 4, p += 4) {
+            p[0] = h[0];
+            p[1] = h[1];
+            p[2] = h[2];
+            p[3] = h[3];
+        }
+        while (n--)
+            *p++ = *h++;
+        return;
+    }
+
+    for (; n >= 4U; n -= 4U, d += 8, p += 4) {
+        p[0] = d[0] | (d[1] << 8);
+        p[1] = d[2] | (d[3] << 8);
+        p[2] = d[4] | (d[5] << 8);
+        p[3] = d[6] | (d[7] << 8);
+    }
+    for (; n; n--, d += 2)
+        *p++ = d[0] | (d[1] << 8);
+}
+
+/* len bytes at the ring tail, also across the wrap. the bytes stay in the
+   ring, release them once the packet is out. */
+static inline void usbd_pma_write_ring(uint16_t addr, const ring_struct *r, uint16_t len)
+{
+    uint16_t tail = r->tail & r->mask;
+    uint16_t first = ring_size(r) - tail;
+
+    /* head is read before the data it covers */
+    RING_BARRIER();
+    if (first >= len) {
+        usbd_pma_write(addr, r->buf + tail, len);
+        return;
+    }
+
+    usbd_pma_write(addr, r->buf + tail, first & ~1U);
+    addr += first & ~1U;
+    if (first & 1U) {
+        /* one halfword takes the last and the first byte of the storage */
+        USBD_PMA_WORD(addr) = r->buf[r->mask] | (r->buf[0] << 8);
+        usbd_pma_write(addr + 2U, r->buf + 1, len - first - 1U);
+    } else {
+        usbd_pma_write(addr, r->buf, len - first);
+    }
+}
+
+/* hand len bytes in the tx buffer of an endpoint to the host */
+static inline void usbd_pma_tx_valid(uint8_t ep_num, uint16_t len)
+{
+    uint32_t v;
+
+    USBD_TX_COUNT(ep_num) = len;
+    v = USBD_EPCS(ep_num) & (USBD_EPCS_KEEP | USBD_EPCS_TX_STAT);
+    USBD_EPCS(ep_num) = (v ^ USBD_EPCS_TX_VALID) | USBD_EPCS_CTR;
+}
+
+/* send one packet of len bytes the caller put in the tx buffer, in place of
+   usbd_ep_tx. this relies on the driver: its in transfer complete handler
+   adds the packet to trs_count and calls the class data handler once
+   trs_count reaches trs_len, so both are set to one packet here. single
+   buffered endpoints only, the tx buffer is the one of the descriptor table. */
+static inline void usbd_pma_ep_tx(void *pudev, uint8_t ep_num, uint16_t len)
+{
+    usb_ep_struct *ep = &((usbd_core_handle_struct *)pudev)->in_ep[ep_num];
+
+    ep->trs_len = len;
+    ep->trs_count = 0;
+    usbd_pma_tx_valid(ep_num, len);
+}
+
+#endif  /* USBD_PMA_H */
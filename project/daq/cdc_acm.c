@@ -0,0 +1,500 @@
+#include "cdc_acm.h"
+#include "usbd_int.h"
+#include "usbd_pma.h"
+#include "daq.h"
+
+#define USBD_VID                          0x28E9
+#define USBD_PID                          0x018A
+
+typedef struct
+{
+    uint32_t dwDTERate;   /* data terminal rate */
+    uint8_t  bCharFormat; /* stop bits */
+    uint8_t  bParityType; /* parity */
+    uint8_t  bDataBits;   /* data bits */
+}line_coding_struct;
+
+static uint32_t cdc_cmd = NO_CMD;
+static __IO uint32_t cdc_altset = 0;
+
+uint8_t usb_cmd_buffer[CDC_ACM_CMD_PACKET_SIZE];
+static uint8_t out_packet[CDC_ACM_DATA_PACKET_SIZE];
+
+static line_coding_struct linecoding =
+{
+    DAQ_SAMPLE_RATE,    /* scans per second */
+    0x00,               /* stop bits - 1 */
+    0x00,               /* parity - none */
+    0x08                /* num of bits 8 */
+};
+
+static uint16_t line_state = 0;             // DTR bit 0, RTS bit 1
+
+void *cdc_pudev = NULL;
+
+// the frame on the IN endpoint, sent packet by packet from its samples.
+static volatile uint8_t in_busy = 0;
+static const volatile uint16_t *in_src;
+static uint16_t in_seq;
+static uint8_t in_flags;
+static uint16_t in_scans;
+static uint16_t in_size;
+static uint16_t in_offset;                  // frame bytes handed to the endpoint
+static uint16_t in_last;                    // last packet, a full one ends with a zlp
+static uint8_t in_cut = 0;                  // OVERRUN, and START if dropped, for the next frame
+
+static daq_stats_struct daq_stats_reply;
+static daq_trigger_struct daq_trigger_buffer;
+
+usbd_int_cb_struct *usbd_int_fops = NULL;
+
+/* note:it should use the C99 standard when compiling the below codes */
+/* USB standard device descriptor */
+const usb_descriptor_device_struct device_descriptor =
+{
+    .Header =
+     {
+         .bLength = USB_DEVICE_DESC_SIZE,
+         .bDescriptorType = USB_DESCTYPE_DEVICE
+     },
+    .bcdUSB = 0x0200,
+    .bDeviceClass = 0x02,
+    .bDeviceSubClass = 0x00,
+    .bDeviceProtocol = 0x00,
+    .bMaxPacketSize0 = USBD_EP0_MAX_SIZE,
+    .idVendor = USBD_VID,
+    .idProduct = USBD_PID,
+    .bcdDevice = 0x0100,
+    .iManufacturer = USBD_MFC_STR_IDX,
+    .iProduct = USBD_PRODUCT_STR_IDX,
+    .iSerialNumber = USBD_SERIAL_STR_IDX,
+    .bNumberConfigurations = USBD_CFG_MAX_NUM
+};
+
+/* USB device configuration descriptor */
+const usb_descriptor_configuration_set_struct configuration_descriptor =
+{
+    .config =
+    {
+        .Header =
+         {
+            .bLength = sizeof(usb_descriptor_configuration_struct),
+            .bDescriptorType = USB_DESCTYPE_CONFIGURATION
+         },
+        .wTotalLength = USB_CDC_ACM_CONFIG_DESC_SIZE,
+        .bNumInterfaces = 0x02,
+        .bConfigurationValue = 0x01,
+        .iConfiguration = 0x00,
+        .bmAttributes = 0x80,
+        .bMaxPower = 0x32
+    },
+
+    .cmd_interface =
+    {
+        .Header =
+         {
+             .bLength = sizeof(usb_descriptor_interface_struct),
+             .bDescriptorType = USB_DESCTYPE_INTERFACE
+         },
+        .bInterfaceNumber = 0x00,
+        .bAlternateSetting = 0x00,
+        .bNumEndpoints = 0x01,
+        .bInterfaceClass = 0x02,
+        .bInterfaceSubClass = 0x02,
+        .bInterfaceProtocol = 0x01,
+        .iInterface = 0x00
+    },
+
+    .header =
+    {
+        .Header =
+         {
+            .bLength = sizeof(usb_descriptor_header_function_struct),
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
+         },
+        .bDescriptorSubtype = 0x00,
+        .bcdCDC = 0x0110
+    },
+
+    .call_managment =
+    {
+        .Header =
+         {
+            .bLength = sizeof(usb_descriptor_call_managment_function_struct),
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
+         },
+        .bDescriptorSubtype = 0x01,
+        .bmCapabilities = 0x00,
+        .bDataInterface = 0x01
+    },
+
+    .acm =
+    {
+        .Header =
+         {
+            .bLength = sizeof(usb_descriptor_acm_function_struct),
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
+         },
+        .bDescriptorSubtype = 0x02,
+        .bmCapabilities = 0x02,
+    },
+
+    .union_function =
+    {
+        .Header =
+         {
+            .bLength = sizeof(usb_descriptor_union_function_struct),
+            .bDescriptorType = USB_DESCTYPE_CS_INTERFACE
+         },
+        .bDescriptorSubtype = 0x06,
+        .bMasterInterface = 0x00,
+        .bSlaveInterface0 = 0x01,
+    },
+
+    .cmd_endpoint =
+    {
+        .Header =
+         {
+            .bLength = sizeof(usb_descriptor_endpoint_struct),
+            .bDescriptorType = USB_DESCTYPE_ENDPOINT
+         },
+        .bEndpointAddress = CDC_ACM_CMD_EP,
+        .bmAttributes = 0x03,
+        .wMaxPacketSize = CDC_ACM_CMD_PACKET_SIZE,
+        .bInterval = 0x0A
+    },
+
+    .data_interface =
+    {
+        .Header =
+         {
+            .bLength = sizeof(usb_descriptor_interface_struct),
+            .bDescriptorType = USB_DESCTYPE_INTERFACE
+         },
+        .bInterfaceNumber = 0x01,
+        .bAlternateSetting = 0x00,
+        .bNumEndpoints = 0x02,
+        .bInterfaceClass = 0x0A,
+        .bInterfaceSubClass = 0x00,
+        .bInterfaceProtocol = 0x00,
+        .iInterface = 0x00
+    },
+
+    .out_endpoint =
+    {
+        .Header =
+         {
+             .bLength = sizeof(usb_descriptor_endpoint_struct),
+             .bDescriptorType = USB_DESCTYPE_ENDPOINT
+         },
+        .bEndpointAddress = CDC_ACM_DATA_OUT_EP,
+        .bmAttributes = 0x02,
+        .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE,
+        .bInterval = 0x00
+    },
+
+    .in_endpoint =
+    {
+        .Header =
+         {
+             .bLength = sizeof(usb_descriptor_endpoint_struct),
+             .bDescriptorType = USB_DESCTYPE_ENDPOINT
+         },
+        .bEndpointAddress = CDC_ACM_DATA_IN_EP,
+        .bmAttributes = 0x02,
+        .wMaxPacketSize = CDC_ACM_DATA_PACKET_SIZE,
+        .bInterval = 0x00
+    }
+};
+
+/* USB language ID Descriptor */
+const usb_descriptor_language_id_struct usbd_language_id_desc =
+{
+    .Header =
+     {
+         .bLength = sizeof(usb_descriptor_language_id_struct),
+         .bDescriptorType = USB_DESCTYPE_STRING
+     },
+    .wLANGID = ENG_LANGID
+};
+
+void *const usbd_strings[] =
+{
+    [USBD_LANGID_STR_IDX] = (uint8_t *)&usbd_language_id_desc,
+    [USBD_MFC_STR_IDX] = USBD_STRING_DESC("GigaDevice"),
+    [USBD_PRODUCT_STR_IDX] = USBD_STRING_DESC("GD32 USB ADC stream in FS Mode"),
+    [USBD_SERIAL_STR_IDX] = USBD_STRING_DESC("GD32F1x0-3.0.0-7z8x9yer")
+};
+
+void cdc_acm_in_start(void *pudev);
+
+// one packet of the frame, from the samples straight to packet memory. the
+// header takes the first 8 bytes of the first packet. the driver still tracks
+// the transfer, so its completion reaches cdc_acm_data_handler.
+void cdc_acm_in_packet(void *pudev)
+{
+    uint8_t ep_num = CDC_ACM_DATA_IN_EP & 0x7F;
+    uint16_t addr = USBD_TX_ADDR(ep_num);
+    uint16_t len = in_size - in_offset;
+    uint16_t head = 0;
+
+    if (len > CDC_ACM_DATA_PACKET_SIZE)
+        len = CDC_ACM_DATA_PACKET_SIZE;
+
+    if (in_offset == 0) {
+        USBD_PMA_WORD(addr) = ADC_FRAME_SYNC0 | ADC_FRAME_SYNC1 << 8;
+        USBD_PMA_WORD(addr + 2U) = in_seq;
+        USBD_PMA_WORD(addr + 4U) = DAQ_CHANNEL_MASK | (DAQ_FRAME_FLAGS | in_flags | in_cut) << 8;
+        USBD_PMA_WORD(addr + 6U) = in_scans;
+        head = ADC_FRAME_HEADER;
+    }
+    usbd_pma_write(addr + head, (const uint8_t *)in_src + in_offset + head - ADC_FRAME_HEADER,
+        len - head);
+
+    // dma got there first, what is in packet memory may be newer. the frame
+    // ends early and the host drops it, the next one says it was us.
+    if (!daq_frame_valid(in_src, in_seq)) {
+        in_cut = ADC_FRAME_OVERRUN;
+        if (in_offset == 0) {
+            in_cut |= in_flags & ADC_FRAME_START;
+            in_busy = 0;
+            daq_release();
+            cdc_acm_in_start(pudev);
+            return;
+        }
+        in_offset = in_size;
+        in_last = 0;
+        usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, 0, 0);
+        return;
+    }
+    if (in_offset == 0)
+        in_cut = 0;
+
+    usbd_pma_ep_tx(pudev, ep_num, len);
+    in_offset += len;
+    in_last = len;
+}
+
+// send the next frame once the endpoint is idle.
+void cdc_acm_in_start(void *pudev)
+{
+    if (in_busy == 1 || ((usbd_core_handle_struct *)pudev)->status != USBD_CONFIGURED)
+        return;
+
+    in_src = daq_take(&in_seq, &in_flags, &in_scans);
+    if (in_src == NULL)
+        return;
+
+    in_busy = 1;
+    in_size = ADC_FRAME_RAW_SIZE(in_scans * DAQ_CHANNELS);
+    in_offset = 0;
+    cdc_acm_in_packet(pudev);
+}
+
+void cdc_acm_daq_ready(void)
+{
+    if (cdc_pudev != NULL)
+        cdc_acm_in_start(cdc_pudev);
+}
+
+void cdc_acm_data_in(void *pudev)
+{
+    if (in_busy == 0)
+        return;
+
+    if (in_offset < in_size) {
+        cdc_acm_in_packet(pudev);
+        return;
+    }
+    // a full packet does not end the transfer, close it with a zlp.
+    if (in_last == CDC_ACM_DATA_PACKET_SIZE) {
+        in_last = 0;
+        usbd_ep_tx(pudev, CDC_ACM_DATA_IN_EP, 0, 0);
+        return;
+    }
+
+    in_busy = 0;
+    daq_release();
+    cdc_acm_in_start(pudev);
+}
+
+// the stream runs while DTR is set, a new line coding restarts it.
+void cdc_acm_daq_update(void)
+{
+    uint32_t rate = linecoding.dwDTERate;
+
+    if (!(line_state & 0x01)) {
+        daq_stop();
+        return;
+    }
+    if (rate < DAQ_RATE_MIN || rate > DAQ_RATE_MAX)
+        rate = DAQ_SAMPLE_RATE;
+    daq_start(rate);
+}
+
+usbd_status_enum cdc_acm_init(void *pudev, uint8_t config_index)
+{
+    cdc_pudev = pudev;
+
+    // packets are written to packet memory directly, that needs a single buffer.
+    usbd_ep_init(pudev, ENDP_SNG_BUF, &configuration_descriptor.in_endpoint);
+    usbd_ep_init(pudev, ENDP_SNG_BUF, &configuration_descriptor.out_endpoint);
+    usbd_ep_init(pudev, ENDP_SNG_BUF, &configuration_descriptor.cmd_endpoint);
+
+    // a transfer cut off by a bus reset never completes.
+    if (in_busy == 1) {
+        in_busy = 0;
+        daq_release();
+    }
+    usbd_ep_rx(pudev, CDC_ACM_DATA_OUT_EP, out_packet, CDC_ACM_DATA_PACKET_SIZE);
+    return USBD_OK;
+}
+
+usbd_status_enum cdc_acm_deinit(void *pudev, uint8_t config_index)
+{
+    line_state = 0;
+    cdc_acm_daq_update();
+
+    usbd_ep_deinit(pudev, CDC_ACM_DATA_IN_EP);
+    usbd_ep_deinit(pudev, CDC_ACM_DATA_OUT_EP);
+    usbd_ep_deinit(pudev, CDC_ACM_CMD_EP);
+    return USBD_OK;
+}
+
+usbd_status_enum cdc_acm_data_handler(void *pudev, usbd_dir_enum rx_tx, uint8_t ep_id)
+{
+    if ((USBD_RX == rx_tx) && ((EP0_OUT & 0x7FU) == ep_id)) {
+        if (NO_CMD == cdc_cmd)
+            return USBD_OK;
+        if (DAQ_VENDOR_SET_TRIGGER == cdc_cmd) {
+            cdc_cmd = NO_CMD;
+            daq_trigger_set(&daq_trigger_buffer);
+            return USBD_OK;
+        }
+        linecoding.dwDTERate = usb_cmd_buffer[0];
+        linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[1] << 8;
+        linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[2] << 16;
+        linecoding.dwDTERate |= (uint32_t)usb_cmd_buffer[3] << 24;
+        linecoding.bCharFormat = usb_cmd_buffer[4];
+        linecoding.bParityType = usb_cmd_buffer[5];
+        linecoding.bDataBits = usb_cmd_buffer[6];
+        cdc_cmd = NO_CMD;
+        cdc_acm_daq_update();
+        return USBD_OK;
+    }
+
+    if ((USBD_TX == rx_tx) && ((CDC_ACM_DATA_IN_EP & 0x7F) == ep_id)) {
+        cdc_acm_data_in(pudev);
+        return USBD_OK;
+    } else if ((USBD_RX == rx_tx) && ((CDC_ACM_DATA_OUT_EP & 0x7FU) == ep_id)) {
+        // nothing to send the device, the data is dropped.
+        usbd_ep_rx(pudev, CDC_ACM_DATA_OUT_EP, out_packet, CDC_ACM_DATA_PACKET_SIZE);
+        return USBD_OK;
+    }
+    return USBD_FAIL;
+}
+
+usbd_status_enum cdc_acm_req_handler(void *pudev, usb_device_req_struct *req)
+{
+    switch (req->bmRequestType & USB_REQ_MASK) {
+    case USB_CLASS_REQ:
+        switch (req->bRequest) {
+        case SET_LINE_CODING:
+            cdc_cmd = req->bRequest;
+            usbd_ep_rx(pudev, EP0_OUT, usb_cmd_buffer, req->wLength);
+            break;
+        case GET_LINE_CODING:
+            usb_cmd_buffer[0] = linecoding.dwDTERate;
+            usb_cmd_buffer[1] = linecoding.dwDTERate >> 8;
+            usb_cmd_buffer[2] = linecoding.dwDTERate >> 16;
+            usb_cmd_buffer[3] = linecoding.dwDTERate >> 24;
+            usb_cmd_buffer[4] = linecoding.bCharFormat;
+            usb_cmd_buffer[5] = linecoding.bParityType;
+            usb_cmd_buffer[6] = linecoding.bDataBits;
+            usbd_ep_tx(pudev, EP0_IN, usb_cmd_buffer, req->wLength);
+            break;
+        case SET_CONTROL_LINE_STATE: {
+            uint16_t changed = line_state ^ req->wValue;
+
+            line_state = req->wValue;
+            if (changed & 0x01)
+                cdc_acm_daq_update();
+            break; }
+        default:
+            break;
+        }
+        break;
+
+    case USB_VENDOR_REQ:
+        switch (req->bRequest) {
+        case DAQ_VENDOR_GET_STATS:
+            if (!(req->bmRequestType & 0x80)) {
+                usbd_enum_error(pudev, req);
+                break;
+            }
+            daq_stats_get(&daq_stats_reply, req->wValue == 1);
+            usbd_ep_tx(pudev, EP0_IN, (uint8_t *)&daq_stats_reply,
+                MIN(sizeof(daq_stats_reply), req->wLength));
+            break;
+        case DAQ_VENDOR_SET_TRIGGER:
+            if ((req->bmRequestType & 0x80) || req->wLength != sizeof(daq_trigger_buffer)) {
+                usbd_enum_error(pudev, req);
+                break;
+            }
+            cdc_cmd = req->bRequest;
+            usbd_ep_rx(pudev, EP0_OUT, (uint8_t *)&daq_trigger_buffer, req->wLength);
+            break;
+        case DAQ_VENDOR_GET_TRIGGER:
+            if (!(req->bmRequestType & 0x80)) {
+                usbd_enum_error(pudev, req);
+                break;
+            }
+            daq_trigger_get(&daq_trigger_buffer);
+            usbd_ep_tx(pudev, EP0_IN, (uint8_t *)&daq_trigger_buffer,
+                MIN(sizeof(daq_trigger_buffer), req->wLength));
+            break;
+        default:
+            usbd_enum_error(pudev, req);
+            break;
+        }
+        break;
+
+    case USB_STANDARD_REQ:
+        /* standard device request */
+        switch(req->bRequest) {
+        case USBREQ_GET_INTERFACE: {
+            usbd_ep_tx(pudev, EP0_IN, (uint8_t *)&cdc_altset, 1);
+            break; }
+
+        case USBREQ_SET_INTERFACE: {
+            if ((uint8_t)(req->wValue) < USBD_ITF_MAX_NUM) {
+                cdc_altset = req->wValue;
+            } else {
+                /* call the error management function (command will be nacked */
+                usbd_enum_error(pudev, req);
+            }
+            break; }
+
+        case USBREQ_GET_DESCRIPTOR: {
+            uint16_t len = CDC_ACM_DESC_SIZE;
+            uint8_t  *pbuf= (uint8_t*)(&configuration_descriptor) + 9;
+
+            if (CDC_ACM_DESC_TYPE == (req->wValue >> 8)) {
+                len = MIN(CDC_ACM_DESC_SIZE, req->wLength);
+                pbuf = (uint8_t*)(&configuration_descriptor) + 9 + (9 * USBD_ITF_MAX_NUM);
+            }
+            usbd_ep_tx(pudev, EP0_IN, pbuf, len);
+            break; }
+
+        default:
+            break;
+        }
+        break;
+
+    default:
+        usbd_enum_error(pudev, req);
+        break;
+    }
+
+    return USBD_OK;
+}
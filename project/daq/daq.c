@@ -0,0 +1,510 @@
+#include "daq.h"
+
+#define DAQ_TRIG_IDLE                      0       // plain stream, or stopped
+#define DAQ_TRIG_ARMED                     1
+#define DAQ_TRIG_FIRED                     2       // waiting for the post scans
+#define DAQ_TRIG_HELD                      3       // the window waits for the IN endpoint
+
+volatile uint16_t daq_buf[2][DAQ_BLOCK_SAMPLES];
+volatile uint32_t daq_overrun = 0;          // blocks or frames nobody took in time
+
+static volatile int8_t daq_ready = -1;      // half that is complete, -1 none
+static volatile uint16_t daq_ready_seq = 0;
+static volatile uint16_t daq_seq = 0;       // blocks completed, goes on across restarts
+static volatile uint8_t daq_flags = 0;      // START and OVERRUN of the next block
+static uint32_t daq_rate = DAQ_SAMPLE_RATE;
+static daq_stats_struct daq_stats;
+
+#ifndef DAQ_DSP
+// the trigger of the next arm and the one of the running stream. armed, the
+// ring runs until the window around the trigger is complete, then it holds
+// until the IN endpoint sent the window.
+static daq_trigger_struct daq_trig = { DAQ_TRIG_OFF, 0, 0x800, 0xfff,
+    DAQ_BLOCK_SCANS / 2, DAQ_BLOCK_SCANS / 2 };
+static daq_trigger_struct daq_trig_run;
+static volatile uint8_t daq_trig_state = DAQ_TRIG_IDLE;
+static uint32_t daq_trig_blocks;            // completed since the arm
+static uint32_t daq_trig_at;                // scan of the trigger, counted from the arm
+static uint16_t daq_trig_last;              // last sample of the previous block
+static uint16_t daq_trig_seq = 0;           // windows sent
+static volatile uint8_t daq_trig_taken;
+#endif
+
+#ifdef DAQ_DSP
+// one chain per channel, its output scans are collected in the fill buffer.
+// the other one may be queued for the IN endpoint until it is released.
+static dsp_chain_struct daq_chain[DAQ_CHANNELS];
+static volatile uint16_t daq_out[2][DAQ_FRAME_SAMPLES];
+static uint8_t daq_out_fill = 0;
+static uint16_t daq_out_scans = 0;
+static uint16_t daq_out_seq = 0;            // frames made, a dropped one is a gap
+static uint8_t daq_out_flags = 0;
+static volatile int8_t daq_out_queued = -1;
+static volatile uint8_t daq_out_taken = 0;
+static volatile uint16_t daq_queued_seq;
+static volatile uint8_t daq_queued_flags;
+#endif
+
+void daq_init(void)
+{
+    timer_parameter_struct timer_initpara;
+    uint8_t i;
+
+    for (i = 0; i < DAQ_CHANNELS; i++)
+        gpio_mode_set(GPIOA, GPIO_MODE_ANALOG, GPIO_PUPD_NONE, GPIO_PIN_0 << i);
+
+    // one trigger converts all channels in rank order, no cpu per sample.
+    adc_special_function_config(ADC_SCAN_MODE, ENABLE);
+    adc_special_function_config(ADC_CONTINUOUS_MODE, DISABLE);
+    adc_data_alignment_config(ADC_DATAALIGN_RIGHT);
+    adc_channel_length_config(ADC_REGULAR_CHANNEL, DAQ_CHANNELS);
+    for (i = 0; i < DAQ_CHANNELS; i++)
+        adc_regular_channel_config(i, i, DAQ_SAMPLETIME);
+    adc_external_trigger_source_config(ADC_REGULAR_CHANNEL, ADC_EXTTRIG_REGULAR_T2_TRGO);
+    adc_external_trigger_config(ADC_REGULAR_CHANNEL, ENABLE);
+    adc_dma_mode_enable();
+    adc_enable();
+    adc_calibration_enable();
+
+    // core clock ticks, the period is set by daq_start.
+    timer_deinit(TIMER2);
+    timer_initpara.prescaler = 0;
+    timer_initpara.alignedmode = TIMER_COUNTER_EDGE;
+    timer_initpara.counterdirection = TIMER_COUNTER_UP;
+    timer_initpara.period = SystemCoreClock / DAQ_SAMPLE_RATE - 1;
+    timer_initpara.clockdivision = TIMER_CKDIV_DIV1;
+    timer_initpara.repetitioncounter = 0;
+    timer_init(TIMER2, &timer_initpara);
+    timer_master_output_trigger_source_select(TIMER2, TIMER_TRI_OUT_SRC_UPDATE);
+}
+
+#ifndef DAQ_DSP
+// level and window triggers are compared by the analog watchdog on every
+// conversion, its interrupt is enabled once a block of history is in.
+static void daq_trig_arm(void)
+{
+    daq_trig_run = daq_trig;
+    daq_trig_blocks = 0;
+    daq_trig_taken = 0;
+    if (daq_trig_run.mode == DAQ_TRIG_OFF) {
+        daq_trig_state = DAQ_TRIG_IDLE;
+        return;
+    }
+
+    if (daq_trig_run.mode == DAQ_TRIG_ABOVE)
+        adc_watchdog_threshold_config(0, daq_trig_run.level);
+    else if (daq_trig_run.mode == DAQ_TRIG_BELOW)
+        adc_watchdog_threshold_config(daq_trig_run.level, 0xfff);
+    else if (daq_trig_run.mode == DAQ_TRIG_OUTSIDE)
+        adc_watchdog_threshold_config(daq_trig_run.level, daq_trig_run.high);
+    if (daq_trig_run.mode >= DAQ_TRIG_ABOVE)
+        adc_watchdog_single_channel_enable(daq_trig_run.channel);
+    daq_trig_state = DAQ_TRIG_ARMED;
+}
+#endif
+
+// dma and the trigger timer from block 0 on, at daq_rate.
+static void daq_run(void)
+{
+    dma_parameter_struct dma_init_struct;
+
+    dma_deinit(DMA_CH0);
+    dma_init_struct.direction = DMA_PERIPHERAL_TO_MEMORY;
+    dma_init_struct.memory_addr = (uint32_t)daq_buf;
+    dma_init_struct.memory_inc = DMA_MEMORY_INCREASE_ENABLE;
+    dma_init_struct.memory_width = DMA_MEMORY_WIDTH_16BIT;
+    dma_init_struct.number = 2 * DAQ_BLOCK_SAMPLES;
+    dma_init_struct.periph_addr = (uint32_t)&ADC_RDATA;
+    dma_init_struct.periph_inc = DMA_PERIPH_INCREASE_DISABLE;
+    dma_init_struct.periph_width = DMA_PERIPHERAL_WIDTH_16BIT;
+    dma_init_struct.priority = DMA_PRIORITY_HIGH;
+    dma_init(DMA_CH0, dma_init_struct);
+    dma_circulation_enable(DMA_CH0);
+    dma_interrupt_enable(DMA_CH0, DMA_INT_HTF);
+    dma_interrupt_enable(DMA_CH0, DMA_INT_FTF);
+    dma_channel_enable(DMA_CH0);
+
+    daq_ready = -1;
+#ifndef DAQ_DSP
+    daq_trig_arm();
+#endif
+    timer_autoreload_value_config(TIMER2, SystemCoreClock / daq_rate - 1);
+    timer_counter_value_config(TIMER2, 0);
+    timer_enable(TIMER2);
+}
+
+void daq_start(uint32_t rate)
+{
+    daq_stop();
+    daq_flags = ADC_FRAME_START;
+    daq_rate = rate;
+    daq_run();
+}
+
+// a scan that is still converting lands in the stopped dma, nothing waits for it.
+void daq_stop(void)
+{
+    timer_disable(TIMER2);
+    dma_channel_disable(DMA_CH0);
+    adc_interrupt_disable(ADC_INT_WDE);
+    adc_watchdog_disable();
+    daq_ready = -1;
+#ifndef DAQ_DSP
+    daq_trig_state = DAQ_TRIG_IDLE;
+#endif
+}
+
+static uint8_t daq_block_valid(uint8_t half, uint16_t seq)
+{
+    // dma is back in the half once the next block is complete, or a restart
+    // began there. the pending flag of that block may not be served yet.
+    uint32_t pos = 2 * DAQ_BLOCK_SAMPLES - dma_transfer_number_get(DMA_CH0);
+
+    return (uint16_t)(daq_seq - seq) == 1 && pos / DAQ_BLOCK_SAMPLES != half;
+}
+
+#ifndef DAQ_DSP
+int8_t daq_trigger_set(const daq_trigger_struct *t)
+{
+    if (t->mode > DAQ_TRIG_OUTSIDE || t->channel >= DAQ_CHANNELS ||
+        t->level > 0xfff || t->high > 0xfff || t->level > t->high ||
+        t->post == 0 || t->pre + t->post > DAQ_BLOCK_SCANS)
+        return -1;
+    daq_trig = *t;
+    return 0;
+}
+
+void daq_trigger_get(daq_trigger_struct *t)
+{
+    *t = daq_trig;
+}
+
+// runs at the USB priority, so it never cuts into the IN path.
+const volatile uint16_t *daq_take(uint16_t *seq, uint8_t *flags, uint16_t *scans)
+{
+    int8_t half = daq_ready;
+
+    if (daq_trig_state != DAQ_TRIG_IDLE) {
+        if (daq_trig_state != DAQ_TRIG_HELD || daq_trig_taken)
+            return NULL;
+        daq_trig_taken = 1;
+        *seq = daq_trig_seq++;
+        *flags = daq_flags | ADC_FRAME_TRIGGER;
+        *scans = daq_trig_run.pre + daq_trig_run.post;
+        daq_flags = 0;
+        return daq_buf[0];
+    }
+
+    if (half < 0)
+        return NULL;
+    daq_ready = -1;
+    *seq = daq_ready_seq;
+    *flags = daq_flags;
+    *scans = DAQ_BLOCK_SCANS;
+    daq_flags = 0;
+    return daq_buf[half];
+}
+
+// a window is valid until the ring is rearmed or restarted.
+uint8_t daq_frame_valid(const volatile uint16_t *s, uint16_t seq)
+{
+    if (daq_trig_state != DAQ_TRIG_IDLE)
+        return daq_trig_state == DAQ_TRIG_HELD;
+    return daq_block_valid(s == daq_buf[1], seq);
+}
+
+// a block stays where dma put it, nothing to give back. a window is out,
+// arm for the next one.
+void daq_release(void)
+{
+    if (daq_trig_state == DAQ_TRIG_HELD && daq_trig_taken) {
+        daq_stop();
+        daq_run();
+    }
+}
+
+static void daq_reverse(volatile uint16_t *p, uint32_t n)
+{
+    volatile uint16_t *q = p + n - 1;
+    uint16_t t;
+
+    while (p < q) {
+        t = *p;
+        *p++ = *q;
+        *q-- = t;
+    }
+}
+
+// rotate the ring left by n samples, three reversals, no second buffer.
+static void daq_rotate(uint32_t n)
+{
+    volatile uint16_t *p = daq_buf[0];
+
+    daq_reverse(p, n);
+    daq_reverse(p + n, 2 * DAQ_BLOCK_SAMPLES - n);
+    daq_reverse(p, 2 * DAQ_BLOCK_SAMPLES);
+}
+
+// edges are searched in the completed block, from its sample before.
+static void daq_trig_scan(uint8_t half)
+{
+    const volatile uint16_t *s = daq_buf[half] + daq_trig_run.channel;
+    uint32_t scan = daq_trig_blocks * DAQ_BLOCK_SCANS;
+    uint16_t prev = daq_trig_last, level = daq_trig_run.level, i, v;
+    uint8_t rising = daq_trig_run.mode == DAQ_TRIG_RISING;
+
+    for (i = 0; i < DAQ_BLOCK_SCANS; i++, scan++, s += DAQ_CHANNELS) {
+        v = *s;
+        if (scan >= daq_trig_run.pre && scan != 0 &&
+            (rising ? prev < level && v >= level : prev >= level && v < level)) {
+            daq_trig_at = scan;
+            daq_trig_state = DAQ_TRIG_FIRED;
+            return;
+        }
+        prev = v;
+    }
+    daq_trig_last = prev;
+}
+
+// stop the ring once the scans after the trigger are in, and move the window
+// to the start of daq_buf. dma may have begun the next block before the timer
+// stopped, that overwrote the oldest scans of the ring.
+static void daq_trig_hold(uint32_t done)
+{
+    uint32_t start = daq_trig_at - daq_trig_run.pre, pos, over;
+
+    timer_disable(TIMER2);
+    dma_channel_disable(DMA_CH0);
+    adc_interrupt_disable(ADC_INT_WDE);
+
+    pos = (2 * DAQ_BLOCK_SAMPLES - dma_transfer_number_get(DMA_CH0) + DAQ_CHANNELS - 1) / DAQ_CHANNELS;
+    over = (pos + 2 * DAQ_BLOCK_SCANS - (done / DAQ_BLOCK_SCANS & 1) * DAQ_BLOCK_SCANS) %
+        (2 * DAQ_BLOCK_SCANS);
+    if (start + 2 * DAQ_BLOCK_SCANS < done + over) {
+        // the window is cut, the next one says it was us.
+        daq_flags |= ADC_FRAME_OVERRUN;
+        daq_overrun++;
+        daq_stop();
+        daq_run();
+        return;
+    }
+
+    daq_rotate(start % (2 * DAQ_BLOCK_SCANS) * DAQ_CHANNELS);
+    daq_trig_state = DAQ_TRIG_HELD;
+    cdc_acm_daq_ready();
+}
+
+static void daq_trig_block_done(uint8_t half)
+{
+    uint32_t done;
+
+    if (daq_trig_state == DAQ_TRIG_ARMED) {
+        if (daq_trig_run.mode <= DAQ_TRIG_FALLING) {
+            daq_trig_scan(half);
+        } else if (daq_trig_blocks == 0) {
+            // a block of history is in, more than any pre window.
+            adc_interrupt_flag_clear(ADC_INT_FLAG_WDE);
+            adc_interrupt_enable(ADC_INT_WDE);
+        }
+    }
+    done = ++daq_trig_blocks * DAQ_BLOCK_SCANS;
+    if (daq_trig_state == DAQ_TRIG_FIRED && done >= daq_trig_at + daq_trig_run.post)
+        daq_trig_hold(done);
+}
+#else
+// no trigger on filtered samples.
+int8_t daq_trigger_set(const daq_trigger_struct *t)
+{
+    return t->mode == DAQ_TRIG_OFF ? 0 : -1;
+}
+
+void daq_trigger_get(daq_trigger_struct *t)
+{
+    t->mode = DAQ_TRIG_OFF;
+    t->channel = t->level = t->high = t->pre = t->post = 0;
+}
+
+const volatile uint16_t *daq_take(uint16_t *seq, uint8_t *flags, uint16_t *scans)
+{
+    if (daq_out_queued < 0 || daq_out_taken)
+        return NULL;
+    daq_out_taken = 1;
+    *seq = daq_queued_seq;
+    *flags = daq_queued_flags;
+    *scans = DAQ_FRAME_SCANS;
+    return daq_out[daq_out_queued];
+}
+
+// filtered frames stay put until they are released.
+uint8_t daq_frame_valid(const volatile uint16_t *s, uint16_t seq)
+{
+    return 1;
+}
+
+void daq_release(void)
+{
+    daq_out_queued = -1;
+    daq_out_taken = 0;
+}
+
+uint8_t daq_pending(void)
+{
+    return daq_ready >= 0;
+}
+
+static void daq_dsp_reset(void)
+{
+    static const int16_t q[5] = { DAQ_DSP_BIQUAD };
+    uint8_t c;
+
+    for (c = 0; c < DAQ_CHANNELS; c++) {
+        dsp_average_init(&daq_chain[c].avg, DAQ_DSP_AVERAGE_SHIFT);
+        dsp_cic_init(&daq_chain[c].cic, DAQ_DSP_CIC_ORDER, DAQ_DSP_CIC_SHIFT);
+        dsp_biquad_init(&daq_chain[c].iir, q[0], q[1], q[2], q[3], q[4]);
+    }
+    daq_out_scans = 0;
+    daq_out_flags = ADC_FRAME_START;
+}
+
+// hand the fill buffer to the IN endpoint, or drop it if the last one is
+// still there.
+static void daq_out_publish(void)
+{
+    daq_out_scans = 0;
+    __disable_irq();
+    if (daq_out_queued >= 0) {
+        daq_out_flags |= ADC_FRAME_OVERRUN;
+        daq_overrun++;
+    } else {
+        daq_out_queued = daq_out_fill;
+        daq_queued_seq = daq_out_seq;
+        daq_queued_flags = daq_out_flags;
+        daq_out_flags = 0;
+        daq_out_fill ^= 1;
+        cdc_acm_daq_ready();
+    }
+    daq_out_seq++;
+    __enable_irq();
+}
+
+// filter the complete block, main loop. it has one block time before dma is
+// back, a block that changed under the filters flags the frame overrun.
+void daq_poll(void)
+{
+    volatile uint16_t *s;
+    uint16_t seq, i, v;
+    uint8_t c, flags, out;
+    int8_t half;
+    uint32_t t;
+
+    __disable_irq();
+    half = daq_ready;
+    seq = daq_ready_seq;
+    flags = daq_flags;
+    daq_ready = -1;
+    daq_flags = 0;
+    __enable_irq();
+    if (half < 0)
+        return;
+
+    if (flags & ADC_FRAME_START)
+        daq_dsp_reset();
+    daq_out_flags |= flags & ADC_FRAME_OVERRUN;
+
+    t = dwt_cycles();
+    s = daq_buf[half];
+    for (i = 0; i < DAQ_BLOCK_SCANS; i++, s += DAQ_CHANNELS) {
+        out = 0;
+        for (c = 0; c < DAQ_CHANNELS; c++) {
+            if (dsp_chain_put(&daq_chain[c], s[c], &v)) {
+                daq_out[daq_out_fill][daq_out_scans * DAQ_CHANNELS + c] = v;
+                out = 1;
+            }
+        }
+        if (out && ++daq_out_scans == DAQ_FRAME_SCANS)
+            daq_out_publish();
+    }
+    __disable_irq();
+    dwt_stat_add(&daq_stats.dsp, t);
+    if (!daq_block_valid(half, seq))
+        daq_out_flags |= ADC_FRAME_OVERRUN;
+    __enable_irq();
+}
+#endif
+
+static void daq_block_done(uint8_t half)
+{
+#ifndef DAQ_DSP
+    if (daq_trig_state != DAQ_TRIG_IDLE) {
+        daq_trig_block_done(half);
+        return;
+    }
+#endif
+    // the previous block was not taken, dma is already writing over it.
+    if (daq_ready >= 0) {
+        daq_flags |= ADC_FRAME_OVERRUN;
+        daq_overrun++;
+    }
+    daq_ready = half;
+    daq_ready_seq = daq_seq++;
+#ifndef DAQ_DSP
+    cdc_acm_daq_ready();
+#endif
+}
+
+void daq_dma_isr(void)
+{
+    // half transfer completes block 0, full transfer block 1.
+    if (RESET != dma_interrupt_flag_get(DMA_CH0, DMA_INT_FLAG_HTF)) {
+        dma_interrupt_flag_clear(DMA_CH0, DMA_INT_FLAG_HTF);
+        daq_block_done(0);
+    }
+    if (RESET != dma_interrupt_flag_get(DMA_CH0, DMA_INT_FLAG_FTF)) {
+        dma_interrupt_flag_clear(DMA_CH0, DMA_INT_FLAG_FTF);
+        daq_block_done(1);
+    }
+}
+
+// the watchdog saw the trigger channel out of its window. the scan is in the
+// ring or about to be, it is taken from the dma position, a block whose flag
+// is not served yet counts too.
+void daq_adc_isr(void)
+{
+#ifndef DAQ_DSP
+    uint32_t pos, off;
+#endif
+
+    if (RESET == adc_interrupt_flag_get(ADC_INT_FLAG_WDE))
+        return;
+    adc_interrupt_flag_clear(ADC_INT_FLAG_WDE);
+    adc_interrupt_disable(ADC_INT_WDE);
+#ifndef DAQ_DSP
+    if (daq_trig_state != DAQ_TRIG_ARMED)
+        return;
+    pos = (2 * DAQ_BLOCK_SAMPLES - dma_transfer_number_get(DMA_CH0) + DAQ_CHANNELS - 1) / DAQ_CHANNELS;
+    off = (pos + 2 * DAQ_BLOCK_SCANS - (daq_trig_blocks & 1) * DAQ_BLOCK_SCANS) % (2 * DAQ_BLOCK_SCANS);
+    daq_trig_at = daq_trig_blocks * DAQ_BLOCK_SCANS + off - 1;
+    daq_trig_state = DAQ_TRIG_FIRED;
+#endif
+}
+
+void daq_stats_get(daq_stats_struct *s, uint8_t clear)
+{
+    daq_stats.core_hz = SystemCoreClock;
+    daq_stats.rate = daq_rate;
+    daq_stats.channels = DAQ_CHANNELS;
+    daq_stats.block_samples = DAQ_BLOCK_SAMPLES;
+#ifdef DAQ_DSP
+    daq_stats.decimation = 1U << DAQ_DSP_CIC_SHIFT;
+#else
+    daq_stats.decimation = 1;
+#endif
+    daq_stats.overrun = daq_overrun;
+    *s = daq_stats;
+    if (clear) {
+        daq_stats.dsp.count = 0;
+        daq_stats.dsp.cycles = 0;
+        daq_stats.dsp.max = 0;
+        daq_overrun = 0;
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef DAQ_H
+#define DAQ_H
+
+#include "usbd_conf.h"
+#include "adc_frame.h"
+#include "dwt.h"
+#ifdef DAQ_DSP
+#include "dsp.h"
+#endif
+
+#define DAQ_BLOCK_SAMPLES                  (DAQ_BLOCK_SCANS * DAQ_CHANNELS)
+#define DAQ_CHANNEL_MASK                   ((1U << DAQ_CHANNELS) - 1U)
+
+/* a frame is a dma block, a trigger window or DAQ_DSP_FRAME_SCANS filtered
+   scans, daq_take tells */
+#ifdef DAQ_DSP
+/* daq_dsp_reset does not look at what the init calls return, so the filter
+   settings of usbd_conf.h are checked here */
+#if DAQ_DSP_AVERAGE_SHIFT > DSP_AVERAGE_MAX_SHIFT
+#error "DAQ_DSP_AVERAGE_SHIFT is above DSP_AVERAGE_MAX_SHIFT"
+#endif
+#if DAQ_DSP_CIC_ORDER == 0 || DAQ_DSP_CIC_ORDER > DSP_CIC_MAX_ORDER
+#error "DAQ_DSP_CIC_ORDER is out of 1..DSP_CIC_MAX_ORDER"
+#endif
+#if 16 + DAQ_DSP_CIC_ORDER * DAQ_DSP_CIC_SHIFT > 32
+#error "the cic integrators overflow, lower DAQ_DSP_CIC_ORDER or DAQ_DSP_CIC_SHIFT"
+#endif
+#define DAQ_FRAME_SCANS                    DAQ_DSP_FRAME_SCANS
+#define DAQ_FRAME_FLAGS                    (ADC_FRAME_RAW | ADC_FRAME_WIDE)
+#else
+#define DAQ_FRAME_SCANS                    DAQ_BLOCK_SCANS
+#define DAQ_FRAME_FLAGS                    ADC_FRAME_RAW
+#endif
+#define DAQ_FRAME_SAMPLES                  (DAQ_FRAME_SCANS * DAQ_CHANNELS)
+
+/* vendor requests to interface 0. GET_STATS, device to host, returns
+   daq_stats_struct, wValue 1 clears the cycle counts and overruns once they
+   are read. SET_TRIGGER and GET_TRIGGER carry daq_trigger_struct, a trigger
+   that is not valid is ignored, read it back to be sure. */
+#define DAQ_VENDOR_GET_STATS               0x01
+#define DAQ_VENDOR_SET_TRIGGER             0x02
+#define DAQ_VENDOR_GET_TRIGGER             0x03
+
+/* trigger modes. edges are searched in every completed block, level and
+   window are compared by the adc analog watchdog and placed within a scan
+   or so. OFF streams every block. */
+#define DAQ_TRIG_OFF                       0
+#define DAQ_TRIG_RISING                    1       /* from below level to level or above */
+#define DAQ_TRIG_FALLING                   2
+#define DAQ_TRIG_ABOVE                     3       /* above level */
+#define DAQ_TRIG_BELOW                     4       /* below level */
+#define DAQ_TRIG_OUTSIDE                   5       /* below level or above high */
+
+/* little endian words on the wire */
+typedef struct
+{
+    uint32_t core_hz;           /* converts the cycles to time */
+    uint32_t rate;              /* scans per second */
+    uint32_t channels;
+    uint32_t block_samples;
+    uint32_t decimation;        /* 1 without DAQ_DSP */
+    uint32_t overrun;           /* blocks or frames dropped */
+    dwt_stat_struct dsp;        /* one block through the filters */
+} daq_stats_struct;
+
+/* a window of pre + post scans goes out as one TRIGGER frame, its scan pre is
+   the trigger. pre + post is up to DAQ_BLOCK_SCANS, post at least 1. */
+typedef struct
+{
+    uint16_t mode;
+    uint16_t channel;           /* 0 is PA0 */
+    uint16_t level;             /* 12 bit */
+    uint16_t high;              /* OUTSIDE only */
+    uint16_t pre;
+    uint16_t post;
+} daq_trigger_struct;
+
+extern volatile uint16_t daq_buf[2][DAQ_BLOCK_SAMPLES];
+extern volatile uint32_t daq_overrun;
+
+/* adc, dma and trigger timer setup, the stream is stopped */
+void daq_init(void);
+/* (re)start the stream at rate scans per second, block 0 is filled first */
+void daq_start(uint32_t rate);
+void daq_stop(void);
+/* the trigger of the next (re)start or window, -1 if it is not valid */
+int8_t daq_trigger_set(const daq_trigger_struct *t);
+void daq_trigger_get(daq_trigger_struct *t);
+/* the next frame for the IN endpoint with its sequence number, START,
+   OVERRUN or TRIGGER flags and scans, NULL if there is none. USB priority. */
+const volatile uint16_t *daq_take(uint16_t *seq, uint8_t *flags, uint16_t *scans);
+/* the samples of the frame are not overwritten yet */
+uint8_t daq_frame_valid(const volatile uint16_t *s, uint16_t seq);
+/* the frame taken last is out */
+void daq_release(void);
+void daq_dma_isr(void);
+void daq_adc_isr(void);
+void daq_stats_get(daq_stats_struct *s, uint8_t clear);
+#ifdef DAQ_DSP
+/* a block waits for daq_poll */
+uint8_t daq_pending(void);
+/* filter the complete block, main loop */
+void daq_poll(void);
+#endif
+
+/* a frame is ready, called with the USB isr held off */
+extern void cdc_acm_daq_ready(void);
+
+#endif  /* DAQ_H */
@@ -0,0 +1,81 @@
+#include "cdc_acm.h"
+#include "daq.h"
+#include "usbd_int.h"
+
+usbd_core_handle_struct usb_device_dev =
+{
+    .dev_desc = (uint8_t *)&device_descriptor,
+    .config_desc = (uint8_t *)&configuration_descriptor,
+    .strings = usbd_strings,
+    .class_init = cdc_acm_init,
+    .class_deinit = cdc_acm_deinit,
+    .class_req_handler = cdc_acm_req_handler,
+    .class_data_handler = cdc_acm_data_handler
+};
+
+void  USBD_LP_IRQHandler(void)
+{
+    usbd_isr();
+}
+
+void  USBD_HP_IRQHandler(void)
+{
+    usbd_isr();
+}
+
+void DMA_Channel0_IRQHandler(void)
+{
+    daq_dma_isr();
+}
+
+void ADC_CMP_IRQHandler(void)
+{
+    daq_adc_isr();
+}
+
+int main(void)
+{
+    rcu_periph_clock_enable(RCU_GPIOA);
+    rcu_periph_clock_enable(RCU_ADC);
+    rcu_periph_clock_enable(RCU_DMA);
+    rcu_periph_clock_enable(RCU_TIMER2);
+    rcu_periph_clock_enable(RCU_USBD);
+
+    rcu_usbd_clock_config(RCU_USBD_CKPLL_DIV1_5);
+    rcu_adc_clock_config(RCU_ADCCK_APB2_DIV6);
+
+    gpio_mode_set(GPIOA, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO_PIN_13);
+    gpio_output_options_set(GPIOA, GPIO_OTYPE_PP, GPIO_OSPEED_50MHZ, GPIO_PIN_13);
+    gpio_bit_set(GPIOA, GPIO_PIN_13);       // pullup.
+
+    dwt_init();
+    daq_init();
+
+    usbd_core_init(&usb_device_dev);
+    usb_device_dev.status = USBD_CONNECTED;
+
+    nvic_priority_group_set(NVIC_PRIGROUP_PRE1_SUB3);
+    nvic_irq_enable(USBD_LP_IRQn, 1, 0);
+    nvic_irq_enable(USBD_HP_IRQn, 1, 0);
+    // a complete block starts IN transfers, so same priority as USB.
+    nvic_irq_enable(DMA_Channel0_IRQn, 1, 1);
+    // the watchdog trigger is placed against the dma blocks, same as dma.
+    nvic_irq_enable(ADC_CMP_IRQn, 1, 1);
+
+#ifndef DAQ_DSP
+    // dma fills the blocks, the USB isr sends them.
+    while (1)
+        __WFI();
+#else
+    // dma fills the blocks, the filters run here and the USB isr sends what
+    // they make. a block that completes between the check and the sleep
+    // wakes the core anyway, the pending interrupt is taken once enabled.
+    while (1) {
+        __disable_irq();
+        if (!daq_pending())
+            __WFI();
+        __enable_irq();
+        daq_poll();
+    }
+#endif
+}
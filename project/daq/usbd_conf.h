@@ -0,0 +1,65 @@
+#ifndef USBD_CONF_H
+#define USBD_CONF_H
+
+#include "gd32f1x0.h"
+
+#define USBD_CFG_MAX_NUM                   1U
+#define USBD_ITF_MAX_NUM                   1U
+
+/* define if low power mode is enabled; it allows entering the device into DEEP_SLEEP mode
+   following USB suspend event and wakes up after the USB wakeup event is received. */
+//#define USB_DEVICE_LOW_PWR_MODE_SUPPORT
+
+/* USB feature -- Self Powered */
+/* #define USBD_SELF_POWERED */
+
+/* one CDC ACM function, IN streams the adc frames, OUT data is dropped */
+#define CDC_ACM_CMD_EP                     EP2_IN
+#define CDC_ACM_DATA_IN_EP                 EP1_IN
+#define CDC_ACM_DATA_OUT_EP                EP3_OUT
+
+#define CDC_ACM_CMD_PACKET_SIZE            8U
+#define CDC_ACM_DATA_PACKET_SIZE           64U
+
+/* PA0.. (ADC_IN0..) are converted as one scan per TIMER2 update, dma writes
+   the scans circularly into two blocks of DAQ_BLOCK_SCANS. a block goes out as
+   one RAW frame (core/adc_frame.h) on the IN endpoint, every packet is written
+   from the block to packet memory while dma fills the other one, so a frame
+   has to be out within one block time or it is cut off.
+   DTR starts the stream at the line coding rate in scans per second, taken if
+   it is within DAQ_RATE_MIN..DAQ_RATE_MAX, DAQ_SAMPLE_RATE otherwise. the adc
+   runs at 12 MHz, a conversion takes DAQ_SAMPLETIME + 12.5 clocks, 857 ksps
+   at 1.5. full speed bulk carries about 1 MB/s, 500 ksps of le16 samples, the
+   host sees what it lost by the frame sequence.
+   with a trigger set (daq_trigger_struct, vendor request) the ring runs until
+   the window around the trigger is in, stops and sends it as one TRIGGER
+   frame, then arms again. the window is up to DAQ_BLOCK_SCANS, the link only
+   carries the events. */
+#define DAQ_CHANNELS                       1U
+#define DAQ_SAMPLE_RATE                    250000U
+#define DAQ_RATE_MIN                       2000U
+#define DAQ_RATE_MAX                       800000U
+#define DAQ_SAMPLETIME                     ADC_SAMPLETIME_1POINT5
+#define DAQ_BLOCK_SCANS                    (512U / DAQ_CHANNELS)
+
+/* define to filter the blocks in the main loop (core/dsp.h) and stream
+   DAQ_DSP_FRAME_SCANS decimated scans per frame instead: a moving average of
+   2^DAQ_DSP_AVERAGE_SHIFT, a cic of DAQ_DSP_CIC_ORDER decimating by
+   2^DAQ_DSP_CIC_SHIFT and a Q14 biquad (b0, b1, b2, a1, a2). the default is a
+   butterworth lowpass at 0.2 of the output rate, 250 ksps become 15.6 ksps
+   of 16 bit samples. gd32up daqstats reads the cycles a block costs. */
+//#define DAQ_DSP
+#define DAQ_DSP_AVERAGE_SHIFT              0U
+#define DAQ_DSP_CIC_ORDER                  3U
+#define DAQ_DSP_CIC_SHIFT                  4U
+#define DAQ_DSP_BIQUAD                     3384, 6770, 3384, -6054, 3208
+#define DAQ_DSP_FRAME_SCANS                (256U / DAQ_CHANNELS)
+
+/* endpoint count used by the CDC ACM device */
+#define EP_COUNT                           4U
+#define USB_STRING_COUNT                   4U
+
+/* base address of the allocation buffer, used for buffer descriptor table and packet memory */
+#define BUFFER_ADDRESS                     0x0000U
+
+#endif /* USBD_CONF_H */
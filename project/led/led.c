@@ -17,6 +17,10 @@ void SysTick_Handler(void)
 
 int main(void)
 {
+#ifdef RUN_IN_RAM
+        // vector table is at the start of sram, see gd32f150g8_ram.ld.
+        nvic_vector_table_set(NVIC_VECTTAB_RAM, 0);
+#endif
         if (SysTick_Config(SystemCoreClock / 1000))
                 while (1);
         NVIC_SetPriority(SysTick_IRQn, 0x00);